@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "hash_policy.hpp"
+
+// Оценка числа различных ключей алгоритмом HyperLogLog по готовому
+// 64-битному хешу: 2^precision однобайтовых регистров, стандартная ошибка
+// около 1.04 / sqrt(2^precision) (1.6% при precision = 12, 4 KiB).
+class HyperLogLog {
+ public:
+  explicit HyperLogLog(uint8_t precision) : precision_(precision) {
+    if (precision < 4 || precision > 18) {
+      throw std::invalid_argument("HyperLogLog precision must be in [4, 18]");
+    }
+    registers_.assign(std::size_t{1} << precision, 0);
+  }
+
+  // hash должен быть перемешан (см. finalizeHash).
+  void add(uint64_t hash) {
+    std::size_t index = hash >> (64 - precision_);
+    // Стоп-бит ограничивает ранг, если остальные биты хеша нулевые.
+    uint64_t rest = (hash << precision_) | (uint64_t{1} << (precision_ - 1));
+    auto rank = static_cast<uint8_t>(std::countl_zero(rest) + 1);
+    registers_[index] = std::max(registers_[index], rank);
+  }
+
+  double estimate() const {
+    double m = static_cast<double>(registers_.size());
+    double sum = 0;
+    std::size_t zeros = 0;
+    for (uint8_t value : registers_) {
+      sum += std::ldexp(1.0, -value);
+      zeros += value == 0;
+    }
+    double alpha = 0.7213 / (1 + 1.079 / m);
+    double estimate = alpha * m * m / sum;
+    // На малых мощностях точнее linear counting по пустым регистрам.
+    if (estimate <= 2.5 * m && zeros != 0) {
+      return m * std::log(m / static_cast<double>(zeros));
+    }
+    return estimate;
+  }
+
+  void clear() { std::fill(registers_.begin(), registers_.end(), 0); }
+
+ private:
+  uint8_t precision_;
+  std::vector<uint8_t> registers_;
+};
+
+// Count-min sketch: depth строк по width счетчиков. Оценка частоты не
+// меньше истинной и превышает ее не более чем на долю e / width от суммы
+// всех частот с вероятностью 1 - e^-depth.
+class CountMinSketch {
+ public:
+  CountMinSketch(std::size_t width, std::size_t depth)
+      : mask_(std::bit_ceil(std::max<std::size_t>(width, 2)) - 1),
+        depth_(std::max<std::size_t>(depth, 1)),
+        counters_((mask_ + 1) * depth_, 0) {}
+
+  // Учитывает вхождение и возвращает новую оценку частоты. hash должен
+  // быть перемешан (см. finalizeHash).
+  uint64_t add(uint64_t hash) {
+    uint64_t result = UINT64_MAX;
+    for (std::size_t row = 0; row < depth_; ++row) {
+      uint32_t& counter = counters_[row * (mask_ + 1) + column(hash, row)];
+      result = std::min<uint64_t>(result, ++counter);
+    }
+    return result;
+  }
+
+  uint64_t estimate(uint64_t hash) const {
+    uint64_t result = UINT64_MAX;
+    for (std::size_t row = 0; row < depth_; ++row) {
+      result = std::min<uint64_t>(
+          result, counters_[row * (mask_ + 1) + column(hash, row)]);
+    }
+    return result;
+  }
+
+  void clear() { std::fill(counters_.begin(), counters_.end(), 0); }
+
+ private:
+  // Столбцы строк из двух половин хеша (Kirsch–Mitzenmacher).
+  std::size_t column(uint64_t hash, std::size_t row) const {
+    auto low = static_cast<uint32_t>(hash);
+    auto high = static_cast<uint32_t>(hash >> 32);
+    return (low + row * high) & mask_;
+  }
+
+  std::size_t mask_;
+  std::size_t depth_;
+  std::vector<uint32_t> counters_;
+};
+
+// Ключи с наибольшими оценками частоты count-min sketch. В заполненный
+// список ключ попадает, только если его оценка больше наименьшей в списке,
+// поэтому обращение к редкому ключу стоит одного сравнения. Ключи
+// различаются по 64-битному хешу: совпадение хешей разных ключей лишь
+// объединяет их счетчики.
+template <typename Key>
+class TopKeys {
+ public:
+  struct Item {
+    Key key;
+    uint64_t hash;
+    uint64_t count;
+  };
+
+  explicit TopKeys(std::size_t capacity)
+      : capacity_(std::max<std::size_t>(capacity, 1)) {
+    items_.reserve(capacity_);
+  }
+
+  // Запоминает новую оценку count частоты ключа с хешем hash. Ключ строится
+  // вызовом make_key() только при попадании в список.
+  // O(capacity) time complexity, O(1) для ключей вне списка.
+  template <typename MakeKey>
+  void update(uint64_t hash, uint64_t count, MakeKey&& make_key) {
+    if (items_.size() == capacity_ && count <= min_count_) {
+      return;
+    }
+
+    auto it = std::find_if(items_.begin(), items_.end(),
+                           [&](const Item& item) { return item.hash == hash; });
+    if (it != items_.end()) {
+      it->count = count;
+    } else if (items_.size() < capacity_) {
+      items_.push_back({make_key(), hash, count});
+    } else {
+      *std::min_element(items_.begin(), items_.end(), countLess) = {
+          make_key(), hash, count};
+    }
+
+    if (items_.size() == capacity_) {
+      min_count_ =
+          std::min_element(items_.begin(), items_.end(), countLess)->count;
+    }
+  }
+
+  // Ключи списка по убыванию оценки частоты.
+  std::vector<Item> sorted() const {
+    std::vector<Item> result = items_;
+    std::sort(result.begin(), result.end(),
+              [](const Item& lhs, const Item& rhs) {
+                return countLess(rhs, lhs);
+              });
+    return result;
+  }
+
+  void clear() {
+    items_.clear();
+    min_count_ = 0;
+  }
+
+ private:
+  static bool countLess(const Item& lhs, const Item& rhs) {
+    return lhs.count < rhs.count;
+  }
+
+  std::size_t capacity_;
+  std::vector<Item> items_;
+  // Наименьшая оценка в заполненном списке.
+  uint64_t min_count_ = 0;
+};
+
+struct AccessStatsOptions {
+  // В count-min и TopKeys попадает каждое sample_rate-е обращение;
+  // HyperLogLog учитывает все.
+  uint32_t sample_rate = 16;
+  // Сколько самых частых ключей отслеживает TopKeys.
+  std::size_t top_k = 32;
+  // 2^hll_precision регистров HyperLogLog.
+  uint8_t hll_precision = 12;
+  // Размер count-min sketch.
+  std::size_t cms_width = 2'048;
+  std::size_t cms_depth = 4;
+};
+
+// Снимок AccessStats.
+template <typename Key>
+struct AccessStatsSnapshot {
+  struct TopKey {
+    Key key;
+    // Оценка числа обращений сверху.
+    uint64_t count;
+  };
+
+  // Сколько обращений учтено.
+  uint64_t operations;
+  // Оценка числа различных ключей среди них.
+  double distinct_keys;
+  // Самые частые ключи по убыванию оценки частоты.
+  std::vector<TopKey> top_keys;
+};
+
+// Статистика обращений к ключам: число различных ключей (HyperLogLog),
+// частота произвольного ключа (count-min) и самые частые ключи по оценкам
+// count-min (TopKeys). Частоты — оценки с учетом выборки: счетчики
+// умножаются на sample_rate.
+template <typename Key>
+class AccessStats {
+ public:
+  explicit AccessStats(AccessStatsOptions options)
+      : options_(options),
+        distinct_(options.hll_precision),
+        frequencies_(options.cms_width, options.cms_depth),
+        top_(options.top_k) {
+    options_.sample_rate = std::max<uint32_t>(options_.sample_rate, 1);
+    countdown_ = nextCountdown();
+  }
+
+  // Учитывает обращение к ключу с хешем hash политики хранилища. Ключ
+  // строится вызовом make_key() только для выборки, и то редко.
+  template <typename MakeKey>
+  void record(uint64_t hash, MakeKey&& make_key) {
+    ++operations_;
+    hash = finalizeHash(hash);
+    distinct_.add(hash);
+    if (--countdown_ != 0) {
+      return;
+    }
+    countdown_ = nextCountdown();
+    top_.update(hash, frequencies_.add(hash), std::forward<MakeKey>(make_key));
+  }
+
+  // Оценка числа обращений к ключу с хешем hash.
+  uint64_t estimateFrequency(uint64_t hash) const {
+    return frequencies_.estimate(finalizeHash(hash)) * options_.sample_rate;
+  }
+
+  // O(2^hll_precision + top_k log top_k) time complexity.
+  AccessStatsSnapshot<Key> snapshot() const {
+    AccessStatsSnapshot<Key> result{operations_, distinct_.estimate(), {}};
+    for (auto& item : top_.sorted()) {
+      result.top_keys.push_back(
+          {std::move(item.key), item.count * options_.sample_rate});
+    }
+    return result;
+  }
+
+  void clear() {
+    operations_ = 0;
+    countdown_ = nextCountdown();
+    distinct_.clear();
+    frequencies_.clear();
+    top_.clear();
+  }
+
+ private:
+  // Расстояние до следующего обращения в выборке: случайное из
+  // [1, 2 * sample_rate - 1], в среднем sample_rate. Фиксированный шаг
+  // совпадал бы по фазе с периодичными нагрузками (например, чередованием
+  // get и set) и выбирал только часть операций.
+  uint32_t nextCountdown() {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+    uint64_t range = 2 * uint64_t{options_.sample_rate} - 1;
+    return 1 + static_cast<uint32_t>(random_ % range);
+  }
+
+  AccessStatsOptions options_;
+  uint64_t operations_ = 0;
+  // Состояние xorshift64.
+  uint64_t random_ = 0x9e3779b97f4a7c15ULL;
+  uint32_t countdown_;
+  HyperLogLog distinct_;
+  CountMinSketch frequencies_;
+  TopKeys<Key> top_;
+};
@@ -0,0 +1,544 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <utility>
+
+// Монотонный 64-битный префикс ключа: из a < b следует
+// orderedPrefix(a) <= orderedPrefix(b). Для строк — первые 8 байт в порядке
+// big-endian, для целых чисел — само число со смещенным знаком. Для прочих
+// типов префикс не определен (0), и порядок решает полное сравнение.
+template <typename K>
+uint64_t orderedPrefix(const K& key) {
+  if constexpr (std::convertible_to<const K&, std::string_view>) {
+    std::string_view view = key;
+    uint64_t prefix = 0;
+    std::memcpy(&prefix, view.data(), std::min<std::size_t>(view.size(), 8));
+    if constexpr (std::endian::native == std::endian::little) {
+      prefix = __builtin_bswap64(prefix);
+    }
+    return prefix;
+  } else if constexpr (std::unsigned_integral<K>) {
+    return static_cast<uint64_t>(key);
+  } else if constexpr (std::signed_integral<K>) {
+    return static_cast<uint64_t>(static_cast<int64_t>(key)) ^ (1ull << 63);
+  } else {
+    return 0;
+  }
+}
+
+// B+-дерево уникальных значений T (указателей или других тривиально
+// копируемых объектов) в порядке Compare. Узлы занимают kNodeBytes: лист
+// хранит слоты {префикс ключа, значение} подряд и ссылки на соседей, поэтому
+// обход диапазона читает память последовательно, а поиск в узле в основном
+// сравнивает префиксы и разыменовывает значение только при их совпадении.
+// Префикс значения передается при вставке (см. orderedPrefix).
+//
+// Лист, в котором лежит значение, — стабильный handle: он меняется только при
+// расщеплении листа, и дерево сообщает об этом через
+// Relocate(value, new_leaf). Удаление по handle ищет значение в одном листе
+// сравнением на равенство, без сравнений ключей. Недозаполненные листья не
+// сливаются: лист освобождается, когда становится пустым.
+//
+// Внутренние узлы хранят число значений своего поддерева, поэтому rank и
+// select работают за O(log N).
+template <typename T, typename Compare, typename Relocate,
+          std::size_t kNodeBytes = 512>
+class BPlusTree {
+  struct Inner;
+
+  struct Slot {
+    uint64_t prefix;
+    T value;
+  };
+
+  struct Node {
+    Inner* parent = nullptr;
+    uint32_t count = 0;
+    bool is_leaf;
+
+    explicit Node(bool is_leaf) : is_leaf(is_leaf) {}
+  };
+
+  static constexpr std::size_t kLeafCapacity =
+      (kNodeBytes - sizeof(Node) - 2 * sizeof(void*)) / sizeof(Slot);
+  // Внутренний узел хранит kInnerCapacity детей, на один разделитель меньше
+  // и число значений поддерева.
+  static constexpr std::size_t kInnerCapacity =
+      (kNodeBytes - sizeof(Node) - sizeof(std::size_t) + sizeof(Slot)) /
+      (sizeof(Slot) + sizeof(Node*));
+
+  struct alignas(64) Leaf : Node {
+    Leaf* prev = nullptr;
+    Leaf* next = nullptr;
+    Slot slots[kLeafCapacity];
+
+    Leaf() : Node(true) {}
+  };
+
+  // keys[i] — минимальное значение поддерева children[i + 1].
+  struct alignas(64) Inner : Node {
+    Slot keys[kInnerCapacity - 1];
+    Node* children[kInnerCapacity];
+    std::size_t weight = 0;
+
+    Inner() : Node(false) {}
+  };
+
+  static_assert(kLeafCapacity >= 4 && kInnerCapacity >= 4);
+  static_assert(sizeof(Leaf) <= kNodeBytes && sizeof(Inner) <= kNodeBytes);
+
+ public:
+  using value_type = T;
+  using size_type = std::size_t;
+  // Стабильный handle значения: лист, в котором оно лежит.
+  using handle = Leaf*;
+
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    const_iterator() = default;
+
+    reference operator*() const { return leaf_->slots[pos_].value; }
+    pointer operator->() const { return &leaf_->slots[pos_].value; }
+
+    const_iterator& operator++() {
+      if (++pos_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+        if (leaf_ != nullptr) {
+          __builtin_prefetch(leaf_->next);
+        }
+      }
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator copy = *this;
+      ++*this;
+      return copy;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return leaf_ == other.leaf_ && pos_ == other.pos_;
+    }
+
+   private:
+    friend class BPlusTree;
+
+    const_iterator(const Leaf* leaf, uint32_t pos) : leaf_(leaf), pos_(pos) {
+      if (leaf_ != nullptr && pos_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+      }
+    }
+
+    const Leaf* leaf_ = nullptr;
+    uint32_t pos_ = 0;
+  };
+
+  explicit BPlusTree(Compare compare = Compare(),
+                     Relocate relocate = Relocate())
+      : compare_(std::move(compare)),
+        relocate_(std::move(relocate)),
+        root_(new Leaf()) {}
+
+  BPlusTree(const BPlusTree&) = delete;
+  BPlusTree& operator=(const BPlusTree&) = delete;
+
+  BPlusTree(BPlusTree&& other) noexcept
+      : compare_(std::move(other.compare_)),
+        relocate_(std::move(other.relocate_)),
+        root_(std::exchange(other.root_, new Leaf())),
+        size_(std::exchange(other.size_, 0)) {}
+
+  BPlusTree& operator=(BPlusTree&& other) noexcept {
+    if (this != &other) {
+      std::swap(compare_, other.compare_);
+      std::swap(relocate_, other.relocate_);
+      std::swap(root_, other.root_);
+      std::swap(size_, other.size_);
+    }
+    return *this;
+  }
+
+  ~BPlusTree() { destroy(root_); }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const_iterator begin() const {
+    const Node* node = root_;
+    while (!node->is_leaf) {
+      node = static_cast<const Inner*>(node)->children[0];
+    }
+    return const_iterator(static_cast<const Leaf*>(node), 0);
+  }
+
+  const_iterator end() const { return const_iterator(); }
+
+  // Число значений, меньших key. prefix — orderedPrefix(key).
+  // O(log N) time complexity.
+  template <typename K>
+  size_type rank(const K& key, uint64_t prefix) const {
+    size_type result = 0;
+    const Node* node = root_;
+    while (!node->is_leaf) {
+      const auto* inner = static_cast<const Inner*>(node);
+      auto index = static_cast<uint32_t>(
+          std::partition_point(
+              inner->keys, inner->keys + inner->count - 1,
+              [&](const Slot& s) { return !keyLess(key, prefix, s); }) -
+          inner->keys);
+      for (uint32_t i = 0; i < index; ++i) {
+        result += weight(inner->children[i]);
+      }
+      node = inner->children[index];
+    }
+    const auto* leaf = static_cast<const Leaf*>(node);
+    return result + static_cast<size_type>(
+                        std::partition_point(
+                            leaf->slots, leaf->slots + leaf->count,
+                            [&](const Slot& s) {
+                              return slotLess(s, key, prefix);
+                            }) -
+                        leaf->slots);
+  }
+
+  // Значение с номером index в порядке Compare или end(), если
+  // index >= size(). O(log N) time complexity.
+  const_iterator select(size_type index) const {
+    if (index >= size_) {
+      return end();
+    }
+    const Node* node = root_;
+    while (!node->is_leaf) {
+      const auto* inner = static_cast<const Inner*>(node);
+      uint32_t child = 0;
+      while (index >= weight(inner->children[child])) {
+        index -= weight(inner->children[child]);
+        ++child;
+      }
+      node = inner->children[child];
+    }
+    return const_iterator(static_cast<const Leaf*>(node),
+                          static_cast<uint32_t>(index));
+  }
+
+  // Первое значение, не меньшее key. prefix — orderedPrefix(key).
+  template <typename K>
+  const_iterator lower_bound(const K& key, uint64_t prefix) const {
+    const Leaf* leaf = findLeaf(key, prefix);
+    const Slot* slot = std::partition_point(
+        leaf->slots, leaf->slots + leaf->count,
+        [&](const Slot& s) { return slotLess(s, key, prefix); });
+    return const_iterator(leaf, static_cast<uint32_t>(slot - leaf->slots));
+  }
+
+  // Вставляет значение, которого еще нет в дереве, и возвращает его handle.
+  // O(log N).
+  handle insert(T value, uint64_t prefix) {
+    Leaf* leaf = const_cast<Leaf*>(findLeaf(value, prefix));
+    auto pos = static_cast<uint32_t>(
+        std::partition_point(
+            leaf->slots, leaf->slots + leaf->count,
+            [&](const Slot& s) { return slotLess(s, value, prefix); }) -
+        leaf->slots);
+
+    if (leaf->count == kLeafCapacity) {
+      Leaf* right = splitLeaf(leaf);
+      if (pos > leaf->count) {
+        pos -= leaf->count;
+        leaf = right;
+      }
+    }
+
+    std::move_backward(leaf->slots + pos, leaf->slots + leaf->count,
+                       leaf->slots + leaf->count + 1);
+    leaf->slots[pos] = Slot{prefix, value};
+    ++leaf->count;
+    ++size_;
+    for (Inner* node = leaf->parent; node != nullptr; node = node->parent) {
+      ++node->weight;
+    }
+    return leaf;
+  }
+
+  // Вставляет значение, большее всех значений дерева, в самый правый лист
+  // без сравнений ключей. Полный лист не делится пополам, а получает
+  // правого соседа с одним значением, поэтому вставка по возрастанию
+  // заполняет листья целиком. O(log N) только из-за весов предков.
+  handle insertBack(T value, uint64_t prefix) {
+    Node* node = root_;
+    while (!node->is_leaf) {
+      auto* inner = static_cast<Inner*>(node);
+      node = inner->children[inner->count - 1];
+    }
+    auto* leaf = static_cast<Leaf*>(node);
+
+    // Веса предков учитывают значение заранее: если оно уйдет в нового
+    // соседа, insertIntoParent пересчитает только расщепленные узлы.
+    ++size_;
+    for (Inner* inner = leaf->parent; inner != nullptr;
+         inner = inner->parent) {
+      ++inner->weight;
+    }
+    if (leaf->count < kLeafCapacity) {
+      leaf->slots[leaf->count++] = Slot{prefix, value};
+      return leaf;
+    }
+
+    auto* right = new Leaf();
+    right->slots[0] = Slot{prefix, value};
+    right->count = 1;
+    right->prev = leaf;
+    leaf->next = right;
+    insertIntoParent(leaf, right->slots[0], right);
+    return right;
+  }
+
+  // Удаляет значение по его handle. O(kLeafCapacity) без сравнений ключей,
+  // если лист не опустел.
+  void erase(handle leaf, T value) {
+    auto pos = static_cast<uint32_t>(
+        std::find_if(leaf->slots, leaf->slots + leaf->count,
+                     [&](const Slot& s) { return s.value == value; }) -
+        leaf->slots);
+
+    if (pos == 0) {
+      // Минимум листа может быть разделителем в одном из предков. Если лист
+      // опустеет, преемник из следующего листа останется верным
+      // разделителем, либо разделитель уйдет вместе с поддеревом.
+      const Slot* successor = leaf->count > 1    ? &leaf->slots[1]
+                              : leaf->next != nullptr ? &leaf->next->slots[0]
+                                                      : nullptr;
+      replaceSeparator(leaf->parent, value, successor);
+    }
+
+    std::move(leaf->slots + pos + 1, leaf->slots + leaf->count,
+              leaf->slots + pos);
+    --leaf->count;
+    --size_;
+    for (Inner* node = leaf->parent; node != nullptr; node = node->parent) {
+      --node->weight;
+    }
+
+    if (leaf->count == 0 && leaf != root_) {
+      if (leaf->prev != nullptr) {
+        leaf->prev->next = leaf->next;
+      }
+      if (leaf->next != nullptr) {
+        leaf->next->prev = leaf->prev;
+      }
+      removeChild(leaf);
+      delete leaf;
+    }
+  }
+
+  void clear() {
+    destroy(root_);
+    root_ = new Leaf();
+    size_ = 0;
+  }
+
+ private:
+  template <typename K>
+  bool slotLess(const Slot& slot, const K& key, uint64_t prefix) const {
+    return slot.prefix != prefix ? slot.prefix < prefix
+                                 : compare_(slot.value, key);
+  }
+
+  template <typename K>
+  bool keyLess(const K& key, uint64_t prefix, const Slot& slot) const {
+    return prefix != slot.prefix ? prefix < slot.prefix
+                                 : compare_(key, slot.value);
+  }
+
+  template <typename K>
+  const Leaf* findLeaf(const K& key, uint64_t prefix) const {
+    const Node* node = root_;
+    while (!node->is_leaf) {
+      const auto* inner = static_cast<const Inner*>(node);
+      const Slot* separator = std::partition_point(
+          inner->keys, inner->keys + inner->count - 1,
+          [&](const Slot& s) { return !keyLess(key, prefix, s); });
+      node = inner->children[separator - inner->keys];
+    }
+    return static_cast<const Leaf*>(node);
+  }
+
+  // Переносит верхнюю половину полного листа в новый правый сосед.
+  Leaf* splitLeaf(Leaf* leaf) {
+    auto* right = new Leaf();
+    uint32_t keep = (kLeafCapacity + 1) / 2;
+    right->count = leaf->count - keep;
+    std::copy(leaf->slots + keep, leaf->slots + leaf->count, right->slots);
+    leaf->count = keep;
+    for (uint32_t i = 0; i < right->count; ++i) {
+      relocate_(right->slots[i].value, right);
+    }
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next != nullptr) {
+      leaf->next->prev = right;
+    }
+    leaf->next = right;
+
+    insertIntoParent(leaf, right->slots[0], right);
+    return right;
+  }
+
+  static std::size_t weight(const Node* node) {
+    return node->is_leaf ? node->count
+                         : static_cast<const Inner*>(node)->weight;
+  }
+
+  static std::size_t sumWeights(const Inner* node) {
+    std::size_t sum = 0;
+    for (uint32_t i = 0; i < node->count; ++i) {
+      sum += weight(node->children[i]);
+    }
+    return sum;
+  }
+
+  static uint32_t childIndex(const Inner* parent, const Node* child) {
+    return static_cast<uint32_t>(
+        std::find(parent->children, parent->children + parent->count, child) -
+        parent->children);
+  }
+
+  // Вставляет right с разделителем separator справа от left. Значения
+  // только переходят из left в right, поэтому веса предков не меняются.
+  void insertIntoParent(Node* left, const Slot& separator, Node* right) {
+    Inner* parent = left->parent;
+    if (parent == nullptr) {
+      auto* root = new Inner();
+      root->keys[0] = separator;
+      root->children[0] = left;
+      root->children[1] = right;
+      root->count = 2;
+      root->weight = weight(left) + weight(right);
+      left->parent = root;
+      right->parent = root;
+      root_ = root;
+      return;
+    }
+
+    uint32_t index = childIndex(parent, left);
+    if (parent->count < kInnerCapacity) {
+      std::move_backward(parent->keys + index, parent->keys + parent->count - 1,
+                         parent->keys + parent->count);
+      std::move_backward(parent->children + index + 1,
+                         parent->children + parent->count,
+                         parent->children + parent->count + 1);
+      parent->keys[index] = separator;
+      parent->children[index + 1] = right;
+      right->parent = parent;
+      ++parent->count;
+      return;
+    }
+
+    // Переполненный узел: собираем kInnerCapacity + 1 детей и делим пополам,
+    // средний разделитель поднимается на уровень выше.
+    Slot keys[kInnerCapacity];
+    Node* children[kInnerCapacity + 1];
+    std::copy(parent->keys, parent->keys + index, keys);
+    keys[index] = separator;
+    std::copy(parent->keys + index, parent->keys + kInnerCapacity - 1,
+              keys + index + 1);
+    std::copy(parent->children, parent->children + index + 1, children);
+    children[index + 1] = right;
+    std::copy(parent->children + index + 1,
+              parent->children + kInnerCapacity, children + index + 2);
+
+    constexpr uint32_t kKeep = (kInnerCapacity + 1) / 2;
+    auto* sibling = new Inner();
+    std::copy(keys, keys + kKeep - 1, parent->keys);
+    std::copy(children, children + kKeep, parent->children);
+    parent->count = kKeep;
+    std::copy(keys + kKeep, keys + kInnerCapacity, sibling->keys);
+    std::copy(children + kKeep, children + kInnerCapacity + 1,
+              sibling->children);
+    sibling->count = kInnerCapacity + 1 - kKeep;
+
+    right->parent = parent;
+    for (uint32_t i = 0; i < sibling->count; ++i) {
+      sibling->children[i]->parent = sibling;
+    }
+    parent->weight = sumWeights(parent);
+    sibling->weight = sumWeights(sibling);
+
+    insertIntoParent(parent, keys[kKeep - 1], sibling);
+  }
+
+  void replaceSeparator(Inner* node, T value, const Slot* successor) {
+    for (; node != nullptr; node = node->parent) {
+      for (uint32_t i = 0; i + 1 < node->count; ++i) {
+        if (node->keys[i].value == value) {
+          if (successor != nullptr) {
+            node->keys[i] = *successor;
+          }
+          return;
+        }
+      }
+    }
+  }
+
+  // Отцепляет опустевший узел child от родителя. Опустевшие внутренние узлы
+  // удаляются по цепочке вверх, корень с единственным ребенком заменяется
+  // этим ребенком.
+  void removeChild(Node* child) {
+    Inner* parent = child->parent;
+    uint32_t index = childIndex(parent, child);
+    if (parent->count > 1) {
+      uint32_t key = index > 0 ? index - 1 : 0;
+      std::move(parent->keys + key + 1, parent->keys + parent->count - 1,
+                parent->keys + key);
+    }
+    std::move(parent->children + index + 1, parent->children + parent->count,
+              parent->children + index);
+    --parent->count;
+
+    if (parent->count == 0) {
+      removeChild(parent);
+      delete parent;
+      return;
+    }
+
+    while (!root_->is_leaf && root_->count == 1) {
+      auto* old_root = static_cast<Inner*>(root_);
+      root_ = old_root->children[0];
+      root_->parent = nullptr;
+      delete old_root;
+    }
+  }
+
+  static void destroy(Node* node) {
+    if (node->is_leaf) {
+      delete static_cast<Leaf*>(node);
+      return;
+    }
+    auto* inner = static_cast<Inner*>(node);
+    for (uint32_t i = 0; i < inner->count; ++i) {
+      destroy(inner->children[i]);
+    }
+    delete inner;
+  }
+
+  [[no_unique_address]] Compare compare_;
+  [[no_unique_address]] Relocate relocate_;
+  Node* root_;
+  size_type size_ = 0;
+};
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "epoch_reclaimer.hpp"
+
+namespace concurrent_hash_detail {
+
+// Узел списка сегмента: фиктивный узел корзины (четный order) или запись
+// (нечетный order).
+struct Link {
+  std::atomic<Link*> next{nullptr};
+  uint64_t order;
+
+  explicit Link(uint64_t order) : order(order) {}
+};
+
+inline uint64_t reverseBits(uint64_t x) {
+  x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+  x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+  return __builtin_bswap64(x);
+}
+
+struct NoSegmentData {};
+
+}  // namespace concurrent_hash_detail
+
+// Запись ConcurrentHashMap. Вынесена из класса по той же причине, что и
+// HashMapNode: данные сегмента могут хранить указатели на записи.
+template <typename Key, typename Mapped>
+struct ConcurrentHashMapEntry : concurrent_hash_detail::Link {
+  std::pair<const Key, Mapped> value;
+
+  template <typename K, typename... Args>
+  ConcurrentHashMapEntry(uint64_t order, K&& key, Args&&... args)
+      : Link(order),
+        value(std::piecewise_construct,
+              std::forward_as_tuple(std::forward<K>(key)),
+              std::forward_as_tuple(std::forward<Args>(args)...)) {}
+
+  const Key& key() const { return value.first; }
+  Mapped& mapped() { return value.second; }
+  const Mapped& mapped() const { return value.second; }
+};
+
+// Хеш-таблица для многопоточного KeyIndex. Ключи делятся по старшим битам
+// хеша на kSegments сегментов, у каждого своя блокировка для писателей,
+// поэтому set и remove разных сегментов выполняются параллельно. Чтение
+// (find) не берет блокировок и не повторяет проход: число шагов ограничено
+// длиной цепочки (wait-free).
+//
+// Сегмент хранит записи в одном списке, упорядоченном по хешу с обратным
+// порядком битов (split-ordered list, Shalev и Shavit). Корзина — указатель
+// на фиктивный узел в этом списке, и записи корзины лежат за ним подряд.
+// При удвоении числа корзин каждая корзина делится на две вставкой нового
+// фиктивного узла, поэтому рост не перемещает записи и не мешает
+// читателям. Новые корзины инициализируются лениво; читатель, попавший в
+// неинициализированную корзину, начинает с родительской.
+//
+// Удаленные записи и старые массивы корзин освобождаются через EpochDomain.
+// Указатели на записи стабильны до их удаления.
+template <typename Key, typename Mapped, typename Hash,
+          typename KeyEqual = std::equal_to<>,
+          typename SegmentData = concurrent_hash_detail::NoSegmentData>
+class ConcurrentHashMap {
+ public:
+  using entry = ConcurrentHashMapEntry<Key, Mapped>;
+
+  static constexpr int kSegmentBits = 6;
+  static constexpr std::size_t kSegments = std::size_t{1} << kSegmentBits;
+  static constexpr std::size_t kMinBucketCount = 4;
+
+ private:
+  using Link = concurrent_hash_detail::Link;
+  using Entry = entry;
+
+  struct Table {
+    std::size_t mask;
+    std::unique_ptr<std::atomic<Link*>[]> buckets;
+
+    explicit Table(std::size_t count)
+        : mask(count - 1), buckets(new std::atomic<Link*>[count]()) {}
+  };
+
+  // Выравнивание по кеш-линии: блокировки соседних сегментов не должны
+  // делить линию.
+  struct alignas(64) Segment {
+    std::mutex mutex;
+    std::atomic<Table*> table;
+    // Фиктивный узел корзины 0, голова списка.
+    Link head{0};
+    std::atomic<std::size_t> size{0};
+    SegmentData data;
+
+    Segment() : table(new Table(kMinBucketCount)) {
+      table.load(std::memory_order_relaxed)->buckets[0].store(&head);
+    }
+  };
+
+ public:
+  // Доступ к сегменту под его блокировкой. Записи и данные сегмента можно
+  // изменять, пока объект жив.
+  class Locked {
+   public:
+    // Запись с ключом key (hash — его хеш) или nullptr.
+    template <typename K>
+    entry* find(const K& key, std::size_t hash) {
+      return map_->locate(*segment_, key, hash).second;
+    }
+
+    // Если записи с ключом key нет, вставляет запись с ключом make() и
+    // значением, построенным из args. Возвращает запись и признак вставки.
+    template <typename K, typename Make, typename... Args>
+    std::pair<entry*, bool> lazy_emplace(const K& key, std::size_t hash,
+                                         Make&& make, Args&&... args) {
+      auto [pred, found] = map_->locate(*segment_, key, hash);
+      if (found != nullptr) {
+        return {found, false};
+      }
+      auto* inserted = new Entry(entryOrder(hash), make(),
+                                 std::forward<Args>(args)...);
+      inserted->next.store(pred->next.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+      pred->next.store(inserted, std::memory_order_release);
+      map_->grow(*segment_);
+      return {inserted, true};
+    }
+
+    // Исключает запись сегмента. Память освобождается, когда запись больше
+    // не могут читать.
+    void erase(entry* erased) {
+      Table& table = *segment_->table.load(std::memory_order_relaxed);
+      std::size_t bucket =
+          concurrent_hash_detail::reverseBits(erased->order) & table.mask;
+      Link* pred = map_->initBucket(*segment_, bucket);
+      while (pred->next.load(std::memory_order_relaxed) != erased) {
+        pred = pred->next.load(std::memory_order_relaxed);
+      }
+      pred->next.store(erased->next.load(std::memory_order_relaxed),
+                       std::memory_order_release);
+      segment_->size.store(
+          segment_->size.load(std::memory_order_relaxed) - 1,
+          std::memory_order_relaxed);
+      EpochDomain::instance().retire(erased);
+    }
+
+    SegmentData& data() { return segment_->data; }
+
+   private:
+    friend class ConcurrentHashMap;
+
+    Locked(ConcurrentHashMap* map, Segment* segment)
+        : map_(map), segment_(segment), lock_(segment->mutex) {}
+
+    ConcurrentHashMap* map_;
+    Segment* segment_;
+    std::unique_lock<std::mutex> lock_;
+  };
+
+  explicit ConcurrentHashMap(Hash hash = Hash(),
+                             KeyEqual key_equal = KeyEqual())
+      : hash_(std::move(hash)), key_equal_(std::move(key_equal)) {}
+
+  ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+  ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+  // Не должен выполняться одновременно с другими операциями.
+  ~ConcurrentHashMap() {
+    for (Segment& segment : segments_) {
+      Link* link = segment.head.next.load();
+      while (link != nullptr) {
+        Link* next = link->next.load();
+        if (isEntry(link)) {
+          delete static_cast<Entry*>(link);
+        } else {
+          delete link;
+        }
+        link = next;
+      }
+      delete segment.table.load();
+    }
+  }
+
+  template <typename K>
+  std::size_t hash(const K& key) const {
+    return hash_(key);
+  }
+
+  // Ищет запись без блокировок. Вызывающий держит EpochDomain::Guard, пока
+  // обращается к записи.
+  template <typename K>
+  const entry* find(const K& key) const {
+    return find(key, hash_(key));
+  }
+
+  // Как find(key), но с уже посчитанным хешем ключа.
+  template <typename K>
+  const entry* find(const K& key, std::size_t hash) const {
+    const Segment& segment = segmentFor(hash);
+    const Table* table = segment.table.load(std::memory_order_acquire);
+    uint64_t order = entryOrder(hash);
+
+    const Link* link = bucketHead(*table, hash & table->mask);
+    for (link = link->next.load(std::memory_order_acquire);
+         link != nullptr && link->order <= order;
+         link = link->next.load(std::memory_order_acquire)) {
+      if (link->order == order &&
+          key_equal_(static_cast<const Entry*>(link)->key(), key)) {
+        return static_cast<const Entry*>(link);
+      }
+    }
+    return nullptr;
+  }
+
+  // Блокирует сегмент ключа с хешем hash.
+  Locked lock(std::size_t hash) {
+    return Locked(this, &segmentFor(hash));
+  }
+
+  // Блокирует сегмент с номером index < kSegments.
+  Locked lockSegment(std::size_t index) {
+    return Locked(this, &segments_[index]);
+  }
+
+  // Данные сегмента без блокировки: допустимо читать только атомарные поля.
+  const SegmentData& peek(std::size_t index) const {
+    return segments_[index].data;
+  }
+
+  // Число записей (точное в отсутствие конкурентных изменений).
+  std::size_t size() const {
+    std::size_t size = 0;
+    for (const Segment& segment : segments_) {
+      size += segment.size.load(std::memory_order_relaxed);
+    }
+    return size;
+  }
+
+  // Готовит сегменты к хранению count записей без роста.
+  void reserve(std::size_t count) {
+    std::size_t per_segment = std::bit_ceil(count / kSegments + 1);
+    for (Segment& segment : segments_) {
+      std::lock_guard lock(segment.mutex);
+      while (segment.table.load(std::memory_order_relaxed)->mask + 1 <
+             per_segment) {
+        resize(segment);
+      }
+    }
+  }
+
+ private:
+  static uint64_t entryOrder(std::size_t hash) {
+    return concurrent_hash_detail::reverseBits(hash) | 1;
+  }
+
+  static bool isEntry(const Link* link) { return (link->order & 1) != 0; }
+
+  static std::size_t parentBucket(std::size_t bucket) {
+    return bucket & ~std::bit_floor(bucket);
+  }
+
+  Segment& segmentFor(std::size_t hash) {
+    return segments_[hash >> (64 - kSegmentBits)];
+  }
+  const Segment& segmentFor(std::size_t hash) const {
+    return segments_[hash >> (64 - kSegmentBits)];
+  }
+
+  // Фиктивный узел корзины для читателя. Корзина 0 инициализирована всегда.
+  static const Link* bucketHead(const Table& table, std::size_t bucket) {
+    const Link* head = table.buckets[bucket].load(std::memory_order_acquire);
+    while (head == nullptr) {
+      bucket = parentBucket(bucket);
+      head = table.buckets[bucket].load(std::memory_order_acquire);
+    }
+    return head;
+  }
+
+  // Под блокировкой: фиктивный узел корзины, при необходимости вставленный в
+  // список за узлом родительской корзины.
+  Link* initBucket(Segment& segment, std::size_t bucket) {
+    Table& table = *segment.table.load(std::memory_order_relaxed);
+    if (Link* head = table.buckets[bucket].load(std::memory_order_relaxed)) {
+      return head;
+    }
+    Link* pred = initBucket(segment, parentBucket(bucket));
+    auto* dummy = new Link(concurrent_hash_detail::reverseBits(bucket));
+    for (Link* next = pred->next.load(std::memory_order_relaxed);
+         next != nullptr && next->order < dummy->order;
+         next = next->next.load(std::memory_order_relaxed)) {
+      pred = next;
+    }
+    dummy->next.store(pred->next.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    pred->next.store(dummy, std::memory_order_release);
+    table.buckets[bucket].store(dummy, std::memory_order_release);
+    return dummy;
+  }
+
+  // Под блокировкой: последний узел с order не больше order ключа, после
+  // которого вставляется новая запись, и запись с ключом key, если она есть.
+  template <typename K>
+  std::pair<Link*, Entry*> locate(Segment& segment, const K& key,
+                                  std::size_t hash) {
+    Table& table = *segment.table.load(std::memory_order_relaxed);
+    uint64_t order = entryOrder(hash);
+
+    Link* pred = initBucket(segment, hash & table.mask);
+    for (Link* next = pred->next.load(std::memory_order_relaxed);
+         next != nullptr && next->order <= order;
+         next = next->next.load(std::memory_order_relaxed)) {
+      if (next->order == order &&
+          key_equal_(static_cast<Entry*>(next)->key(), key)) {
+        return {pred, static_cast<Entry*>(next)};
+      }
+      pred = next;
+    }
+    return {pred, nullptr};
+  }
+
+  // Под блокировкой: учитывает вставленную запись и удваивает число корзин,
+  // когда записей в сегменте больше, чем корзин.
+  void grow(Segment& segment) {
+    std::size_t size = segment.size.load(std::memory_order_relaxed) + 1;
+    segment.size.store(size, std::memory_order_relaxed);
+    if (size > segment.table.load(std::memory_order_relaxed)->mask + 1) {
+      resize(segment);
+    }
+  }
+
+  // Под блокировкой: публикует массив корзин вдвое больше. Новые корзины
+  // пусты и инициализируются при первом обращении писателя.
+  void resize(Segment& segment) {
+    Table* old_table = segment.table.load(std::memory_order_relaxed);
+    std::size_t old_count = old_table->mask + 1;
+    auto* new_table = new Table(old_count * 2);
+    for (std::size_t bucket = 0; bucket < old_count; ++bucket) {
+      new_table->buckets[bucket].store(
+          old_table->buckets[bucket].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+    segment.table.store(new_table, std::memory_order_release);
+    EpochDomain::instance().retire(old_table);
+  }
+
+  [[no_unique_address]] Hash hash_;
+  [[no_unique_address]] KeyEqual key_equal_;
+  std::array<Segment, kSegments> segments_;
+};
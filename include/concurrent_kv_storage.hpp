@@ -0,0 +1,669 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "concurrent_hash_map.hpp"
+#include "concurrent_skip_list.hpp"
+#include "epoch_reclaimer.hpp"
+#include "hash_policy.hpp"
+#include "hot_key_replicas.hpp"
+#include "kv_storage.hpp"
+#include "read_through.hpp"
+
+// Многопоточный вариант KVStorage со строковыми ключами и значениями: все
+// методы можно вызывать одновременно из разных потоков.
+//
+// KeyIndex — ConcurrentHashMap: get не берет блокировок, а set и remove
+// блокируют только сегмент ключа. Значение записи — неизменяемая версия
+// (Version), которую set заменяет одной атомарной записью указателя, поэтому
+// читатель всегда видит значение и время протухания целиком. TtlIndex свой у
+// каждого сегмента и изменяется под его блокировкой, SortedKeyIndex —
+// ConcurrentSkipList ключей.
+//
+// С InlineValueBytes > 0 значения не длиннее InlineValueBytes хранятся прямо
+// в записи под seqlock: get копирует их без разыменования версии и без
+// записи в общую память, а при конфликте с писателем повторяет копирование.
+//
+// setHotKeyReplication включает реплики горячих ключей (hot_key_replicas.hpp):
+// get самых частых ключей читает копию в реплике своего потока.
+//
+// Как кеш перед медленным хранилищем: getOrLoad загружает отсутствующие
+// значения, объединяя одновременные загрузки одного ключа, и заранее
+// обновляет протухающие (setRefreshAhead), а setWriteBehind пачками
+// отправляет set и remove в KVBackend (read_through.hpp).
+//
+// Операции над одним ключом линеаризуемы по KeyIndex. getManySorted не
+// является снимком: запись, вставленная или удаленная во время обхода, может
+// как попасть, так и не попасть в результат.
+template <KVClock Clock, typename Hash = SeededHash,
+          std::size_t InlineValueBytes = 0>
+class ConcurrentKVStorage {
+  static_assert(KVHashPolicy<Hash>);
+  static_assert(InlineValueBytes <= UINT16_MAX);
+
+  using Key = std::string;
+  using KeyView = std::string_view;
+  using Value = std::string;
+
+  using Duration = typename Clock::duration;
+  using TimePoint = typename Clock::time_point;
+
+  using Seconds = std::chrono::seconds;
+  static constexpr Seconds kNoExpiry{0};
+
+  using InputEntry = std::tuple<Key, Value, uint32_t>;
+  using OutputEntry = std::pair<Key, Value>;
+
+  static constexpr bool kInlineValues = InlineValueBytes > 0;
+  static constexpr std::size_t kInlineWords = (InlineValueBytes + 7) / 8;
+
+  // Неизменяемая версия значения записи. Старая версия освобождается через
+  // EpochDomain, когда ее больше не могут читать.
+  struct Version {
+    Value value;
+    TimePoint expiry;
+    bool has_expiry;
+
+    bool isExpired(TimePoint now) const {
+      return has_expiry && expiry <= now;
+    }
+  };
+
+  // Значение, подготовленное к записи до блокировки сегмента: версия или
+  // байты маленького значения, которые запишутся в InlineValue.
+  struct PreparedValue {
+    const Version* version;
+    Value bytes;
+    TimePoint expiry;
+    bool has_expiry;
+  };
+
+  // Маленькое значение и время протухания в самой записи. Писатель делает
+  // sequence нечетным на время изменения полей записи; читатель копирует
+  // поля без блокировок и повторяет копирование, если sequence был нечетным
+  // или изменился. Поля атомарны, чтобы копирование во время записи не было
+  // гонкой данных. Писатель сохраняет их с release, а читатель загружает с
+  // acquire вместо барьеров: если читатель увидел хотя бы одно новое поле,
+  // повторное чтение sequence увидит нечетное или новое значение. На x86
+  // это обычные mov.
+  struct InlineValue {
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint16_t> size{0};
+    std::atomic<bool> has_expiry{false};
+    std::atomic<typename TimePoint::rep> expiry{0};
+    std::array<std::atomic<uint64_t>, kInlineWords> words{};
+  };
+
+  struct NoInlineValue {};
+
+  struct Record;
+
+  using Entry = ConcurrentHashMapEntry<Key, Record>;
+  using TtlIndex = std::multimap<TimePoint, Entry*>;
+
+  struct Record {
+    // Версия значения. С InlineValueBytes > 0 — nullptr, если значение
+    // хранится в inline_value, и изменяется под его sequence.
+    std::atomic<const Version*> version{nullptr};
+    // Изменяется только под блокировкой сегмента. Невалиден, если у
+    // значения нет времени протухания.
+    typename TtlIndex::iterator ttl_it;
+    [[no_unique_address]] std::conditional_t<kInlineValues, InlineValue,
+                                             NoInlineValue> inline_value;
+
+    explicit Record(PreparedValue value) { assign(std::move(value)); }
+
+    Record(const Record&) = delete;
+    Record& operator=(const Record&) = delete;
+
+    ~Record() { delete version.load(std::memory_order_relaxed); }
+
+    // Под блокировкой сегмента: публикует новое значение. Возвращает прежнюю
+    // версию (или nullptr), которую нужно освободить через EpochDomain.
+    const Version* assign(PreparedValue value) {
+      if constexpr (kInlineValues) {
+        uint32_t sequence =
+            inline_value.sequence.load(std::memory_order_relaxed);
+        inline_value.sequence.store(sequence + 1, std::memory_order_relaxed);
+
+        const Version* old_version =
+            version.exchange(value.version, std::memory_order_release);
+        if (value.version == nullptr) {
+          std::array<uint64_t, kInlineWords> words{};
+          std::copy(value.bytes.begin(), value.bytes.end(),
+                    reinterpret_cast<char*>(words.data()));
+          inline_value.size.store(value.bytes.size(),
+                                  std::memory_order_release);
+          inline_value.has_expiry.store(value.has_expiry,
+                                        std::memory_order_release);
+          inline_value.expiry.store(value.expiry.time_since_epoch().count(),
+                                    std::memory_order_release);
+          for (std::size_t i = 0; i < wordCount(value.bytes.size()); ++i) {
+            inline_value.words[i].store(words[i], std::memory_order_release);
+          }
+        }
+
+        inline_value.sequence.store(sequence + 2, std::memory_order_release);
+        return old_version;
+      } else {
+        return version.exchange(value.version, std::memory_order_acq_rel);
+      }
+    }
+
+    // Без блокировок: значение, если оно не протухло к моменту now. Если
+    // передан expiry_out, сохраняет в него время протухания значения.
+    std::optional<Value> load(
+        TimePoint now, std::optional<TimePoint>* expiry_out = nullptr) const {
+      if constexpr (kInlineValues) {
+        std::array<uint64_t, kInlineWords> words;
+        while (true) {
+          uint32_t sequence =
+              inline_value.sequence.load(std::memory_order_acquire);
+          if ((sequence & 1) != 0) {
+            std::this_thread::yield();
+            continue;
+          }
+
+          const Version* current = version.load(std::memory_order_acquire);
+          std::size_t size = std::min<std::size_t>(
+              inline_value.size.load(std::memory_order_acquire),
+              InlineValueBytes);
+          bool has_expiry =
+              inline_value.has_expiry.load(std::memory_order_acquire);
+          TimePoint expiry(typename TimePoint::duration(
+              inline_value.expiry.load(std::memory_order_acquire)));
+          for (std::size_t i = 0; i < wordCount(size); ++i) {
+            words[i] = inline_value.words[i].load(std::memory_order_acquire);
+          }
+
+          if (inline_value.sequence.load(std::memory_order_relaxed) !=
+              sequence) {
+            continue;
+          }
+
+          if (current != nullptr) {
+            return loadVersion(current, now, expiry_out);
+          }
+          if (expiry_out != nullptr) {
+            *expiry_out =
+                has_expiry ? std::make_optional(expiry) : std::nullopt;
+          }
+          if (has_expiry && expiry <= now) {
+            return std::nullopt;
+          }
+          return Value(reinterpret_cast<const char*>(words.data()), size);
+        }
+      } else {
+        return loadVersion(version.load(std::memory_order_acquire), now,
+                           expiry_out);
+      }
+    }
+
+    // Под блокировкой сегмента.
+    bool hasExpiry() const {
+      if (const Version* current = version.load(std::memory_order_relaxed)) {
+        return current->has_expiry;
+      }
+      if constexpr (kInlineValues) {
+        return inline_value.has_expiry.load(std::memory_order_relaxed);
+      } else {
+        return false;
+      }
+    }
+
+    // Под блокировкой сегмента.
+    std::optional<TimePoint> expiry() const {
+      if (const Version* current = version.load(std::memory_order_relaxed)) {
+        return current->has_expiry ? std::make_optional(current->expiry)
+                                   : std::nullopt;
+      }
+      if constexpr (kInlineValues) {
+        if (inline_value.has_expiry.load(std::memory_order_relaxed)) {
+          return TimePoint(typename TimePoint::duration(
+              inline_value.expiry.load(std::memory_order_relaxed)));
+        }
+      }
+      return std::nullopt;
+    }
+
+    // Под блокировкой сегмента.
+    Value value() const {
+      if (const Version* current = version.load(std::memory_order_relaxed)) {
+        return current->value;
+      }
+      if constexpr (kInlineValues) {
+        std::size_t size = inline_value.size.load(std::memory_order_relaxed);
+        std::array<uint64_t, kInlineWords> words;
+        for (std::size_t i = 0; i < wordCount(size); ++i) {
+          words[i] = inline_value.words[i].load(std::memory_order_relaxed);
+        }
+        return Value(reinterpret_cast<const char*>(words.data()), size);
+      } else {
+        return Value();
+      }
+    }
+
+   private:
+    static std::size_t wordCount(std::size_t bytes) { return (bytes + 7) / 8; }
+
+    static std::optional<Value> loadVersion(
+        const Version* version, TimePoint now,
+        std::optional<TimePoint>* expiry_out) {
+      if (expiry_out != nullptr) {
+        *expiry_out = version->has_expiry ? std::make_optional(version->expiry)
+                                          : std::nullopt;
+      }
+      if (version->isExpired(now)) {
+        return std::nullopt;
+      }
+      return version->value;
+    }
+  };
+
+  struct SegmentData {
+    TtlIndex ttl_index;
+    // Ближайшее время протухания в сегменте: removeOneExpiredEntry
+    // пропускает сегменты без протухших записей, не блокируя их.
+    std::atomic<TimePoint> next_expiry{TimePoint::max()};
+
+    void updateNextExpiry() {
+      next_expiry.store(
+          ttl_index.empty() ? TimePoint::max() : ttl_index.begin()->first,
+          std::memory_order_relaxed);
+    }
+  };
+
+  // Условие записи для set_impl: без него значение записывается всегда.
+  struct AlwaysReplace {
+    bool operator()(const Record*) const { return true; }
+  };
+
+  using KeyIndex =
+      ConcurrentHashMap<Key, Record, Hash, std::equal_to<>, SegmentData>;
+  using SortedKeyIndex = ConcurrentSkipList<Key>;
+
+ public:
+  // Инициализирует хранилище переданным множеством записей (см. KVStorage).
+  explicit ConcurrentKVStorage(std::span<InputEntry> entries,
+                               Clock clock = Clock(), Hash hash = Hash())
+      : clock_(std::move(clock)), key_index_(std::move(hash)) {
+    TimePoint now = Clock::now();
+
+    key_index_.reserve(entries.size());
+
+    for (auto& [key, value, ttl] : entries) {
+      set_impl(std::move(key), std::move(value), static_cast<Seconds>(ttl),
+               now, AlwaysReplace(), false);
+    }
+  }
+
+  // Присваивает по ключу key значение value (см. KVStorage::set).
+  // Блокирует сегмент ключа. O(log N) time complexity.
+  void set(Key key, Value value, uint32_t ttl) {
+    set_impl(std::move(key), std::move(value), static_cast<Seconds>(ttl),
+             Clock::now(), AlwaysReplace(), true);
+  }
+
+  // Удаляет запись по ключу key. Возвращает false, если ключа не было.
+  // Блокирует сегмент ключа. O(log N) time complexity.
+  bool remove(KeyView key) {
+    std::size_t hash = key_index_.hash(key);
+    auto segment = key_index_.lock(hash);
+    // Ключ может быть в медленном хранилище, даже если его нет в кеше.
+    if (write_behind_ != nullptr) {
+      write_behind_->push(Key(key), std::nullopt);
+    }
+    Entry* entry = segment.find(key, hash);
+    if (entry == nullptr) {
+      return false;
+    }
+
+    unindex(segment, entry, hash);
+    segment.erase(entry);
+
+    return true;
+  }
+
+  // Получает значение по ключу key. Не берет блокировок, кроме момента,
+  // когда ключ становится горячим.
+  // average-case O(1) time complexity.
+  std::optional<Value> get(KeyView key) const {
+    std::size_t hash = key_index_.hash(key);
+
+    if (hot_keys_ != nullptr) {
+      std::optional<Value> value;
+      // Горячий ключ без времени протухания читается без вызова часов.
+      if (hot_keys_->find(hash, key, [] { return Clock::now(); }, value)) {
+        hot_keys_->sample(hash);
+        return value;
+      }
+      if (hot_keys_->sample(hash)) {
+        promote(key, hash);
+      }
+    }
+
+    std::optional<TimePoint> expiry;
+    return lookup(key, hash, Clock::now(), expiry);
+  }
+
+  // Получает значение по ключу key, а при промахе загружает его вызовом
+  // loader(key) -> std::optional<Value> и сохраняет со временем жизни ttl.
+  // Одновременные промахи по одному ключу выполняют одну загрузку, остальные
+  // вызовы ждут ее результата, исключение loader получают все они. Ответ
+  // std::nullopt не кешируется. Загруженное значение не заменяет значение,
+  // записанное set во время загрузки. Не читает реплики горячих ключей.
+  template <typename Loader>
+  std::optional<Value> getOrLoad(KeyView key, Loader&& loader, uint32_t ttl) {
+    std::size_t hash = key_index_.hash(key);
+    TimePoint now = Clock::now();
+
+    std::optional<TimePoint> expiry;
+    if (auto value = lookup(key, hash, now, expiry)) {
+      if (expiry.has_value() && *expiry - now <= refreshWindow(ttl)) {
+        loads_.tryRun(key, [&] {
+          return refresh(key, loader, ttl, *expiry, *value);
+        });
+      }
+      return value;
+    }
+
+    return loads_.run(key, [&]() -> std::optional<Value> {
+      // Загрузка, завершившаяся перед началом этой, уже сохранила значение.
+      std::optional<TimePoint> unused;
+      if (auto value = lookup(key, hash, Clock::now(), unused)) {
+        return value;
+      }
+
+      std::optional<Value> loaded = loader(key);
+      if (!loaded.has_value()) {
+        return std::nullopt;
+      }
+      TimePoint loaded_at = Clock::now();
+      auto absent_or_expired = [&](const Record* existing) {
+        if (existing == nullptr) {
+          return true;
+        }
+        auto existing_expiry = existing->expiry();
+        return existing_expiry.has_value() && *existing_expiry <= loaded_at;
+      };
+      if (!set_impl(Key(key), *loaded, static_cast<Seconds>(ttl), loaded_at,
+                    absent_or_expired, false)) {
+        return get(key);
+      }
+      return loaded;
+    });
+  }
+
+  // Доля ttl getOrLoad, за которую до протухания значение загружается
+  // заново: вызов getOrLoad, заметивший это первым, перезагружает значение
+  // сам, а одновременные с ним возвращают текущее, не дожидаясь. 0 (по
+  // умолчанию) выключает обновление. Не должен выполняться одновременно с
+  // другими методами.
+  void setRefreshAhead(double fraction) {
+    refresh_ahead_ = std::clamp(fraction, 0.0, 1.0);
+  }
+
+  // Включает отложенную запись set и remove в backend (write-behind) или
+  // выключает ее (nullptr), дописав накопленное. Протухание и загрузки
+  // getOrLoad в backend не пишутся. Не должен выполняться одновременно с
+  // другими методами.
+  void setWriteBehind(std::shared_ptr<KVBackend> backend,
+                      WriteBehindOptions options = WriteBehindOptions()) {
+    write_behind_.reset();
+    if (backend != nullptr) {
+      write_behind_ =
+          std::make_unique<WriteBehindQueue>(std::move(backend), options);
+    }
+  }
+
+  // Дожидается записи в backend всех set и remove, завершившихся до вызова.
+  void flushWriteBehind() {
+    if (write_behind_ != nullptr) {
+      write_behind_->flush();
+    }
+  }
+
+  // Возвращает следующие count записей начиная с key в лексикографическом
+  // порядке ключей. Не берет блокировок.
+  // O(log N + count) time complexity.
+  std::vector<OutputEntry> getManySorted(KeyView key, uint32_t count) const {
+    std::vector<OutputEntry> result;
+    result.reserve(count);
+    if (count == 0) {
+      return result;
+    }
+
+    TimePoint now = Clock::now();
+
+    EpochDomain::Guard guard;
+    sorted_index_.scanWhile(key, [&](const Key& sorted_key) {
+      // Ключ мог быть удален после того, как обход его прочитал.
+      const Entry* entry = key_index_.find(sorted_key);
+      if (entry != nullptr) {
+        if (auto value = entry->mapped().load(now)) {
+          result.emplace_back(sorted_key, std::move(*value));
+        }
+      }
+      return result.size() < count;
+    });
+
+    return result;
+  }
+
+  // Удаляет протухшую запись и возвращает ее. Если удалять нечего, то вернет
+  // std::nullopt. Параллельные вызовы начинают с разных сегментов и
+  // блокируют только сегменты, в которых есть протухшие записи.
+  // O(kSegments + log N) time complexity.
+  std::optional<OutputEntry> removeOneExpiredEntry() {
+    TimePoint now = Clock::now();
+    std::size_t start = expiry_cursor_.fetch_add(1, std::memory_order_relaxed);
+
+    for (std::size_t i = 0; i < KeyIndex::kSegments; ++i) {
+      std::size_t index = (start + i) % KeyIndex::kSegments;
+      if (!(key_index_.peek(index).next_expiry.load(
+                std::memory_order_relaxed) <= now)) {
+        continue;
+      }
+
+      auto segment = key_index_.lockSegment(index);
+      TtlIndex& ttl_index = segment.data().ttl_index;
+      if (ttl_index.empty() || !(ttl_index.begin()->first <= now)) {
+        continue;
+      }
+
+      Entry* entry = ttl_index.begin()->second;
+      // Копируем, а не забираем: запись еще могут читать другие потоки.
+      OutputEntry result(entry->key(), entry->mapped().value());
+
+      unindex(segment, entry, key_index_.hash(KeyView(entry->key())));
+      segment.erase(entry);
+
+      return result;
+    }
+
+    return std::nullopt;
+  }
+
+  // Включает реплики горячих ключей с заданными параметрами или выключает их
+  // (std::nullopt). Не должен выполняться одновременно с другими методами.
+  void setHotKeyReplication(std::optional<HotKeyOptions> options) {
+    if (options.has_value()) {
+      hot_keys_ = std::make_unique<HotKeyReplicas<TimePoint>>(*options);
+    } else {
+      hot_keys_.reset();
+    }
+  }
+
+  // Число реплицируемых горячих ключей.
+  std::size_t hotKeyCount() const {
+    return hot_keys_ != nullptr ? hot_keys_->size() : 0;
+  }
+
+  // Число записей, включая протухшие, но еще не удаленные (точное в
+  // отсутствие конкурентных изменений).
+  std::size_t size() const { return key_index_.size(); }
+
+ private:
+  Clock clock_;
+  // mutable: get блокирует сегмент, когда делает ключ горячим.
+  mutable KeyIndex key_index_;
+  SortedKeyIndex sorted_index_;
+  // Сегмент, с которого начнет поиск следующий removeOneExpiredEntry.
+  std::atomic<std::size_t> expiry_cursor_{0};
+  std::unique_ptr<HotKeyReplicas<TimePoint>> hot_keys_;
+  SingleFlight<std::optional<Value>> loads_;
+  double refresh_ahead_ = 0;
+  // Уничтожается первой и дописывает накопленное, пока хранилище цело.
+  std::unique_ptr<WriteBehindQueue> write_behind_;
+
+  std::optional<Value> lookup(KeyView key, std::size_t hash, TimePoint now,
+                              std::optional<TimePoint>& expiry) const {
+    EpochDomain::Guard guard;
+    const Entry* entry = key_index_.find(key, hash);
+    if (entry == nullptr) {
+      return std::nullopt;
+    }
+
+    return entry->mapped().load(now, &expiry);
+  }
+
+  Duration refreshWindow(uint32_t ttl) const {
+    return std::chrono::duration_cast<Duration>(
+        std::chrono::duration<double>(refresh_ahead_ * ttl));
+  }
+
+  // Заблаговременно перезагружает значение, которое протухнет в момент
+  // expiry. Новое значение записывается, только если запись с тех пор не
+  // менялась. Ошибка загрузки не мешает вернуть текущее значение current.
+  template <typename Loader>
+  std::optional<Value> refresh(KeyView key, Loader& loader, uint32_t ttl,
+                               TimePoint expiry, const Value& current) {
+    std::optional<Value> loaded;
+    try {
+      loaded = loader(key);
+    } catch (...) {
+      return current;
+    }
+    if (!loaded.has_value()) {
+      return current;
+    }
+
+    auto unchanged = [&](const Record* existing) {
+      return existing != nullptr && existing->expiry() == expiry;
+    };
+    if (!set_impl(Key(key), *loaded, static_cast<Seconds>(ttl), Clock::now(),
+                  unchanged, false)) {
+      return current;
+    }
+    return loaded;
+  }
+
+  // Под блокировкой сегмента: удаляет запись с хешем hash из вторичных
+  // индексов и реплик.
+  void unindex(typename KeyIndex::Locked& segment, Entry* entry,
+               std::size_t hash) {
+    if (entry->mapped().hasExpiry()) {
+      SegmentData& data = segment.data();
+      data.ttl_index.erase(entry->mapped().ttl_it);
+      data.updateNextExpiry();
+    }
+    sorted_index_.erase(entry->key());
+    if (hot_keys_ != nullptr && hot_keys_->contains(hash)) {
+      hot_keys_->erase(hash, entry->key());
+    }
+  }
+
+  // Копирует значение ключа в реплики. Блокировка сегмента упорядочивает
+  // копирование с set и remove этого ключа.
+  void promote(KeyView key, std::size_t hash) const {
+    auto segment = key_index_.lock(hash);
+    if (const Entry* entry = segment.find(key, hash)) {
+      hot_keys_->promote(hash, key, entry->mapped().value(),
+                         entry->mapped().expiry());
+    }
+  }
+
+  // Добавляет запись в хранилище. Версия большого значения строится до
+  // блокировки сегмента, чтобы не держать ее во время аллокаций.
+  // may_replace(existing) под блокировкой сегмента решает, записывать ли
+  // значение (existing == nullptr, если ключа нет); возвращает, записано ли
+  // оно. С write_behind изменение уходит в backend в порядке записи.
+  template <typename MayReplace>
+  bool set_impl(Key key, Value value, Seconds ttl, TimePoint now,
+                MayReplace&& may_replace, bool write_behind) {
+    bool has_expiry = ttl != kNoExpiry;
+    TimePoint expiry =
+        has_expiry ? now + static_cast<Duration>(ttl) : TimePoint();
+
+    std::optional<Value> backend_value;
+    if (write_behind && write_behind_ != nullptr) {
+      backend_value = value;
+    }
+
+    PreparedValue prepared{nullptr, Value(), expiry, has_expiry};
+    if (kInlineValues && value.size() <= InlineValueBytes) {
+      prepared.bytes = std::move(value);
+    } else {
+      prepared.version = new Version{std::move(value), expiry, has_expiry};
+    }
+
+    std::size_t hash = key_index_.hash(KeyView(key));
+    auto segment = key_index_.lock(hash);
+    if constexpr (!std::is_same_v<std::decay_t<MayReplace>, AlwaysReplace>) {
+      const Entry* existing = segment.find(KeyView(key), hash);
+      if (!may_replace(existing != nullptr ? &existing->mapped() : nullptr)) {
+        delete prepared.version;
+        return false;
+      }
+    }
+    auto [entry, inserted] = segment.lazy_emplace(
+        KeyView(key), hash, [&] { return key; }, std::move(prepared));
+
+    Record& record = entry->mapped();
+    SegmentData& data = segment.data();
+
+    if (inserted) {
+      // Ключ попадает в SortedKeyIndex под блокировкой сегмента, поэтому
+      // вставки и удаления одного ключа в нем не переупорядочиваются.
+      sorted_index_.insert(std::move(key));
+    } else {
+      if (record.hasExpiry()) {
+        data.ttl_index.erase(record.ttl_it);
+      }
+      if (const Version* old_version = record.assign(std::move(prepared))) {
+        EpochDomain::instance().retire(const_cast<Version*>(old_version));
+      }
+      if (hot_keys_ != nullptr && hot_keys_->contains(hash)) {
+        hot_keys_->update(hash, entry->key(), record.value(),
+                          record.expiry());
+      }
+    }
+
+    if (has_expiry) {
+      record.ttl_it = data.ttl_index.emplace(expiry, entry);
+    }
+    data.updateNextExpiry();
+
+    if (backend_value.has_value()) {
+      write_behind_->push(entry->key(), std::move(*backend_value));
+    }
+    return true;
+  }
+};
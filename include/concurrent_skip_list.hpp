@@ -0,0 +1,312 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "epoch_reclaimer.hpp"
+
+// Lock-free упорядоченное множество на skip list (Herlihy, Shavit, "The Art
+// of Multiprocessor Programming", гл. 14) для конкурентного упорядоченного
+// индекса. Вставка публикует узел одним CAS на нижнем уровне и затем
+// достраивает верхние уровни. Удаление логически помечает указатели next узла
+// сверху вниз (младший бит); пометка нижнего уровня определяет, какой поток
+// удалил ключ. Помеченные узлы физически исключаются поиском, а память
+// освобождается через EpochDomain.
+//
+// Чтение (contains, scan) не выполняет CAS и не повторяет проход: оно идет по
+// указателям, пропуская помеченные узлы, и поэтому не блокируется ни
+// писателями, ни другими читателями.
+//
+// Key должен конструироваться по умолчанию: такой ключ хранит голова списка.
+template <typename Key, typename Compare = std::less<>>
+class ConcurrentSkipList {
+ public:
+  static constexpr int kMaxHeight = 24;
+
+ private:
+  struct Node {
+    Key key;
+    int height;
+    // Узел освобождается, когда и вставивший, и удаливший его потоки
+    // закончили с ним работать (см. release).
+    std::atomic<int> refs{2};
+    // Помеченный указатель: младший бит — признак удаления узла на уровне.
+    std::atomic<uintptr_t> next[1];
+
+    template <typename K>
+    Node(K&& key, int height) : key(std::forward<K>(key)), height(height) {}
+  };
+
+  static Node* pointer(uintptr_t link) {
+    return reinterpret_cast<Node*>(link & ~uintptr_t{1});
+  }
+  static bool marked(uintptr_t link) { return (link & 1) != 0; }
+  static uintptr_t unmarked(uintptr_t link) { return link & ~uintptr_t{1}; }
+  static uintptr_t link(Node* node) {
+    return reinterpret_cast<uintptr_t>(node);
+  }
+
+ public:
+  explicit ConcurrentSkipList(Compare compare = Compare())
+      : compare_(std::move(compare)), head_(allocate(Key(), kMaxHeight)) {}
+
+  ConcurrentSkipList(const ConcurrentSkipList&) = delete;
+  ConcurrentSkipList& operator=(const ConcurrentSkipList&) = delete;
+
+  // Не должен выполняться одновременно с другими операциями.
+  ~ConcurrentSkipList() {
+    Node* node = pointer(head_->next[0].load());
+    while (node != nullptr) {
+      Node* next = pointer(node->next[0].load());
+      deallocate(node);
+      node = next;
+    }
+    deallocate(head_);
+  }
+
+  // Приблизительное число ключей (точное в отсутствие конкурентных
+  // изменений).
+  std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  // Вставляет key, если его нет. Возвращает false, если ключ уже есть.
+  template <typename K>
+  bool insert(K&& key) {
+    EpochDomain::Guard guard;
+    Node* preds[kMaxHeight];
+    Node* succs[kMaxHeight];
+    Node* node = allocate(std::forward<K>(key), randomHeight());
+
+    while (true) {
+      if (find(node->key, preds, succs)) {
+        deallocate(node);
+        return false;
+      }
+      for (int level = 0; level < node->height; ++level) {
+        node->next[level].store(link(succs[level]), std::memory_order_relaxed);
+      }
+      uintptr_t expected = link(succs[0]);
+      if (preds[0]->next[0].compare_exchange_strong(expected, link(node))) {
+        break;
+      }
+    }
+    size_.fetch_add(1, std::memory_order_relaxed);
+
+    linkUpperLevels(node, preds, succs);
+    release(node);
+    return true;
+  }
+
+  // Удаляет key. Возвращает false, если ключа нет.
+  template <typename K>
+  bool erase(const K& key) {
+    EpochDomain::Guard guard;
+    Node* preds[kMaxHeight];
+    Node* succs[kMaxHeight];
+
+    while (true) {
+      if (!find(key, preds, succs)) {
+        return false;
+      }
+      Node* node = succs[0];
+
+      for (int level = node->height - 1; level > 0; --level) {
+        uintptr_t next = node->next[level].load();
+        while (!marked(next) &&
+               !node->next[level].compare_exchange_weak(next, next | 1)) {
+        }
+      }
+
+      uintptr_t next = node->next[0].load();
+      while (!marked(next)) {
+        if (node->next[0].compare_exchange_weak(next, next | 1)) {
+          size_.fetch_sub(1, std::memory_order_relaxed);
+          unlink(node->key);
+          release(node);
+          return true;
+        }
+      }
+      // Узел удалил другой поток; ключ мог быть вставлен заново.
+    }
+  }
+
+  template <typename K>
+  bool contains(const K& key) const {
+    EpochDomain::Guard guard;
+    Node* node = lowerBound(key);
+    return node != nullptr && !compare_(key, node->key) &&
+           !marked(node->next[0].load());
+  }
+
+  // Передает visit(key) не более count ключей, не меньших from, в порядке
+  // возрастания. Ключи, вставленные или удаленные во время обхода, могут как
+  // попасть, так и не попасть в результат.
+  template <typename K, typename Visit>
+  void scan(const K& from, std::size_t count, Visit&& visit) const {
+    if (count == 0) {
+      return;
+    }
+    scanWhile(from, [&](const Key& key) {
+      visit(key);
+      return --count > 0;
+    });
+  }
+
+  // Передает visit(key) ключи, не меньшие from, в порядке возрастания, пока
+  // visit возвращает true.
+  template <typename K, typename Visit>
+  void scanWhile(const K& from, Visit&& visit) const {
+    EpochDomain::Guard guard;
+    for (Node* node = lowerBound(from); node != nullptr;) {
+      uintptr_t next = node->next[0].load(std::memory_order_acquire);
+      if (!marked(next) && !visit(static_cast<const Key&>(node->key))) {
+        return;
+      }
+      node = pointer(next);
+    }
+  }
+
+ private:
+  static constexpr std::size_t nodeBytes(int height) {
+    return sizeof(Node) + (height - 1) * sizeof(std::atomic<uintptr_t>);
+  }
+
+  template <typename K>
+  static Node* allocate(K&& key, int height) {
+    void* memory =
+        ::operator new(nodeBytes(height), std::align_val_t(alignof(Node)));
+    auto* node = new (memory) Node(std::forward<K>(key), height);
+    for (int level = 1; level < height; ++level) {
+      std::construct_at(&node->next[level], 0);
+    }
+    return node;
+  }
+
+  static void deallocate(void* memory) {
+    std::destroy_at(static_cast<Node*>(memory));
+    ::operator delete(memory, std::align_val_t(alignof(Node)));
+  }
+
+  static int randomHeight() {
+    thread_local uint64_t state =
+        reinterpret_cast<uintptr_t>(&state) | 0x9E3779B97F4A7C15ull;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    // Вероятность подняться на уровень выше — 1/4, как в Redis.
+    int height = 1;
+    for (uint64_t bits = state; height < kMaxHeight && (bits & 3) == 0;
+         bits >>= 2) {
+      ++height;
+    }
+    return height;
+  }
+
+  // Первый узел (возможно, помеченный) с ключом не меньше key. Не изменяет
+  // список.
+  template <typename K>
+  Node* lowerBound(const K& key) const {
+    Node* pred = head_;
+    Node* curr = nullptr;
+    for (int level = kMaxHeight - 1; level >= 0; --level) {
+      curr = pointer(pred->next[level].load(std::memory_order_acquire));
+      while (curr != nullptr && compare_(curr->key, key)) {
+        pred = curr;
+        curr = pointer(curr->next[level].load(std::memory_order_acquire));
+      }
+    }
+    return curr;
+  }
+
+  // Заполняет preds/succs для key на всех уровнях, исключая встреченные
+  // помеченные узлы. Возвращает true, если в списке есть непомеченный узел с
+  // ключом key (он в succs[0]). С past_equal проходит и мимо непомеченных
+  // узлов с ключом key.
+  template <typename K>
+  bool find(const K& key, Node** preds, Node** succs,
+            bool past_equal = false) const {
+  retry:
+    Node* pred = head_;
+    for (int level = kMaxHeight - 1; level >= 0; --level) {
+      Node* curr = pointer(pred->next[level].load());
+      while (curr != nullptr) {
+        uintptr_t next = curr->next[level].load();
+        if (marked(next)) {
+          uintptr_t expected = link(curr);
+          if (!pred->next[level].compare_exchange_strong(expected,
+                                                         unmarked(next))) {
+            goto retry;
+          }
+          curr = pointer(next);
+          continue;
+        }
+        if (past_equal ? compare_(key, curr->key) : !compare_(curr->key, key)) {
+          break;
+        }
+        pred = curr;
+        curr = pointer(next);
+      }
+      preds[level] = pred;
+      succs[level] = curr;
+    }
+    return succs[0] != nullptr && !compare_(key, succs[0]->key);
+  }
+
+  // Исключает со всех уровней помеченные узлы с ключом key. Проходит и мимо
+  // непомеченного узла с тем же ключом: удаленный узел может оказаться на
+  // верхнем уровне за вставленным заново.
+  template <typename K>
+  void unlink(const K& key) const {
+    Node* preds[kMaxHeight];
+    Node* succs[kMaxHeight];
+    find(key, preds, succs, /*past_equal=*/true);
+  }
+
+  // Достраивает уровни 1..height-1 только что вставленного узла. Если узел
+  // уже удаляют, прекращает и исключает его с тех уровней, куда успел
+  // вставить.
+  void linkUpperLevels(Node* node, Node** preds, Node** succs) {
+    for (int level = 1; level < node->height; ++level) {
+      while (true) {
+        uintptr_t next = node->next[level].load();
+        if (marked(next)) {
+          unlink(node->key);
+          return;
+        }
+        if (next != link(succs[level]) &&
+            !node->next[level].compare_exchange_strong(next,
+                                                       link(succs[level]))) {
+          continue;
+        }
+        uintptr_t expected = link(succs[level]);
+        if (preds[level]->next[level].compare_exchange_strong(expected,
+                                                              link(node))) {
+          break;
+        }
+        if (!find(node->key, preds, succs) || succs[0] != node) {
+          unlink(node->key);
+          return;
+        }
+      }
+    }
+    if (marked(node->next[0].load())) {
+      unlink(node->key);
+    }
+  }
+
+  // Узел недостижим, когда оба потока — вставивший и удаливший — закончили
+  // исключать его со всех уровней.
+  void release(Node* node) {
+    if (node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      EpochDomain::instance().retire(node, &deallocate);
+    }
+  }
+
+  [[no_unique_address]] Compare compare_;
+  Node* head_;
+  std::atomic<std::size_t> size_{0};
+};
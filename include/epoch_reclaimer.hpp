@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation для lock-free структур. Поток, читающий общие узлы,
+// держит EpochDomain::Guard; узел, исключенный из структуры, передается в
+// retire и освобождается, когда все потоки, которые могли его видеть, вышли
+// из своих Guard. Глобальная эпоха продвигается, только если все активные
+// потоки уже наблюдали текущую; объект, удаленный в эпоху e, освобождается
+// после того, как эпоха достигнет e + 2.
+//
+// Домен один на процесс: потоки регистрируются в нем при первом Guard и
+// освобождают запись при завершении, передавая неосвобожденные объекты в
+// общий список.
+class EpochDomain {
+  struct Retired {
+    void* object;
+    void (*deleter)(void*);
+    uint64_t epoch;
+  };
+
+  // Запись потока. Записи не удаляются до конца работы домена и
+  // переиспользуются новыми потоками. Каждая занимает свою кеш-линию: Guard
+  // читателя пишет только в нее.
+  struct alignas(64) Record {
+    // (эпоха << 1) | 1, пока поток внутри Guard, иначе 0.
+    std::atomic<uint64_t> state{0};
+    std::atomic<bool> in_use{true};
+    Record* next = nullptr;
+    uint32_t nesting = 0;
+    std::size_t retired_since_collect = 0;
+    std::vector<Retired> limbo;
+  };
+
+  // Владеет записью текущего потока и возвращает ее домену при выходе из
+  // потока.
+  class ThreadHandle {
+   public:
+    ~ThreadHandle() {
+      if (record_ != nullptr) {
+        EpochDomain::instance().unregister(record_);
+      }
+    }
+
+    Record* get() {
+      if (record_ == nullptr) {
+        record_ = EpochDomain::instance().acquireRecord();
+      }
+      return record_;
+    }
+
+   private:
+    Record* record_ = nullptr;
+  };
+
+ public:
+  // Сколько retire между попытками продвинуть эпоху и освободить объекты.
+  static constexpr std::size_t kCollectInterval = 64;
+
+  static EpochDomain& instance() {
+    static EpochDomain domain;
+    return domain;
+  }
+
+  EpochDomain(const EpochDomain&) = delete;
+  EpochDomain& operator=(const EpochDomain&) = delete;
+
+  ~EpochDomain() {
+    Record* record = records_.load();
+    while (record != nullptr) {
+      freeAll(record->limbo);
+      delete std::exchange(record, record->next);
+    }
+    freeAll(orphans_);
+  }
+
+  // Защищает читаемые узлы от освобождения. Допускает вложенность.
+  class Guard {
+   public:
+    Guard() : record_(localRecord()) {
+      if (record_->nesting++ == 0) {
+        uint64_t epoch = instance().epoch_.load();
+        record_->state.store((epoch << 1) | 1);
+      }
+    }
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+    ~Guard() {
+      if (--record_->nesting == 0) {
+        record_->state.store(0, std::memory_order_release);
+      }
+    }
+
+   private:
+    Record* record_;
+  };
+
+  // Передает объект, уже недостижимый для новых читателей, на отложенное
+  // удаление.
+  template <typename T>
+  void retire(T* object) {
+    retire(object, [](void* p) { delete static_cast<T*>(p); });
+  }
+
+  void retire(void* object, void (*deleter)(void*)) {
+    Record* record = localRecord();
+    record->limbo.push_back({object, deleter, epoch_.load()});
+    if (++record->retired_since_collect == kCollectInterval) {
+      record->retired_since_collect = 0;
+      collect(record);
+    }
+  }
+
+  // Текущая глобальная эпоха (для тестов).
+  uint64_t epoch() const { return epoch_.load(); }
+
+ private:
+  EpochDomain() = default;
+
+  static Record* localRecord() {
+    thread_local ThreadHandle handle;
+    return handle.get();
+  }
+
+  Record* acquireRecord() {
+    for (Record* record = records_.load(); record != nullptr;
+         record = record->next) {
+      bool expected = false;
+      if (record->in_use.compare_exchange_strong(expected, true)) {
+        return record;
+      }
+    }
+    auto* record = new Record();
+    record->next = records_.load();
+    while (!records_.compare_exchange_weak(record->next, record)) {
+    }
+    return record;
+  }
+
+  void unregister(Record* record) {
+    if (!record->limbo.empty()) {
+      std::lock_guard lock(orphans_mutex_);
+      orphans_.insert(orphans_.end(), record->limbo.begin(),
+                      record->limbo.end());
+      record->limbo.clear();
+    }
+    record->in_use.store(false, std::memory_order_release);
+  }
+
+  // Продвигает эпоху, если все активные потоки наблюдали текущую.
+  bool tryAdvance() {
+    uint64_t epoch = epoch_.load();
+    for (Record* record = records_.load(); record != nullptr;
+         record = record->next) {
+      uint64_t state = record->state.load();
+      if ((state & 1) != 0 && (state >> 1) != epoch) {
+        return false;
+      }
+    }
+    return epoch_.compare_exchange_strong(epoch, epoch + 1);
+  }
+
+  void collect(Record* record) {
+    tryAdvance();
+    uint64_t epoch = epoch_.load();
+    freeExpired(record->limbo, epoch);
+
+    std::unique_lock lock(orphans_mutex_, std::try_to_lock);
+    if (lock.owns_lock()) {
+      freeExpired(orphans_, epoch);
+    }
+  }
+
+  static void freeExpired(std::vector<Retired>& retired, uint64_t epoch) {
+    std::size_t kept = 0;
+    for (const Retired& object : retired) {
+      if (object.epoch + 2 <= epoch) {
+        object.deleter(object.object);
+      } else {
+        retired[kept++] = object;
+      }
+    }
+    retired.resize(kept);
+  }
+
+  static void freeAll(std::vector<Retired>& retired) {
+    for (const Retired& object : retired) {
+      object.deleter(object.object);
+    }
+    retired.clear();
+  }
+
+  std::atomic<uint64_t> epoch_{0};
+  std::atomic<Record*> records_{nullptr};
+  std::mutex orphans_mutex_;
+  std::vector<Retired> orphans_;
+};
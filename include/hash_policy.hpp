@@ -0,0 +1,246 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__AES__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#define KV_STORAGE_HAS_AES_HASH 1
+#endif
+
+// Концепт для политики хеширования ключей KVStorage. KeyView — тип, которым
+// ключ передается в поиск (см. kv_traits.hpp).
+template <typename H, typename KeyView = std::string_view>
+concept KVHashPolicy = std::copy_constructible<H> &&
+                       requires(const H& hash, KeyView key) {
+                         { hash(key) } -> std::convertible_to<std::size_t>;
+                       };
+
+namespace hash_detail {
+
+inline constexpr uint64_t kSecret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull};
+
+inline uint64_t randomSeed() {
+  std::random_device device;
+  return (static_cast<uint64_t>(device()) << 32) | device();
+}
+
+inline void mum(uint64_t& a, uint64_t& b) {
+  __uint128_t product = static_cast<__uint128_t>(a) * b;
+  a = static_cast<uint64_t>(product);
+  b = static_cast<uint64_t>(product >> 64);
+}
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+  mum(a, b);
+  return a ^ b;
+}
+
+inline uint64_t read8(const unsigned char* p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint64_t read4(const unsigned char* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Ключи длиной 1..3 байта.
+inline uint64_t read3(const unsigned char* p, std::size_t len) {
+  return (static_cast<uint64_t>(p[0]) << 16) |
+         (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+}
+
+// Перемешивание seed, которое wyhash выполняет в начале каждого вызова.
+// Политики делают его один раз при создании.
+inline uint64_t prepareSeed(uint64_t seed) {
+  return seed ^ mix(seed ^ kSecret[0], kSecret[1]);
+}
+
+// wyhash (final v4): на коротких ключах обходится одним-двумя умножениями
+// 64x64->128 без циклов. seed должен быть подготовлен prepareSeed.
+inline uint64_t wyhash(std::string_view key, uint64_t seed) {
+  const auto* p = reinterpret_cast<const unsigned char*>(key.data());
+  std::size_t len = key.size();
+
+  uint64_t a = 0;
+  uint64_t b = 0;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      std::size_t shift = (len >> 3) << 2;
+      a = (read4(p) << 32) | read4(p + shift);
+      b = (read4(p + len - 4) << 32) | read4(p + len - 4 - shift);
+    } else if (len > 0) {
+      a = read3(p, len);
+    }
+  } else {
+    std::size_t i = len;
+    if (i >= 48) {
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+      do {
+        seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+        seed1 = mix(read8(p + 16) ^ kSecret[2], read8(p + 24) ^ seed1);
+        seed2 = mix(read8(p + 32) ^ kSecret[3], read8(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i >= 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = read8(p + i - 16);
+    b = read8(p + i - 8);
+  }
+
+  a ^= kSecret[1];
+  b ^= seed;
+  mum(a, b);
+  return mix(a ^ kSecret[0] ^ len, b ^ kSecret[1]);
+}
+
+#ifdef KV_STORAGE_HAS_AES_HASH
+// Хеш длинных (> 32 B) ключей на AES-NI: два независимых потока по 16 B,
+// каждый блок перемешивается одним раундом AES, в конце три раунда сводят
+// потоки. Последние 32 B читаются с перекрытием, длина участвует в состоянии.
+inline uint64_t aesHash(std::string_view key, uint64_t seed) {
+  const auto* p = reinterpret_cast<const unsigned char*>(key.data());
+  std::size_t len = key.size();
+
+  const __m128i round_key = _mm_set_epi64x(
+      static_cast<int64_t>(seed), static_cast<int64_t>(seed ^ kSecret[0]));
+  __m128i state0 = _mm_xor_si128(
+      round_key, _mm_set_epi64x(static_cast<int64_t>(len),
+                                static_cast<int64_t>(kSecret[1])));
+  __m128i state1 = _mm_xor_si128(
+      round_key, _mm_set_epi64x(static_cast<int64_t>(kSecret[2]),
+                                static_cast<int64_t>(len)));
+
+  auto load = [](const unsigned char* at) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(at));
+  };
+
+  const unsigned char* last = p + len - 32;
+  for (; p < last; p += 32) {
+    state0 = _mm_aesenc_si128(_mm_xor_si128(state0, load(p)), round_key);
+    state1 = _mm_aesenc_si128(_mm_xor_si128(state1, load(p + 16)), round_key);
+  }
+  state0 = _mm_aesenc_si128(_mm_xor_si128(state0, load(last)), round_key);
+  state1 = _mm_aesenc_si128(_mm_xor_si128(state1, load(last + 16)), round_key);
+
+  __m128i state = _mm_aesenc_si128(state0, state1);
+  state = _mm_aesenc_si128(state, round_key);
+  state = _mm_aesenc_si128(state, round_key);
+
+  return static_cast<uint64_t>(_mm_extract_epi64(state, 0)) ^
+         static_cast<uint64_t>(_mm_extract_epi64(state, 1));
+}
+#endif
+
+}  // namespace hash_detail
+
+// Политика хеширования по умолчанию. Каждый экземпляр получает случайный
+// seed, поэтому клиент не может заранее подобрать ключи, попадающие в одну
+// корзину (hash flooding). Для воспроизводимости seed можно передать явно.
+// Короткие ключи хешируются wyhash, длинные — через AES-NI, если он
+// доступен при компиляции.
+class SeededHash {
+ public:
+  using is_transparent = void;
+
+  SeededHash() : SeededHash(hash_detail::randomSeed()) {}
+  explicit SeededHash(uint64_t seed)
+      : seed_(seed), mixed_seed_(hash_detail::prepareSeed(seed)) {}
+
+  std::size_t operator()(std::string_view key) const {
+#ifdef KV_STORAGE_HAS_AES_HASH
+    if (key.size() > 32) {
+      return hash_detail::aesHash(key, mixed_seed_);
+    }
+#endif
+    return hash_detail::wyhash(key, mixed_seed_);
+  }
+
+  // Ключи фиксированного размера без padding (UUID, массивы байт)
+  // хешируются по своему объектному представлению.
+  template <typename K>
+    requires(!std::convertible_to<const K&, std::string_view> &&
+             std::has_unique_object_representations_v<K>)
+  std::size_t operator()(const K& key) const {
+    return hash_detail::wyhash(
+        std::string_view(reinterpret_cast<const char*>(&key), sizeof(K)),
+        mixed_seed_);
+  }
+
+  uint64_t seed() const { return seed_; }
+
+ private:
+  uint64_t seed_;
+  uint64_t mixed_seed_;
+};
+
+// Несидируемый std::hash<std::string_view>, как до введения политик.
+struct StdHash {
+  using is_transparent = void;
+
+  std::size_t operator()(std::string_view key) const {
+    return std::hash<std::string_view>{}(key);
+  }
+};
+
+// Хеш целочисленных ключей без перемешивания: плотные последовательные
+// идентификаторы раскладываются по корзинам без коллизий. Ключи с общим
+// шагом, кратным степени двойки, попадают в одни и те же корзины — для них
+// нужен MultiplyShiftHash.
+struct IdentityHash {
+  template <std::integral K>
+  std::size_t operator()(K key) const {
+    return static_cast<std::size_t>(key);
+  }
+};
+
+// Multiply-shift для целочисленных ключей: одно умножение 64x64->128 на
+// случайный нечетный множитель. Половины произведения складываются через
+// xor, поэтому младшие биты, по которым выбирается корзина, зависят от всех
+// битов ключа.
+class MultiplyShiftHash {
+ public:
+  MultiplyShiftHash() : MultiplyShiftHash(hash_detail::randomSeed()) {}
+  explicit MultiplyShiftHash(uint64_t seed)
+      : multiplier_(hash_detail::prepareSeed(seed) | 1) {}
+
+  template <std::integral K>
+  std::size_t operator()(K key) const {
+    return hash_detail::mix(static_cast<uint64_t>(key), multiplier_);
+  }
+
+ private:
+  uint64_t multiplier_;
+};
+
+// Финальное перемешивание хеша (fmix64 из MurmurHash3). Его применяют
+// структуры, которым нужны все биты хеша (фильтр Блума, скетчи), чтобы они
+// работали и со слабыми политиками вроде IdentityHash.
+inline uint64_t finalizeHash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
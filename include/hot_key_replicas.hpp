@@ -0,0 +1,381 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+struct HotKeyOptions {
+  // Число реплик. Поток читает из реплики со своим номером по модулю
+  // replicas, поэтому при replicas не меньше числа ядер у каждого ядра
+  // (точнее, у каждого потока) своя копия горячих ключей.
+  std::size_t replicas = std::max(1u, std::thread::hardware_concurrency());
+  // get учитывается в счетчиках обращений с вероятностью 1 / sample_rate.
+  uint32_t sample_rate = 64;
+  // Сколько выборок делают ключ горячим. Счетчики периодически делятся
+  // пополам, поэтому горячим становится ключ с высокой текущей частотой.
+  uint32_t threshold = 16;
+};
+
+// Реплики горячих ключей для многопоточного хранилища. Выборка обращений в
+// get находит до kCapacity самых частых ключей; их значения копируются в
+// каждую реплику, и get горячего ключа читает только реплику своего потока —
+// без поиска в хеш-индексе, блокировок и записи в общую память. Хранилище
+// обновляет реплики при set и remove горячего ключа под блокировкой его
+// сегмента.
+//
+// Реплицируются только ключи до kMaxKeyBytes и значения до kMaxValueBytes:
+// они копируются в реплику целиком под seqlock, как inline-значения
+// ConcurrentKVStorage.
+template <typename TimePoint>
+class HotKeyReplicas {
+ public:
+  static constexpr std::size_t kCapacity = 8;
+  static constexpr std::size_t kMaxKeyBytes = 32;
+  static constexpr std::size_t kMaxValueBytes = 64;
+  static constexpr std::size_t kCounters = 1024;
+  // Через сколько выборок счетчики делятся пополам.
+  static constexpr uint64_t kDecayInterval = 4096;
+  // Сколько выборок поток накапливает до обновления общего счетчика.
+  static constexpr uint32_t kSampleBatch = 16;
+
+ private:
+  using Rep = typename TimePoint::rep;
+
+  // Копия горячей записи в реплике, защищенная seqlock. Поля атомарны и
+  // пишутся с release, а читаются с acquire (см. ConcurrentKVStorage).
+  struct alignas(64) Item {
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint8_t> key_size{0};
+    std::atomic<uint8_t> value_size{0};
+    std::atomic<bool> has_expiry{false};
+    // 0 — слот пуст.
+    std::atomic<uint64_t> hash{0};
+    std::atomic<Rep> expiry{0};
+    std::array<std::atomic<uint64_t>, kMaxKeyBytes / 8> key{};
+    std::array<std::atomic<uint64_t>, kMaxValueBytes / 8> value{};
+  };
+
+  struct Replica {
+    std::array<Item, kCapacity> items;
+  };
+
+ public:
+  explicit HotKeyReplicas(HotKeyOptions options)
+      : options_(options),
+        replica_count_(std::max<std::size_t>(1, options.replicas)),
+        replicas_(new Replica[replica_count_]) {
+    options_.sample_rate = std::max<uint32_t>(1, options_.sample_rate);
+  }
+
+  HotKeyReplicas(const HotKeyReplicas&) = delete;
+  HotKeyReplicas& operator=(const HotKeyReplicas&) = delete;
+
+  // Без блокировок: ищет key в реплике текущего потока. Возвращает false,
+  // если ключ не горячий; иначе записывает в value значение или
+  // std::nullopt, если запись протухла к моменту now(). Часы now()
+  // вызываются, только если у записи есть время протухания. Слот ищется по
+  // directory_ (одна кеш-линия), и реплика читается, только если тег
+  // совпал: get негорячего ключа не трогает реплик.
+  template <typename Now>
+  bool find(std::size_t hash, std::string_view key, const Now& now,
+            std::optional<std::string>& value) const {
+    uint64_t tag = tagOf(hash);
+    for (std::size_t slot = 0; slot < kCapacity; ++slot) {
+      if (directory_[slot].load(std::memory_order_relaxed) != tag) {
+        continue;
+      }
+      const Replica& replica = replicas_[threadIndex() % replica_count_];
+      if (read(replica.items[slot], tag, key, now, value)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Учитывает обращение к ключу с вероятностью 1 / sample_rate. Возвращает
+  // true, если ключ стоит сделать горячим (см. promote).
+  bool sample(std::size_t hash) {
+    thread_local uint32_t countdown = 0;
+    if (countdown > 0) {
+      --countdown;
+      return false;
+    }
+    countdown = nextGap() - 1;
+
+    uint32_t count =
+        counters_[tagOf(hash) % kCounters].fetch_add(
+            1, std::memory_order_relaxed) +
+        1;
+    // Общий счетчик выборок обновляется пачками, чтобы потоки не писали в
+    // одну кеш-линию на каждой выборке.
+    thread_local uint32_t pending = 0;
+    if (++pending == kSampleBatch) {
+      pending = 0;
+      uint64_t before =
+          samples_.fetch_add(kSampleBatch, std::memory_order_relaxed);
+      if (before / kDecayInterval != (before + kSampleBatch) / kDecayInterval) {
+        decay();
+      }
+    }
+    return count >= options_.threshold && !contains(hash);
+  }
+
+  // Без блокировок: есть ли, возможно, горячий ключ с таким хешем.
+  bool contains(std::size_t hash) const {
+    uint64_t tag = tagOf(hash);
+    for (const auto& directory_tag : directory_) {
+      if (directory_tag.load(std::memory_order_relaxed) == tag) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Под блокировкой сегмента ключа: делает ключ горячим и копирует его
+  // значение во все реплики. Если все слоты заняты, вытесняет самый редкий
+  // горячий ключ, но только более редкий, чем key.
+  void promote(std::size_t hash, std::string_view key, std::string_view value,
+               std::optional<TimePoint> expiry) {
+    if (key.size() > kMaxKeyBytes || value.size() > kMaxValueBytes) {
+      return;
+    }
+    std::lock_guard lock(mutex_);
+    if (findSlot(hash, key) != kCapacity) {
+      return;
+    }
+
+    // Свободный слот, а если его нет — слот самого редкого горячего ключа.
+    // Частота горячего ключа после деления счетчиков может стать нулевой,
+    // поэтому свободный слот ищется явно.
+    std::size_t slot = 0;
+    for (std::size_t i = 0; i < kCapacity; ++i) {
+      if (directory_[i].load(std::memory_order_relaxed) == 0) {
+        slot = i;
+        break;
+      }
+      if (frequency(i) < frequency(slot)) {
+        slot = i;
+      }
+    }
+    if (directory_[slot].load(std::memory_order_relaxed) != 0 &&
+        frequency(slot) >= frequencyOf(hash)) {
+      return;
+    }
+
+    keys_[slot] = std::string(key);
+    directory_[slot].store(tagOf(hash), std::memory_order_relaxed);
+    publish(slot, tagOf(hash), key, value, expiry);
+  }
+
+  // Под блокировкой сегмента ключа: обновляет значение горячего ключа во
+  // всех репликах. Значение, не помещающееся в реплику, снимает с ключа
+  // статус горячего.
+  void update(std::size_t hash, std::string_view key, std::string_view value,
+              std::optional<TimePoint> expiry) {
+    std::lock_guard lock(mutex_);
+    std::size_t slot = findSlot(hash, key);
+    if (slot == kCapacity) {
+      return;
+    }
+    if (value.size() > kMaxValueBytes) {
+      evict(slot);
+    } else {
+      publish(slot, tagOf(hash), key, value, expiry);
+    }
+  }
+
+  // Под блокировкой сегмента ключа: убирает ключ из реплик.
+  void erase(std::size_t hash, std::string_view key) {
+    std::lock_guard lock(mutex_);
+    std::size_t slot = findSlot(hash, key);
+    if (slot != kCapacity) {
+      evict(slot);
+    }
+  }
+
+  // Число горячих ключей.
+  std::size_t size() const {
+    std::size_t size = 0;
+    for (const auto& directory_tag : directory_) {
+      size += directory_tag.load(std::memory_order_relaxed) != 0;
+    }
+    return size;
+  }
+
+ private:
+  static constexpr std::size_t wordCount(std::size_t bytes) {
+    return (bytes + 7) / 8;
+  }
+
+  // Хеш с ненулевым тегом: 0 обозначает пустой слот.
+  static uint64_t tagOf(std::size_t hash) { return hash | 1; }
+
+  // Расстояние до следующей выборки: случайное из [1, 2 * sample_rate - 1],
+  // в среднем sample_rate. Фиксированный шаг совпадал бы по фазе с
+  // периодичными нагрузками: при обходе 8 ключей по кругу и sample_rate 64
+  // в выборку попадал бы только один из них.
+  uint32_t nextGap() const {
+    thread_local uint64_t random = 0x9e3779b97f4a7c15ULL;
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    uint64_t range = 2 * uint64_t{options_.sample_rate} - 1;
+    return 1 + static_cast<uint32_t>(random % range);
+  }
+
+  // Номер потока, назначаемый при первом обращении.
+  static std::size_t threadIndex() {
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t index =
+        next.fetch_add(1, std::memory_order_relaxed);
+    return index;
+  }
+
+  template <typename Now>
+  static bool read(const Item& item, uint64_t tag, std::string_view key,
+                   const Now& now, std::optional<std::string>& value) {
+    std::array<uint64_t, kMaxKeyBytes / 8> key_words;
+    std::array<uint64_t, kMaxValueBytes / 8> value_words;
+    while (true) {
+      uint32_t sequence = item.sequence.load(std::memory_order_acquire);
+      if ((sequence & 1) != 0) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      uint64_t item_tag = item.hash.load(std::memory_order_acquire);
+      std::size_t key_size = std::min<std::size_t>(
+          item.key_size.load(std::memory_order_acquire), kMaxKeyBytes);
+      std::size_t value_size = std::min<std::size_t>(
+          item.value_size.load(std::memory_order_acquire), kMaxValueBytes);
+      bool has_expiry = item.has_expiry.load(std::memory_order_acquire);
+      TimePoint expiry(typename TimePoint::duration(
+          item.expiry.load(std::memory_order_acquire)));
+      for (std::size_t i = 0; i < wordCount(key_size); ++i) {
+        key_words[i] = item.key[i].load(std::memory_order_acquire);
+      }
+      for (std::size_t i = 0; i < wordCount(value_size); ++i) {
+        value_words[i] = item.value[i].load(std::memory_order_acquire);
+      }
+
+      if (item.sequence.load(std::memory_order_relaxed) != sequence) {
+        continue;
+      }
+
+      if (item_tag != tag ||
+          std::string_view(reinterpret_cast<const char*>(key_words.data()),
+                           key_size) != key) {
+        return false;
+      }
+      if (has_expiry && expiry <= now()) {
+        value.reset();
+      } else {
+        value.emplace(reinterpret_cast<const char*>(value_words.data()),
+                      value_size);
+      }
+      return true;
+    }
+  }
+
+  // Под mutex_.
+  std::size_t findSlot(std::size_t hash, std::string_view key) const {
+    for (std::size_t slot = 0; slot < kCapacity; ++slot) {
+      if (directory_[slot].load(std::memory_order_relaxed) == tagOf(hash) &&
+          keys_[slot] == key) {
+        return slot;
+      }
+    }
+    return kCapacity;
+  }
+
+  uint32_t frequencyOf(std::size_t hash) const {
+    return counters_[tagOf(hash) % kCounters].load(std::memory_order_relaxed);
+  }
+
+  // Под mutex_: частота ключа слота (0 для пустого слота).
+  uint32_t frequency(std::size_t slot) const {
+    uint64_t tag = directory_[slot].load(std::memory_order_relaxed);
+    return tag == 0 ? 0 : frequencyOf(tag);
+  }
+
+  // Под mutex_: записывает ключ и значение в слот всех реплик.
+  void publish(std::size_t slot, uint64_t tag, std::string_view key,
+               std::string_view value, std::optional<TimePoint> expiry) {
+    std::array<uint64_t, kMaxKeyBytes / 8> key_words{};
+    std::array<uint64_t, kMaxValueBytes / 8> value_words{};
+    std::copy(key.begin(), key.end(),
+              reinterpret_cast<char*>(key_words.data()));
+    std::copy(value.begin(), value.end(),
+              reinterpret_cast<char*>(value_words.data()));
+
+    for (std::size_t r = 0; r < replica_count_; ++r) {
+      Item& item = replicas_[r].items[slot];
+      uint32_t sequence = item.sequence.load(std::memory_order_relaxed);
+      item.sequence.store(sequence + 1, std::memory_order_relaxed);
+
+      item.hash.store(tag, std::memory_order_release);
+      item.key_size.store(key.size(), std::memory_order_release);
+      item.value_size.store(value.size(), std::memory_order_release);
+      item.has_expiry.store(expiry.has_value(), std::memory_order_release);
+      item.expiry.store(expiry.value_or(TimePoint()).time_since_epoch().count(),
+                        std::memory_order_release);
+      for (std::size_t i = 0; i < wordCount(key.size()); ++i) {
+        item.key[i].store(key_words[i], std::memory_order_release);
+      }
+      for (std::size_t i = 0; i < wordCount(value.size()); ++i) {
+        item.value[i].store(value_words[i], std::memory_order_release);
+      }
+
+      item.sequence.store(sequence + 2, std::memory_order_release);
+    }
+  }
+
+  // Под mutex_: освобождает слот во всех репликах.
+  void evict(std::size_t slot) {
+    directory_[slot].store(0, std::memory_order_relaxed);
+    keys_[slot].clear();
+    for (std::size_t r = 0; r < replica_count_; ++r) {
+      Item& item = replicas_[r].items[slot];
+      uint32_t sequence = item.sequence.load(std::memory_order_relaxed);
+      item.sequence.store(sequence + 1, std::memory_order_relaxed);
+      item.hash.store(0, std::memory_order_release);
+      item.sequence.store(sequence + 2, std::memory_order_release);
+    }
+  }
+
+  // Делит счетчики пополам. Одновременные fetch_add могут потеряться, что
+  // для оценки частоты не важно.
+  void decay() {
+    std::unique_lock lock(decay_mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return;
+    }
+    for (auto& counter : counters_) {
+      counter.store(counter.load(std::memory_order_relaxed) / 2,
+                    std::memory_order_relaxed);
+    }
+  }
+
+  HotKeyOptions options_;
+  std::size_t replica_count_;
+  std::unique_ptr<Replica[]> replicas_;
+
+  // Теги горячих ключей: по ним set без блокировки mutex_ проверяет, не
+  // горячий ли ключ.
+  std::array<std::atomic<uint64_t>, kCapacity> directory_{};
+  // Ключи слотов, только под mutex_.
+  std::array<std::string, kCapacity> keys_;
+  std::mutex mutex_;
+
+  alignas(64) std::array<std::atomic<uint32_t>, kCounters> counters_{};
+  alignas(64) std::atomic<uint64_t> samples_{0};
+  std::mutex decay_mutex_;
+};
@@ -0,0 +1,534 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+// Узел IncrementalHashMap. Вынесен из класса, чтобы внешние индексы могли
+// хранить указатели на записи, не инстанцируя таблицу (тип значения может
+// ссылаться на собственные итераторы этих индексов).
+//
+// Полный хеш ключа вычисляется один раз при вставке и хранится в узле:
+// рехеширование не хеширует ключи повторно, а поиск сравнивает ключи только
+// при совпадении хешей.
+template <typename Key, typename Mapped>
+struct HashMapNode {
+  HashMapNode* next;
+  std::size_t hash;
+  std::pair<const Key, Mapped> value;
+
+  template <typename K, typename... Args>
+  HashMapNode(std::size_t hash, K&& key, Args&&... args)
+      : next(nullptr),
+        hash(hash),
+        value(std::piecewise_construct,
+              std::forward_as_tuple(std::forward<K>(key)),
+              std::forward_as_tuple(std::forward<Args>(args)...)) {}
+
+  const Key& key() const { return value.first; }
+  Mapped& mapped() { return value.second; }
+  const Mapped& mapped() const { return value.second; }
+};
+
+// Хеш-таблица с цепочками и инкрементальным рехешированием в стиле dict из
+// Redis. Во время роста существуют две таблицы: старая и новая. Каждая
+// модифицирующая операция переносит не более kRehashStepBuckets корзин из
+// старой таблицы в новую, поэтому ни одна операция не платит за перенос всех
+// записей сразу.
+//
+// Узлы аллоцируются по отдельности и никогда не перемещаются, поэтому
+// указатели и ссылки на ключи и значения остаются валидными до удаления самой
+// записи (в том числе во время рехеширования).
+template <typename Key, typename Mapped, typename Hash, typename KeyEqual>
+class IncrementalHashMap {
+ public:
+  using key_type = Key;
+  using mapped_type = Mapped;
+  using value_type = std::pair<const Key, Mapped>;
+  using size_type = std::size_t;
+  using node = HashMapNode<Key, Mapped>;
+
+  // Сколько корзин переносится за одну модифицирующую операцию.
+  static constexpr size_type kRehashStepBuckets = 4;
+  // Сколько пустых корзин можно просмотреть на одну переносимую корзину.
+  static constexpr size_type kRehashEmptyVisits = 10;
+  static constexpr size_type kMinBucketCount = 4;
+
+ private:
+  using Node = node;
+
+  // Массив корзин аллоцируется через calloc: для больших таблиц аллокатор
+  // отдает уже обнуленные страницы, и стоимость обнуления размазывается по
+  // первым обращениям к ним.
+  struct Table {
+    Node** buckets = nullptr;
+    size_type mask = 0;
+    size_type used = 0;
+
+    size_type bucketCount() const {
+      return buckets == nullptr ? 0 : mask + 1;
+    }
+  };
+
+ public:
+  class iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = IncrementalHashMap::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = value_type*;
+    using reference = value_type&;
+
+    iterator() = default;
+
+    reference operator*() const { return node_->value; }
+    pointer operator->() const { return &node_->value; }
+
+    iterator& operator++() {
+      if (node_->next != nullptr) {
+        node_ = node_->next;
+      } else {
+        ++bucket_;
+        seek();
+      }
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator copy = *this;
+      ++*this;
+      return copy;
+    }
+
+    bool operator==(const iterator& other) const {
+      return node_ == other.node_;
+    }
+
+    // Стабильный указатель на запись: в отличие от итератора, остается
+    // валидным при рехешировании.
+    Node* node() const { return node_; }
+
+   private:
+    friend class IncrementalHashMap;
+
+    iterator(const IncrementalHashMap* map, Node* node, int table,
+             size_type bucket)
+        : map_(map), node_(node), table_(table), bucket_(bucket) {}
+
+    // Переходит к первому узлу, начиная с корзины bucket_ таблицы table_.
+    void seek() {
+      for (; table_ < 2; ++table_, bucket_ = 0) {
+        const Table& table = map_->tables_[table_];
+        for (; bucket_ < table.bucketCount(); ++bucket_) {
+          if (table.buckets[bucket_] != nullptr) {
+            node_ = table.buckets[bucket_];
+            return;
+          }
+        }
+      }
+      node_ = nullptr;
+    }
+
+    const IncrementalHashMap* map_ = nullptr;
+    Node* node_ = nullptr;
+    int table_ = 0;
+    size_type bucket_ = 0;
+  };
+
+  // Аналог node handle из std::unordered_map: владеет извлеченной записью.
+  class node_type {
+   public:
+    node_type() = default;
+
+    // Как и в стандартной библиотеке, ключ извлеченного узла можно изменять
+    // (в частности, перемещать).
+    Key& key() const { return const_cast<Key&>(node_->value.first); }
+    Mapped& mapped() const { return node_->value.second; }
+
+    bool empty() const { return node_ == nullptr; }
+    explicit operator bool() const { return !empty(); }
+
+   private:
+    friend class IncrementalHashMap;
+
+    explicit node_type(Node* node) : node_(node) {}
+
+    std::unique_ptr<Node> node_;
+  };
+
+  IncrementalHashMap() = default;
+
+  explicit IncrementalHashMap(Hash hash, KeyEqual key_equal = KeyEqual())
+      : hash_(std::move(hash)), key_equal_(std::move(key_equal)) {}
+
+  IncrementalHashMap(const IncrementalHashMap&) = delete;
+  IncrementalHashMap& operator=(const IncrementalHashMap&) = delete;
+
+  IncrementalHashMap(IncrementalHashMap&& other) noexcept
+      : hash_(std::move(other.hash_)),
+        key_equal_(std::move(other.key_equal_)),
+        tables_{std::exchange(other.tables_[0], Table{}),
+                std::exchange(other.tables_[1], Table{})},
+        rehash_index_(std::exchange(other.rehash_index_, 0)),
+        pending_bucket_count_(std::exchange(other.pending_bucket_count_, 0)),
+        max_load_factor_(other.max_load_factor_) {}
+
+  IncrementalHashMap& operator=(IncrementalHashMap&& other) noexcept {
+    if (this != &other) {
+      clear();
+      freeTable(tables_[0]);
+      hash_ = std::move(other.hash_);
+      key_equal_ = std::move(other.key_equal_);
+      tables_[0] = std::exchange(other.tables_[0], Table{});
+      tables_[1] = std::exchange(other.tables_[1], Table{});
+      rehash_index_ = std::exchange(other.rehash_index_, 0);
+      pending_bucket_count_ = std::exchange(other.pending_bucket_count_, 0);
+      max_load_factor_ = other.max_load_factor_;
+    }
+    return *this;
+  }
+
+  ~IncrementalHashMap() {
+    clear();
+    freeTable(tables_[0]);
+  }
+
+  size_type size() const { return tables_[0].used + tables_[1].used; }
+  bool empty() const { return size() == 0; }
+
+  size_type bucket_count() const {
+    return tables_[0].bucketCount() + tables_[1].bucketCount();
+  }
+
+  float load_factor() const {
+    size_type buckets = targetTable().bucketCount();
+    return buckets == 0 ? 0.0f : static_cast<float>(size()) / buckets;
+  }
+
+  float max_load_factor() const { return max_load_factor_; }
+
+  // Новое значение учитывается при следующем росте или вызове
+  // reserve/shrink_to_fit.
+  void max_load_factor(float load_factor) {
+    if (!(load_factor > 0.0f)) {
+      throw std::invalid_argument("max_load_factor must be positive");
+    }
+    max_load_factor_ = load_factor;
+  }
+
+  bool isRehashing() const { return tables_[1].buckets != nullptr; }
+
+  const Hash& hash_function() const { return hash_; }
+
+  iterator begin() const {
+    iterator it(this, nullptr, 0, 0);
+    it.seek();
+    return it;
+  }
+
+  iterator end() const { return iterator(this, nullptr, 2, 0); }
+
+  template <typename K>
+  iterator find(const K& key) const {
+    return find(key, hash_(key));
+  }
+
+  // Поиск с заранее вычисленным хешем.
+  template <typename K>
+  iterator find(const K& key, size_type hash) const {
+    for (int t = 0; t < (isRehashing() ? 2 : 1); ++t) {
+      const Table& table = tables_[t];
+      if (table.buckets == nullptr) {
+        continue;
+      }
+
+      size_type bucket = hash & table.mask;
+      for (Node* node = table.buckets[bucket]; node != nullptr;
+           node = node->next) {
+        if (node->hash == hash && key_equal_(node->key(), key)) {
+          return iterator(this, node, t, bucket);
+        }
+      }
+    }
+
+    return end();
+  }
+
+  // Случайная запись или nullptr для пустой таблицы. Выбирает корзину
+  // равномерно среди корзин обеих таблиц и позицию в цепочке равномерно из
+  // [0, chain_bound), повторяя выбор, если в позиции нет узла: каждая запись
+  // выпадает с равной вероятностью, пока цепочки не длиннее chain_bound.
+  // Встреченная более длинная цепочка увеличивает chain_bound, поэтому
+  // вызывающий хранит его между вызовами.
+  // O(chain_bound / load_factor) expected time complexity.
+  template <typename Rng>
+  Node* randomNode(Rng& rng, size_type& chain_bound) const {
+    if (empty()) {
+      return nullptr;
+    }
+    size_type first = tables_[0].bucketCount();
+    std::uniform_int_distribution<size_type> bucket_of(
+        0, first + tables_[1].bucketCount() - 1);
+    while (true) {
+      size_type bucket = bucket_of(rng);
+      const Table& table = tables_[bucket < first ? 0 : 1];
+      Node* node = table.buckets[bucket < first ? bucket : bucket - first];
+      if (node == nullptr) {
+        continue;
+      }
+      size_type length = 1;
+      for (Node* it = node->next; it != nullptr; it = it->next) {
+        ++length;
+      }
+      chain_bound = std::max(chain_bound, length);
+      size_type position =
+          std::uniform_int_distribution<size_type>(0, chain_bound - 1)(rng);
+      if (position >= length) {
+        continue;
+      }
+      for (; position > 0; --position) {
+        node = node->next;
+      }
+      return node;
+    }
+  }
+
+  // Вставляет запись, если ключа еще нет. Иначе ничего не делает.
+  // Возвращает итератор на запись с ключом key и флаг вставки.
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+    return lazy_emplace(
+        key, [&key]() -> K&& { return std::forward<K>(key); },
+        std::forward<Args>(args)...);
+  }
+
+  // Как try_emplace, но ищет по lookup, а ключ новой записи строит вызовом
+  // make_key() только при вставке. Нужно, когда хранимый ключ дорого или
+  // невозможно построить заранее (например, интернированный).
+  template <typename K, typename MakeKey, typename... Args>
+  std::pair<iterator, bool> lazy_emplace(const K& lookup, MakeKey&& make_key,
+                                         Args&&... args) {
+    rehashStep(kRehashStepBuckets);
+
+    size_type hash = hash_(lookup);
+    if (auto it = find(lookup, hash); it != end()) {
+      return {it, false};
+    }
+
+    expandIfNeeded();
+
+    // Во время рехеширования новые записи попадают сразу в новую таблицу.
+    int t = isRehashing() ? 1 : 0;
+    Table& table = tables_[t];
+
+    Node* node = new Node(hash, make_key(), std::forward<Args>(args)...);
+    size_type bucket = hash & table.mask;
+    node->next = table.buckets[bucket];
+    table.buckets[bucket] = node;
+    ++table.used;
+
+    return {iterator(this, node, t, bucket), true};
+  }
+
+  void erase(iterator it) { erase(it.node_); }
+  void erase(const Node* target) { delete unlink(target); }
+
+  node_type extract(iterator it) { return extract(it.node_); }
+  node_type extract(const Node* target) { return node_type(unlink(target)); }
+
+  void clear() {
+    for (Table& table : tables_) {
+      for (size_type i = 0; i < table.bucketCount(); ++i) {
+        Node* node = table.buckets[i];
+        while (node != nullptr) {
+          delete std::exchange(node, node->next);
+        }
+        table.buckets[i] = nullptr;
+      }
+      table.used = 0;
+    }
+
+    if (isRehashing()) {
+      freeTable(tables_[0]);
+      tables_[0] = std::exchange(tables_[1], Table{});
+      rehash_index_ = 0;
+    }
+    pending_bucket_count_ = 0;
+  }
+
+  // Гарантирует, что count записей поместятся без роста таблицы. Для пустой
+  // таблицы корзины аллоцируются сразу, иначе запускается инкрементальное
+  // рехеширование.
+  void reserve(size_type count) {
+    size_type target = bucketCountFor(count);
+    if (target <= targetTable().bucketCount()) {
+      return;
+    }
+
+    resize(target);
+  }
+
+  // Запускает инкрементальное сжатие таблицы до минимального размера,
+  // достаточного для текущего числа записей. Корзины переносятся так же, как
+  // при росте: модифицирующими операциями и вызовами rehashStep.
+  void shrink_to_fit() {
+    size_type target = bucketCountFor(size());
+    if (target >= targetTable().bucketCount()) {
+      return;
+    }
+
+    resize(target);
+  }
+
+  // Переносит не более buckets корзин из старой таблицы в новую.
+  // Возвращает true, если рехеширование еще не завершено.
+  bool rehashStep(size_type buckets) {
+    if (!isRehashing()) {
+      return false;
+    }
+
+    Table& from = tables_[0];
+    Table& to = tables_[1];
+    size_type empty_visits = buckets * kRehashEmptyVisits;
+
+    while (buckets > 0 && from.used != 0) {
+      while (from.buckets[rehash_index_] == nullptr) {
+        ++rehash_index_;
+        if (--empty_visits == 0) {
+          return true;
+        }
+      }
+
+      Node* node = from.buckets[rehash_index_];
+      while (node != nullptr) {
+        Node* next = node->next;
+        size_type bucket = node->hash & to.mask;
+        node->next = to.buckets[bucket];
+        to.buckets[bucket] = node;
+        --from.used;
+        ++to.used;
+        node = next;
+      }
+      from.buckets[rehash_index_] = nullptr;
+      ++rehash_index_;
+      --buckets;
+    }
+
+    if (from.used != 0) {
+      return true;
+    }
+
+    freeTable(from);
+    from = std::exchange(to, Table{});
+    rehash_index_ = 0;
+
+    // Запрошенный во время рехеширования размер применяем после его
+    // завершения.
+    if (size_type pending = std::exchange(pending_bucket_count_, 0);
+        pending != 0 && pending != from.bucketCount()) {
+      startRehash(pending);
+      return true;
+    }
+
+    return false;
+  }
+
+ private:
+  // Минимальное число корзин, при котором count записей не превышают
+  // max_load_factor_.
+  size_type bucketCountFor(size_type count) const {
+    size_type buckets = kMinBucketCount;
+    while (buckets * max_load_factor_ < count) {
+      buckets *= 2;
+    }
+    return buckets;
+  }
+
+  // Таблица, в которую в итоге попадут все записи.
+  const Table& targetTable() const { return tables_[isRehashing() ? 1 : 0]; }
+
+  static Table allocateTable(size_type bucket_count) {
+    void* buckets = std::calloc(bucket_count, sizeof(Node*));
+    if (buckets == nullptr) {
+      throw std::bad_alloc();
+    }
+    return Table{static_cast<Node**>(buckets), bucket_count - 1, 0};
+  }
+
+  static void freeTable(Table& table) {
+    std::free(table.buckets);
+    table = Table{};
+  }
+
+  // Начинает перенос записей в таблицу из bucket_count корзин. Если
+  // рехеширование уже идет, новый размер будет применен после его окончания.
+  void resize(size_type bucket_count) {
+    if (isRehashing()) {
+      pending_bucket_count_ = bucket_count;
+      return;
+    }
+
+    if (tables_[0].buckets == nullptr) {
+      tables_[0] = allocateTable(bucket_count);
+      return;
+    }
+
+    startRehash(bucket_count);
+  }
+
+  void startRehash(size_type bucket_count) {
+    tables_[1] = allocateTable(bucket_count);
+    rehash_index_ = 0;
+  }
+
+  void expandIfNeeded() {
+    if (isRehashing()) {
+      return;
+    }
+
+    if (tables_[0].buckets == nullptr) {
+      tables_[0] = allocateTable(bucketCountFor(1));
+      return;
+    }
+
+    if (tables_[0].used >= tables_[0].bucketCount() * max_load_factor_) {
+      resize(bucketCountFor(tables_[0].used * 2));
+    }
+  }
+
+  // Вынимает узел из цепочки, не освобождая его.
+  Node* unlink(const Node* target) {
+    rehashStep(kRehashStepBuckets);
+
+    // Шаг рехеширования мог перенести узел, поэтому ищем корзину заново.
+    for (int t = 0; t < (isRehashing() ? 2 : 1); ++t) {
+      Table& table = tables_[t];
+      Node** link = &table.buckets[target->hash & table.mask];
+      for (; *link != nullptr; link = &(*link)->next) {
+        if (*link == target) {
+          Node* found = *link;
+          *link = found->next;
+          found->next = nullptr;
+          --table.used;
+          return found;
+        }
+      }
+    }
+
+    return nullptr;
+  }
+
+  [[no_unique_address]] Hash hash_;
+  [[no_unique_address]] KeyEqual key_equal_;
+  Table tables_[2];
+  size_type rehash_index_ = 0;
+  // Размер, запрошенный через reserve/shrink_to_fit во время рехеширования.
+  size_type pending_bucket_count_ = 0;
+  float max_load_factor_ = 1.0f;
+};
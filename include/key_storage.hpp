@@ -0,0 +1,288 @@
+#pragma once
+
+#include <array>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+// Политики хранения ключей в KVStorage. Политика задает тип ключа внутри
+// записи KeyIndex (stored_type), общее для всех ключей состояние (Pool) и
+// преобразования между типом ключа и stored_type. stored_type должен
+// сравниваться (==, <=>) с типом, которым ключ передается в поиск
+// (std::string_view для строк), и с самим собой в порядке полных ключей.
+
+// Ключи хранятся как есть: строки — в std::string, целые числа и ключи
+// фиксированного размера — прямо в записи.
+template <typename K = std::string>
+struct PlainKeys {
+  using stored_type = K;
+
+  struct Pool {};
+
+  static stored_type make(Pool& /*pool*/, K&& key) { return std::move(key); }
+
+  static const K& materialize(const stored_type& key) { return key; }
+
+  static K release(stored_type& key) { return std::move(key); }
+};
+
+namespace key_storage_detail {
+
+// Строка на 16 B: до 15 символов хранится внутри объекта, длиннее — в куче.
+// Последний байт — длина короткой строки или kHeapTag.
+class CompactString {
+ public:
+  CompactString() { bytes_[kTagOffset] = 0; }
+
+  explicit CompactString(std::string_view str) {
+    if (str.size() <= kInlineCapacity) {
+      std::memcpy(bytes_.data(), str.data(), str.size());
+      bytes_[kTagOffset] = static_cast<char>(str.size());
+      return;
+    }
+
+    char* data = new char[str.size()];
+    std::memcpy(data, str.data(), str.size());
+    auto size = static_cast<uint32_t>(str.size());
+    std::memcpy(bytes_.data(), &data, sizeof(data));
+    std::memcpy(bytes_.data() + sizeof(data), &size, sizeof(size));
+    bytes_[kTagOffset] = kHeapTag;
+  }
+
+  CompactString(CompactString&& other) noexcept : bytes_(other.bytes_) {
+    other.bytes_[kTagOffset] = 0;
+  }
+
+  CompactString& operator=(CompactString&& other) noexcept {
+    if (this != &other) {
+      reset();
+      bytes_ = other.bytes_;
+      other.bytes_[kTagOffset] = 0;
+    }
+    return *this;
+  }
+
+  ~CompactString() { reset(); }
+
+  std::string_view view() const {
+    if (!isHeap()) {
+      return {bytes_.data(), static_cast<std::size_t>(bytes_[kTagOffset])};
+    }
+    return {heapData(), heapSize()};
+  }
+
+  // Память под строку, включая объект.
+  std::size_t memoryUsage() const {
+    return sizeof(*this) + (isHeap() ? heapSize() : 0);
+  }
+
+ private:
+  static constexpr std::size_t kTagOffset = 15;
+  static constexpr std::size_t kInlineCapacity = 15;
+  static constexpr char kHeapTag = static_cast<char>(0xFF);
+
+  bool isHeap() const { return bytes_[kTagOffset] == kHeapTag; }
+
+  char* heapData() const {
+    char* data;
+    std::memcpy(&data, bytes_.data(), sizeof(data));
+    return data;
+  }
+
+  uint32_t heapSize() const {
+    uint32_t size;
+    std::memcpy(&size, bytes_.data() + sizeof(char*), sizeof(size));
+    return size;
+  }
+
+  void reset() {
+    if (isHeap()) {
+      delete[] heapData();
+    }
+    bytes_[kTagOffset] = 0;
+  }
+
+  std::array<char, 16> bytes_;
+};
+
+// Лексикографическое сравнение конкатенаций lhs_head + lhs_tail и
+// rhs_head + rhs_tail без их построения.
+inline std::strong_ordering compareConcat(std::string_view lhs_head,
+                                          std::string_view lhs_tail,
+                                          std::string_view rhs_head,
+                                          std::string_view rhs_tail) {
+  while (true) {
+    if (lhs_head.empty()) {
+      if (lhs_tail.empty()) {
+        return rhs_head.empty() && rhs_tail.empty()
+                   ? std::strong_ordering::equal
+                   : std::strong_ordering::less;
+      }
+      lhs_head = std::exchange(lhs_tail, {});
+    }
+    if (rhs_head.empty()) {
+      if (rhs_tail.empty()) {
+        return std::strong_ordering::greater;
+      }
+      rhs_head = std::exchange(rhs_tail, {});
+    }
+
+    std::size_t len = std::min(lhs_head.size(), rhs_head.size());
+    if (int cmp = lhs_head.compare(0, len, rhs_head.substr(0, len)); cmp != 0) {
+      return cmp < 0 ? std::strong_ordering::less
+                     : std::strong_ordering::greater;
+    }
+    lhs_head.remove_prefix(len);
+    rhs_head.remove_prefix(len);
+  }
+}
+
+}  // namespace key_storage_detail
+
+// Ключ делится по последнему разделителю Delimiter на префикс
+// ("org/17/bucket/3/") и суффикс. Префиксы интернируются в общем Pool со
+// счетчиком ссылок, и запись хранит только указатель на префикс и суффикс в
+// CompactString (24 B вместо 32 B std::string и копии всего ключа в куче).
+// Полный ключ собирается только при возврате из getManySorted и
+// removeOneExpiredEntry; поиск и сравнение работают по частям.
+template <char Delimiter = '/'>
+struct InternedPrefixKeys {
+  class Pool;
+
+  struct Prefix {
+    std::string text;
+    std::size_t refs = 0;
+    Pool* pool = nullptr;
+  };
+
+  class stored_type {
+   public:
+    stored_type(Prefix* prefix, std::string_view suffix)
+        : prefix_(prefix), suffix_(suffix) {}
+
+    stored_type(stored_type&& other) noexcept
+        : prefix_(std::exchange(other.prefix_, nullptr)),
+          suffix_(std::move(other.suffix_)) {}
+
+    stored_type& operator=(stored_type&&) = delete;
+
+    ~stored_type() {
+      if (prefix_ != nullptr) {
+        prefix_->pool->release(prefix_);
+      }
+    }
+
+    std::string_view prefix() const {
+      return prefix_ == nullptr ? std::string_view() : prefix_->text;
+    }
+    std::string_view suffix() const { return suffix_.view(); }
+
+    // Длина полного ключа.
+    std::size_t size() const { return prefix().size() + suffix().size(); }
+
+    std::string str() const {
+      std::string result;
+      result.reserve(prefix().size() + suffix().size());
+      result.append(prefix()).append(suffix());
+      return result;
+    }
+
+    // Память записи под ключ; префикс общий и сюда не входит.
+    std::size_t memoryUsage() const {
+      return sizeof(prefix_) + suffix_.memoryUsage();
+    }
+
+    friend bool operator==(const stored_type& lhs, std::string_view rhs) {
+      std::string_view prefix = lhs.prefix();
+      std::string_view suffix = lhs.suffix();
+      return prefix.size() + suffix.size() == rhs.size() &&
+             rhs.starts_with(prefix) && rhs.ends_with(suffix);
+    }
+
+    friend bool operator==(const stored_type& lhs, const stored_type& rhs) {
+      return lhs.prefix_ == rhs.prefix_ && lhs.suffix() == rhs.suffix();
+    }
+
+    friend std::strong_ordering operator<=>(const stored_type& lhs,
+                                            std::string_view rhs) {
+      return key_storage_detail::compareConcat(lhs.prefix(), lhs.suffix(),
+                                               rhs, {});
+    }
+
+    friend std::strong_ordering operator<=>(const stored_type& lhs,
+                                            const stored_type& rhs) {
+      if (lhs.prefix_ == rhs.prefix_) {
+        return lhs.suffix() <=> rhs.suffix();
+      }
+      return key_storage_detail::compareConcat(lhs.prefix(), lhs.suffix(),
+                                               rhs.prefix(), rhs.suffix());
+    }
+
+   private:
+    Prefix* prefix_;
+    key_storage_detail::CompactString suffix_;
+  };
+
+  // Интернированные префиксы. Префикс удаляется вместе с последним ключом,
+  // который на него ссылается. Ключи хранят указатель на Pool, поэтому он не
+  // перемещается и должен пережить все свои ключи.
+  class Pool {
+   public:
+    Pool() = default;
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    Prefix* acquire(std::string_view text) {
+      auto it = prefixes_.find(text);
+      if (it == prefixes_.end()) {
+        auto prefix = std::make_unique<Prefix>(Prefix{std::string(text), 0,
+                                                      this});
+        std::string_view view = prefix->text;
+        it = prefixes_.emplace(view, std::move(prefix)).first;
+      }
+      ++it->second->refs;
+      return it->second.get();
+    }
+
+    void release(Prefix* prefix) {
+      if (--prefix->refs == 0) {
+        prefixes_.erase(prefix->text);
+      }
+    }
+
+    std::size_t size() const { return prefixes_.size(); }
+
+    // Память под интернированные префиксы (без учета служебных структур
+    // unordered_map).
+    std::size_t memoryUsage() const {
+      std::size_t bytes = 0;
+      for (const auto& [text, prefix] : prefixes_) {
+        bytes += sizeof(Prefix) + prefix->text.capacity();
+      }
+      return bytes;
+    }
+
+   private:
+    std::unordered_map<std::string_view, std::unique_ptr<Prefix>> prefixes_;
+  };
+
+  static stored_type make(Pool& pool, std::string&& key) {
+    std::string_view view = key;
+    std::size_t split = view.rfind(Delimiter);
+    if (split == std::string_view::npos) {
+      return stored_type(nullptr, view);
+    }
+    return stored_type(pool.acquire(view.substr(0, split + 1)),
+                       view.substr(split + 1));
+  }
+
+  static std::string materialize(const stored_type& key) { return key.str(); }
+
+  static std::string release(stored_type& key) { return key.str(); }
+};
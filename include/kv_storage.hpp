@@ -1,17 +1,36 @@
+#pragma once
+
+#include <algorithm>
 #include <chrono>
 #include <concepts>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
 #include <optional>
+#include <random>
 #include <set>
 #include <span>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <tuple>
-#include <unordered_map>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "access_stats.hpp"
+#include "bloom_filter.hpp"
+#include "bplus_tree.hpp"
+#include "hash_policy.hpp"
+#include "incremental_hash_map.hpp"
+#include "key_storage.hpp"
+#include "kv_stream.hpp"
+#include "kv_traits.hpp"
+#include "value_blob.hpp"
+#include "value_codec.hpp"
+
 // Концепт для шаблонного параметра Clock и его member types.
 template <typename C>
 concept KVClock = std::default_initializable<C> && std::movable<C> && requires {
@@ -30,11 +49,92 @@ concept KVClock = std::default_initializable<C> && std::movable<C> && requires {
   } -> std::same_as<bool>;
 };
 
-template <KVClock Clock>
+// Состояние ключа, которое различает KVStorage::lookup.
+enum class KeyState {
+  // Ключа нет, и о нем ничего не известно.
+  kAbsent,
+  // Для ключа есть непротухший tombstone (см. KVStorage::setAbsent).
+  kKnownAbsent,
+  kPresent,
+};
+
+// Метаданные обращений к записи (Features<..., Access::Yes>).
+struct AccessInfo {
+  // Сколько секунд назад было последнее обращение.
+  uint32_t idle_seconds;
+  // Логарифмический счетчик частоты 0..15 с затуханием (см. KVStorage).
+  uint8_t frequency;
+};
+
+// Запись случайной выборки KVStorage::sample.
+template <typename Key>
+struct EntrySample {
+  Key key;
+  // Длина ключа и размер значения в хранимом виде, как в bytesInRange.
+  std::size_t bytes;
+  // Сколько секунд осталось до протухания с округлением вверх; 0 — без TTL.
+  uint32_t ttl;
+};
+
+// Пространство имен KVStorage (Features<..., Namespaces::Yes>). Записи,
+// сохраненные без пространства, относятся к kDefaultNamespace без квот.
+using NamespaceId = uint32_t;
+inline constexpr NamespaceId kDefaultNamespace = 0;
+
+// Квоты пространства имен. Байты записи — длина ключа и размер значения в
+// хранимом виде (сжатого или blob'а).
+struct NamespaceQuota {
+  std::size_t max_entries = std::numeric_limits<std::size_t>::max();
+  std::size_t max_bytes = std::numeric_limits<std::size_t>::max();
+};
+
+// Учет пространства имен, включая протухшие, но еще не удаленные записи.
+struct NamespaceUsage {
+  std::size_t entries = 0;
+  std::size_t bytes = 0;
+  // Сколько записей вытеснено при превышении квот.
+  uint64_t evictions = 0;
+};
+
+// K и V — типы ключа и значения. Ключи упорядочиваются operator<: строки
+// лексикографически, целые числа по величине. Сжатие и blob'ы доступны только
+// для строковых значений, значения других типов хранятся прямо в записи.
+// Traits — политики хеширования и хранения ключей и набор возможностей (см.
+// kv_traits.hpp). Для строковых ключей и значений есть краткая форма
+// KVStorage<Clock, Features<Sorted::No, Ttl::No>>.
+template <KVClock Clock, typename K = std::string, typename V = std::string,
+          typename Traits = KVTraits<K, V>>
 class KVStorage {
-  using Key = std::string;
-  using KeyView = std::string_view;
-  using Value = std::string;
+  static_assert(std::movable<V>);
+  static_assert(
+      KVHashPolicy<typename Traits::hasher, typename Traits::key_view>);
+
+  using Key = K;
+  using KeyStorage = typename Traits::key_storage;
+  using StoredKey = typename KeyStorage::stored_type;
+  using KeyView = typename Traits::key_view;
+  using Value = V;
+  using Hash = typename Traits::hasher;
+
+  static constexpr bool kStringValues = std::same_as<Value, std::string>;
+  static constexpr bool kSorted = Traits::features::kSorted;
+  static constexpr bool kBPlusTree = Traits::features::kBPlusTree;
+  static constexpr bool kTtl = Traits::features::kTtl;
+  static constexpr bool kAccess = Traits::features::kAccess;
+  static constexpr bool kNamespaces = Traits::features::kNamespaces;
+  static_assert(!kNamespaces || std::same_as<K, std::string>,
+                "Namespaces::Yes requires std::string keys");
+
+  // Заглушка вместо члена типа T, который не нужен при выбранных V и
+  // Features. Параметр делает заглушки разных членов разными типами, чтобы
+  // [[no_unique_address]] мог разместить их все по одному адресу.
+  template <typename T>
+  struct Unused {};
+
+  template <bool Enabled, typename T>
+  using OptionalMember = std::conditional_t<Enabled, T, Unused<T>>;
+
+  using BlobSlot = OptionalMember<kStringValues, ValueHandle>;
 
   using Duration = typename Clock::duration;
   using TimePoint = typename Clock::time_point;
@@ -45,76 +145,312 @@ class KVStorage {
   using InputEntry = std::tuple<Key, Value, uint32_t>;
   using OutputEntry = std::pair<Key, Value>;
 
+  struct ValueMetadata;
+
+  // Запись хеш-индекса. Вторичные индексы хранят указатели на записи, а не
+  // string_view ключей: так getManySorted и removeOneExpiredEntry получают
+  // запись без повторного хеширования ключа и поиска в KeyIndex.
+  using Entry = HashMapNode<StoredKey, ValueMetadata>;
+
+  // Сравнивает записи по ключу, поддерживает heterogenous lookup по KeyView.
+  struct EntryKeyLess {
+    using is_transparent = void;
+
+    bool operator()(const Entry* lhs, const Entry* rhs) const {
+      return lhs->key() < rhs->key();
+    }
+    bool operator()(const Entry* lhs, KeyView rhs) const {
+      return lhs->key() < rhs;
+    }
+    bool operator()(KeyView lhs, const Entry* rhs) const {
+      return lhs < rhs->key();
+    }
+  };
+
+  // B+-дерево сообщает о переносе записи в новый лист при расщеплении.
+  struct SortedRelocate {
+    template <typename Leaf>
+    void operator()(const Entry* entry, Leaf* leaf) const {
+      // Индекс хранит указатели на константные записи, но сами узлы KeyIndex
+      // не константны.
+      const_cast<Entry*>(entry)->mapped().sorted_it = leaf;
+    }
+  };
+
+  using SortedTree = std::set<const Entry*, EntryKeyLess>;
+  using SortedBPlusTree =
+      BPlusTree<const Entry*, EntryKeyLess, SortedRelocate>;
+
   // Важно, чтобы итераторы не инвалидировались при всех операциях над
   // хранилищем (кроме непосредственного удаления записей). Поэтому std::set и
-  // std::multimap — подходящие выборы.
-  using SortedKeyIndex = std::set<KeyView>;
-  using TtlIndex = std::multimap<TimePoint, KeyView>;
+  // std::multimap — подходящие выборы. B+-дерево перемещает записи между
+  // листьями, но обновляет их handle.
+  using SortedKeyIndex =
+      std::conditional_t<kBPlusTree, SortedBPlusTree, SortedTree>;
+  using TtlIndex = std::multimap<TimePoint, const Entry*>;
 
-  using SortedIterator = SortedKeyIndex::iterator;
+  // Соседи записи в списке ее пространства имен (Namespaces::Yes).
+  struct NamespaceLinks {
+    const Entry* older = nullptr;
+    const Entry* newer = nullptr;
+  };
+
+  using SortedIterator =
+      std::conditional_t<kBPlusTree, typename SortedBPlusTree::handle,
+                         typename SortedTree::iterator>;
   using TtlIterator = TtlIndex::iterator;
 
+  // Атрибут значения для вторичного индекса (см. addIndex) или
+  // std::nullopt, если значение в индекс не попадает.
+  using IndexExtractor =
+      std::function<std::optional<std::string>(const Value&)>;
+
+  // Запись вторичного индекса: атрибут значения и запись KeyIndex.
+  using IndexItem = std::pair<std::string, const Entry*>;
+
+  // Упорядочивает по атрибуту, при равных атрибутах — по ключу. Поиск по
+  // std::string_view сравнивает только атрибут.
+  struct IndexItemLess {
+    using is_transparent = void;
+
+    bool operator()(const IndexItem& lhs, const IndexItem& rhs) const {
+      if (lhs.first != rhs.first) {
+        return lhs.first < rhs.first;
+      }
+      return lhs.second->key() < rhs.second->key();
+    }
+    bool operator()(const IndexItem& lhs, std::string_view rhs) const {
+      return lhs.first < rhs;
+    }
+    bool operator()(std::string_view lhs, const IndexItem& rhs) const {
+      return lhs < rhs.first;
+    }
+  };
+
+  // Значение, подготовленное к записи: байты в представлении codec или
+  // blob, если codec == ValueCodec::kBlob.
+  struct PreparedValue {
+    Value bytes;
+    BlobSlot blob;
+    ValueCodec codec;
+  };
+
   struct ValueMetadata {
-    Value value;
+    // Активный член определяется codec. Объединение вместо отдельного поля
+    // под blob сохраняет размер записи.
+    union {
+      // Значение как есть или сжатое.
+      Value value;
+      // Большое значение (codec == ValueCodec::kBlob).
+      BlobSlot blob;
+    };
     // Храним время протухания здесь, так как 95% операций — чтение.
     // Иначе пришлось бы каждый раз разыменовывать итератор в TtlIndex,
     // что хуже для cache locality.
-    // ttl == 0 <=> expiry == std::nullopt.
-    std::optional<TimePoint> expiry;
+    // Невалидно, если has_expiry == false (ttl == 0).
+    [[no_unique_address]] OptionalMember<kTtl, TimePoint> expiry;
     // Храним итераторы на set и multimap, чтобы использовать их для
-    // амортизированного O(1) удаления.
-    SortedIterator sorted_it;
-    // Невалиден, если expiry == std::nullopt.
-    TtlIterator ttl_it;
-
-    ValueMetadata(Value value, std::optional<TimePoint> expiry,
-                  SortedIterator sorted_it, TtlIterator ttl_it)
-        : value(std::move(value)),
-          expiry(expiry),
-          sorted_it(sorted_it),
-          ttl_it(ttl_it) {}
+    // амортизированного O(1) удаления. Заполняются после вставки записи.
+    [[no_unique_address]] OptionalMember<kSorted, SortedIterator> sorted_it;
+    // Невалиден, если has_expiry == false.
+    [[no_unique_address]] OptionalMember<kTtl, TtlIterator> ttl_it;
+    // Список записей пространства имен в порядке последнего set.
+    [[no_unique_address]] mutable OptionalMember<kNamespaces, NamespaceLinks>
+        namespace_links;
+    // Флаги лежат в конце структуры и занимают ее хвостовое выравнивание, а
+    // не отдельные 8 B, как флаг std::optional<TimePoint>.
+    [[no_unique_address]] OptionalMember<kTtl, bool> has_expiry;
+    ValueCodec codec;
+    // Счетчик частоты и время последнего обращения в секундах от создания
+    // хранилища (Access::Yes). Тоже занимают хвостовое выравнивание, и get
+    // обновляет их в той же кеш-линии, из которой читает значение.
+    [[no_unique_address]] mutable OptionalMember<kAccess, uint8_t> frequency;
+    [[no_unique_address]] mutable OptionalMember<kAccess, uint32_t>
+        last_access;
+    [[no_unique_address]] OptionalMember<kNamespaces, NamespaceId>
+        namespace_id;
+    // Поколение пространства имен на момент set: запись из поколения
+    // меньше текущего удалена dropNamespace и ждет reapDropped.
+    [[no_unique_address]] OptionalMember<kNamespaces, uint32_t>
+        namespace_generation;
 
-    bool isExpired(TimePoint now) const {
-      return expiry.has_value() && expiry <= now;
+    ValueMetadata(PreparedValue prepared, std::optional<TimePoint> expiry)
+        : codec(ValueCodec::kRaw),
+          frequency(),
+          last_access(),
+          namespace_id(),
+          namespace_generation() {
+      setExpiry(expiry);
+      construct(std::move(prepared));
     }
-  };
 
-  // Кастомный хэш для поддержки heterogenous lookup.
-  struct string_hash {
-    using hash_type = std::hash<std::string_view>;
-    using is_transparent = void;
+    ValueMetadata(const ValueMetadata&) = delete;
+    ValueMetadata& operator=(const ValueMetadata&) = delete;
+
+    ~ValueMetadata() { destroy(); }
 
-    std::size_t operator()(const char* str) const { return hash_type{}(str); }
-    std::size_t operator()(std::string_view str) const {
-      return hash_type{}(str);
+    bool isBlob() const {
+      return kStringValues && codec == ValueCodec::kBlob;
     }
-    std::size_t operator()(const std::string& str) const {
-      return hash_type{}(str);
+
+    void assign(PreparedValue prepared) {
+      destroy();
+      construct(std::move(prepared));
+    }
+
+    void setExpiry(std::optional<TimePoint> new_expiry) {
+      if constexpr (kTtl) {
+        has_expiry = new_expiry.has_value();
+        expiry = new_expiry.value_or(TimePoint());
+      }
+    }
+
+    bool isExpired(TimePoint now) const {
+      if constexpr (kTtl) {
+        return has_expiry && expiry <= now;
+      } else {
+        return false;
+      }
+    }
+
+   private:
+    void construct(PreparedValue prepared) {
+      codec = prepared.codec;
+      if (isBlob()) {
+        std::construct_at(&blob, std::move(prepared.blob));
+      } else {
+        std::construct_at(&value, std::move(prepared.bytes));
+      }
+    }
+
+    void destroy() {
+      if (isBlob()) {
+        std::destroy_at(&blob);
+      } else {
+        std::destroy_at(&value);
+      }
     }
   };
 
   // Важно чтобы указатели не инвалидировались при любых операциях, чтобы
-  // string_view в других контейнерах оставались валидными. Поэтому
-  // unordered_map — подходящий выбор.
+  // указатели на записи в других контейнерах оставались валидными. Поэтому
+  // используем таблицу с цепочками. В отличие от std::unordered_map она
+  // рехеширует инкрементально и не останавливает set на время переноса
+  // всех записей.
   using KeyIndex =
-      std::unordered_map<Key, ValueMetadata, string_hash, std::equal_to<>>;
+      IncrementalHashMap<StoredKey, ValueMetadata, Hash, std::equal_to<>>;
+
+  struct Tombstone;
+
+  using TombstoneEntry = HashMapNode<StoredKey, Tombstone>;
+  using TombstoneTtlIndex = std::multimap<TimePoint, const TombstoneEntry*>;
+
+  // Отрицательная запись: только ключ и время протухания, без значения и
+  // без места в SortedKeyIndex. Бесконечный tombstone протухает в
+  // TimePoint::max().
+  struct Tombstone {
+    TimePoint expiry;
+    typename TombstoneTtlIndex::iterator ttl_it;
+
+    explicit Tombstone(TimePoint expiry) : expiry(expiry) {}
+  };
+
+  // Отдельная от KeyIndex таблица: ключ лежит либо в KeyIndex, либо здесь.
+  using TombstoneIndex =
+      IncrementalHashMap<StoredKey, Tombstone, Hash, std::equal_to<>>;
+
+  // Список записей пространства имен от давно записанных к недавно
+  // записанным: порядок вытеснения.
+  struct EntryList {
+    const Entry* oldest = nullptr;
+    const Entry* newest = nullptr;
+  };
+
+  // Пространство имен: префикс его ключей, квоты и учет записей текущего
+  // поколения. Записи прошлых поколений лежат в dropped до reapDropped.
+  struct Namespace {
+    std::string prefix;
+    NamespaceQuota quota;
+    NamespaceUsage usage;
+    EntryList live;
+    EntryList dropped;
+    uint32_t generation = 0;
+  };
+
+  struct SecondaryIndex {
+    std::string name;
+    IndexExtractor extract;
+    std::set<IndexItem, IndexItemLess> items;
+  };
+
+  // Загрузка importStream в пустое хранилище без квот: ключи строго
+  // возрастают и идут в конец SortedKeyIndex, а TtlIndex строится в конце
+  // загрузки из отсортированных времен протухания, а не случайными
+  // вставками.
+  struct BulkLoad {
+    std::vector<std::pair<TimePoint, const Entry*>> expiries;
+  };
+
+  // Минимальная емкость фильтра Блума, чтобы маленькое хранилище не
+  // перестраивало его на каждой вставке.
+  static constexpr std::size_t kMinMissFilterCapacity = 1'024;
+
+  // Логарифмический счетчик частоты: обращение увеличивает счетчик f с
+  // вероятностью 2^-f, поэтому 15 соответствует десяткам тысяч обращений.
+  // Каждые kFrequencyDecaySeconds без обращений счетчик уменьшается на 1.
+  static constexpr uint8_t kMaxFrequency = 15;
+  static constexpr uint32_t kFrequencyDecaySeconds = 60;
+
+  // Сколько протухших tombstone освобождает один removeOneExpiredEntry.
+  // Больше одного, чтобы освобождение обгоняло setAbsent.
+  static constexpr std::size_t kTombstonesPerExpiry = 2;
+
+  // sample: начальная оценка длины цепочки KeyIndex (при коэффициенте
+  // заполнения до 1 длиннее почти не бывает, а встреченная более длинная ее
+  // увеличивает до конца жизни хранилища) и число попыток на запись
+  // выборки.
+  static constexpr std::size_t kSampleChainBound = 4;
+  static constexpr std::size_t kSampleAttempts = 16;
+
+  // importStream не доверяет оценке числа записей из заголовка потока:
+  // сначала резервирует KeyIndex не больше чем под столько записей, а
+  // дальше удваивает резерв, только когда записи действительно пришли.
+  // Так поддельный заголовок не выделяет больше, чем вдвое сверх
+  // загруженного.
+  static constexpr std::size_t kImportReserveStep = 64 * 1'024;
+  static constexpr std::size_t kUnlimited =
+      std::numeric_limits<std::size_t>::max();
 
  public:
   // Инициализирует хранилище переданным множеством записей. Размер span может
   // быть очень большим. Также принимает абстракцию часов (Clock) для
-  // возможности управления временем в тестах.
-  explicit KVStorage(std::span<InputEntry> entries, Clock clock = Clock())
-      : clock_(std::move(clock)) {
+  // возможности управления временем в тестах и политику хеширования (по
+  // умолчанию со случайным seed).
+  explicit KVStorage(std::span<InputEntry> entries, Clock clock = Clock(),
+                     Hash hash = Hash())
+      : clock_(std::move(clock)), key_index_(hash) {
+    if constexpr (kTtl) {
+      tombstones_ = TombstoneIndex(std::move(hash));
+    }
+
     // Отсчет time to live должен начаться с момента вызова конструктора для
     // всех записей из span.
-    TimePoint now = Clock::now();
+    TimePoint now = currentTime();
+    if constexpr (kAccess) {
+      access_epoch_ = now;
+      access_random_ = 0x9e3779b97f4a7c15ULL;
+    }
+    if constexpr (kNamespaces) {
+      namespaces_.emplace_back();
+      dropped_entries_ = 0;
+    }
 
     // Предотвращаем лишние вызовы rehash.
     key_index_.reserve(entries.size());
 
     for (auto& [key, value, ttl] : entries) {
-      set_impl(std::move(key), std::move(value), static_cast<Seconds>(ttl),
-               now);
+      set_impl(std::move(key), prepare(std::move(value)),
+               static_cast<Seconds>(ttl), now);
     }
   }
 
@@ -123,67 +459,197 @@ class KVStorage {
   // Присваивает по ключу кеу значение value.
   // Если ttl == 0, то время жизни записи - бесконечность, иначе запись должна
   // перестать быть доступной через ttl секунд. Безусловно обновляет ttl записи.
-  // O(logN) time complexity.
+  // Без Ttl::Yes допустим только ttl == 0, иначе бросает
+  // std::invalid_argument. С Namespaces::Yes запись попадает в
+  // kDefaultNamespace; если она одна превышает квоты пространства, бросает
+  // std::length_error и ничего не меняет.
+  // O(logN) time complexity; O(1) в среднем без SortedKeyIndex и TtlIndex.
   void set(Key key, Value value, uint32_t ttl) {
-    TimePoint now = Clock::now();
+    TimePoint now = currentTime();
+
+    set_impl(std::move(key), prepare(std::move(value)),
+             static_cast<Seconds>(ttl), now);
+  }
+
+  // Как set, но принимает уже разделяемое значение: большое значение
+  // сохраняется без копирования, маленькое копируется в запись. Пустой
+  // (nullptr) value бросает std::invalid_argument и ничего не меняет.
+  void set(Key key, ValueHandle value, uint32_t ttl)
+    requires kStringValues
+  {
+    TimePoint now = currentTime();
 
-    set_impl(std::move(key), std::move(value), static_cast<Seconds>(ttl), now);
+    set_impl(std::move(key), prepare(std::move(value)),
+             static_cast<Seconds>(ttl), now);
+  }
+
+  // Как set, но сохраняет запись в пространство имен ns; запись ключа из
+  // другого пространства переходит в ns. Ключ должен начинаться с префикса
+  // пространства, иначе бросает std::invalid_argument. Если с новой записью
+  // пространство превышает квоты, вытесняет его записи, дольше всех не
+  // перезаписывавшиеся (см. set о записи, которая одна превышает квоты).
+  // O(logN) time complexity на запись и на каждую вытесненную; учет и
+  // проверка квот — O(1).
+  void set(NamespaceId ns, Key key, Value value, uint32_t ttl)
+    requires kNamespaces
+  {
+    if (!key.starts_with(namespaces_.at(ns).prefix)) {
+      throw std::invalid_argument("key is outside of the namespace");
+    }
+    TimePoint now = currentTime();
+
+    set_impl(std::move(key), prepare(std::move(value)),
+             static_cast<Seconds>(ttl), now, ns);
   }
 
   // Удаляет запись по ключу кеу.
   // Возвращает true, если запись была удалена. Если ключа не было до удаления,
-  // то вернет false.
+  // то вернет false. Tombstone ключа тоже удаляется (и тоже дает true).
+  // Запись, удаленная dropNamespace, освобождается сразу, но дает false.
   // amortized O(1) time complexity.
   bool remove(KeyView key) {
-    auto entry_it = key_index_.find(key);
+    auto entry_it = findEntry(key);
     if (entry_it == key_index_.end()) {
-      return false;
+      if constexpr (kTtl) {
+        return eraseTombstone(key);
+      } else {
+        return false;
+      }
     }
 
-    sorted_index_.erase(entry_it->second.sorted_it);
-    if (entry_it->second.expiry.has_value()) {
-      ttl_index_.erase(entry_it->second.ttl_it);
-    }
-    key_index_.erase(entry_it);
+    bool dropped = isDropped(entry_it->second);
+    unindex(entry_it.node());
+    key_index_.erase(entry_it.node());
 
-    return true;
+    return !dropped;
   }
 
   // Получает значение по ключу key. Если данного ключа нет, то вернет
   // std::nullopt.
   // average-case O(1) time complexity.
   std::optional<Value> get(KeyView key) const {
-    auto entry_it = key_index_.find(key);
+    auto entry_it = findEntry(key);
 
     if (entry_it == key_index_.end()) {
       return std::nullopt;
     }
 
-    if (entry_it->second.isExpired(Clock::now())) {
+    TimePoint now = currentTime();
+    if (!isLive(entry_it->second, now)) {
       return std::nullopt;
     }
 
-    return entry_it->second.value;
+    touch(entry_it->second, now);
+    return load(entry_it->second);
   }
 
-  // Возвращает следующие count записей начиная с key в порядке
-  // лексикографической сортировки ключей.
+  // Запоминает, что ключа key нет в источнике данных (negative caching):
+  // удаляет его запись и хранит вместо нее tombstone — только ключ и время
+  // протухания. Если ttl == 0, tombstone живет до set или remove ключа.
+  // Протухшие tombstone освобождает removeOneExpiredEntry.
+  // O(logN) time complexity.
+  void setAbsent(Key key, uint32_t ttl)
+    requires kTtl
+  {
+    TimePoint now = currentTime();
+    TimePoint expiry =
+        ttl == 0 ? TimePoint::max()
+                 : now + static_cast<Duration>(static_cast<Seconds>(ttl));
+
+    auto entry_it = key_index_.find(KeyView(key));
+    if (entry_it != key_index_.end()) {
+      unindex(entry_it.node());
+      key_index_.erase(entry_it.node());
+    }
+
+    auto [tombstone_it, inserted] = tombstones_.lazy_emplace(
+        KeyView(key),
+        [&] { return KeyStorage::make(key_pool_, std::move(key)); }, expiry);
+    Tombstone& tombstone = tombstone_it->second;
+    if (!inserted) {
+      tombstone_ttl_index_.erase(tombstone.ttl_it);
+      tombstone.expiry = expiry;
+    }
+    tombstone.ttl_it =
+        tombstone_ttl_index_.emplace(expiry, tombstone_it.node());
+  }
+
+  // Как get, но отличает отсутствующий ключ от известного как отсутствующий
+  // (с непротухшим tombstone). value заполнено только для kPresent.
+  // average-case O(1) time complexity.
+  std::pair<KeyState, std::optional<Value>> lookup(KeyView key) const
+    requires kTtl
+  {
+    TimePoint now = currentTime();
+
+    auto entry_it = findEntry(key);
+    if (entry_it != key_index_.end()) {
+      if (!isLive(entry_it->second, now)) {
+        return {KeyState::kAbsent, std::nullopt};
+      }
+      touch(entry_it->second, now);
+      return {KeyState::kPresent, load(entry_it->second)};
+    }
+
+    if (!tombstones_.empty()) {
+      auto tombstone_it = tombstones_.find(key);
+      if (tombstone_it != tombstones_.end() &&
+          !(tombstone_it->second.expiry <= now)) {
+        return {KeyState::kKnownAbsent, std::nullopt};
+      }
+    }
+    return {KeyState::kAbsent, std::nullopt};
+  }
+
+  // Число tombstone, включая протухшие, но еще не освобожденные.
+  std::size_t tombstoneCount() const
+    requires kTtl
+  {
+    return tombstones_.size();
+  }
+
+  // Как get, но для больших значений возвращает ссылку на blob без
+  // копирования. Ссылка остается валидной после перезаписи или удаления
+  // записи. Маленькие значения копируются в новый blob.
+  // average-case O(1) time complexity.
+  std::optional<ValueHandle> getShared(KeyView key) const
+    requires kStringValues
+  {
+    auto entry_it = findEntry(key);
+
+    TimePoint now = currentTime();
+    if (entry_it == key_index_.end() || !isLive(entry_it->second, now)) {
+      return std::nullopt;
+    }
+
+    touch(entry_it->second, now);
+    if (entry_it->second.isBlob()) {
+      return entry_it->second.blob;
+    }
+    return std::make_shared<const std::string>(load(entry_it->second));
+  }
+
+  // Возвращает следующие count записей начиная с key в порядке возрастания
+  // ключей (для строк — лексикографическом).
   // Пример: ("a", "val1"), ("b", "val2"), ("d", "val3"), ("e", "val4")
   // getManySorted ("c", 2) -> ("d", "val3"), ("e", "val4").
   // O(logN + count) time complexity.
-  std::vector<OutputEntry> getManySorted(KeyView key, uint32_t count) const {
+  std::vector<OutputEntry> getManySorted(KeyView key, uint32_t count) const
+    requires kSorted
+  {
     std::vector<OutputEntry> result;
     result.reserve(count);
 
-    TimePoint now = Clock::now();
+    TimePoint now = currentTime();
 
-    auto first_it = sorted_index_.lower_bound(key);
+    auto first_it = sortedLowerBound(key);
 
     while (first_it != sorted_index_.end() && result.size() < count) {
-      auto entry_it = key_index_.find(*first_it);
+      const Entry* entry = *first_it;
 
-      if (!entry_it->second.isExpired(now)) {
-        result.emplace_back(entry_it->first, entry_it->second.value);
+      if (isLive(entry->mapped(), now)) {
+        result.emplace_back(KeyStorage::materialize(entry->key()),
+                            load(entry->mapped()));
       }
 
       ++first_it;
@@ -192,70 +658,1120 @@ class KVStorage {
     return result;
   }
 
+  // Число записей с ключами в [begin, end) без копирования значений.
+  // Как и namespaceUsage, учитывает протухшие записи, которые еще не удалил
+  // removeOneExpiredEntry, и удаленные dropNamespace до reapDropped.
+  // O(logN) time complexity с Sorted::BPlusTree, O(logN + k) с std::set.
+  std::size_t countRange(KeyView begin, KeyView end) const
+    requires kSorted
+  {
+    if (!(begin < end)) {
+      return 0;
+    }
+    if constexpr (kBPlusTree) {
+      return sorted_index_.rank(end, orderedPrefix(end)) -
+             sorted_index_.rank(begin, orderedPrefix(begin));
+    } else {
+      return static_cast<std::size_t>(std::distance(
+          sorted_index_.lower_bound(begin), sorted_index_.lower_bound(end)));
+    }
+  }
+
+  // Байты записей с ключами в [begin, end): длины ключей и размеры значений
+  // в хранимом виде, как в квотах пространств имен. Учитывает те же записи,
+  // что и countRange; значения не копируются и не распаковываются.
+  // O(logN + k) time complexity.
+  std::size_t bytesInRange(KeyView begin, KeyView end) const
+    requires kSorted
+  {
+    std::size_t bytes = 0;
+    for (auto it = sortedLowerBound(begin);
+         it != sorted_index_.end() && (*it)->key() < end; ++it) {
+      bytes += entryBytes(*it);
+    }
+    return bytes;
+  }
+
+  // Число ключей, меньших key (тех же записей, что учитывает countRange).
+  // Вместе с select позволяет перейти к странице по ее номеру.
+  // O(logN) time complexity.
+  std::size_t rank(KeyView key) const
+    requires kBPlusTree
+  {
+    return sorted_index_.rank(key, orderedPrefix(key));
+  }
+
+  // Ключ с номером index в порядке возрастания или std::nullopt, если
+  // index не меньше числа записей. Случайный index дает равномерную
+  // выборку ключей.
+  // O(logN) time complexity.
+  std::optional<Key> select(std::size_t index) const
+    requires kBPlusTree
+  {
+    auto it = sorted_index_.select(index);
+    if (it == sorted_index_.end()) {
+      return std::nullopt;
+    }
+    return KeyStorage::materialize((*it)->key());
+  }
+
+  // k случайных живых записей с возвращением (запись может встретиться
+  // несколько раз) без копирования значений: оценка распределения размеров
+  // и TTL или кандидаты на вытеснение, как в sampled LRU Redis. Каждая
+  // живая запись выбирается с равной вероятностью (см.
+  // IncrementalHashMap::randomNode); протухшие и удаленные dropNamespace
+  // записи пропускаются. Если таких почти все, может вернуть меньше k
+  // записей: попыток не больше kSampleAttempts * k.
+  // O(k) expected time complexity.
+  template <std::uniform_random_bit_generator Rng>
+  std::vector<EntrySample<Key>> sample(std::size_t k, Rng& rng) const {
+    std::vector<EntrySample<Key>> result;
+    if (key_index_.empty()) {
+      return result;
+    }
+    result.reserve(k);
+
+    TimePoint now = currentTime();
+    for (std::size_t attempt = 0;
+         result.size() < k && attempt / kSampleAttempts < k; ++attempt) {
+      const Entry* entry = key_index_.randomNode(rng, sample_chain_bound_);
+      if (isLive(entry->mapped(), now)) {
+        result.push_back({KeyStorage::materialize(entry->key()),
+                          entryBytes(entry),
+                          remainingTtl(entry->mapped(), now)});
+      }
+    }
+    return result;
+  }
+
+  // Пишет живые записи в порядке ключей в поток формата kv_stream.hpp:
+  // ключ, значение и время протухания в Unix time по system_clock, чтобы
+  // поток можно было перенести на другой хост или отдать новой реплике.
+  // Протухшие и удаленные dropNamespace записи пропускаются. Помимо
+  // хранилища память — один блок потока. Возвращает число записей.
+  // O(N) time complexity.
+  std::size_t exportStream(StreamWriter& writer) const
+    requires kSorted && StreamField<Key> && StreamField<Value>
+  {
+    TimePoint now = currentTime();
+    auto wall_now = std::chrono::system_clock::now();
+    RecordStreamWriter stream(writer, key_index_.size());
+    std::string scratch;
+    for (const Entry* entry : sorted_index_) {
+      const ValueMetadata& metadata = entry->mapped();
+      if (!isLive(metadata, now)) {
+        continue;
+      }
+      uint64_t expiry_ms = 0;
+      if constexpr (kTtl) {
+        if (metadata.has_expiry) {
+          auto expiry = wall_now + (metadata.expiry - now);
+          expiry_ms = static_cast<uint64_t>(
+              std::chrono::ceil<std::chrono::milliseconds>(
+                  expiry.time_since_epoch())
+                  .count());
+        }
+      }
+      Key key = KeyStorage::materialize(entry->key());
+      stream.add(streamFieldBytes(key), storedValueBytes(metadata, scratch),
+                 expiry_ms);
+    }
+    stream.finish();
+    return stream.records();
+  }
+
+  // Загружает записи потока exportStream и возвращает число загруженных.
+  // Записи, протухшие к моменту загрузки, пропускаются; ключи, которые уже
+  // есть в хранилище, перезаписываются, как set. Загрузка в пустое
+  // хранилище (начальная загрузка реплики) резервирует KeyIndex по
+  // заголовку потока, но не сверх уже загруженного (kImportReserveStep),
+  // добавляет записи в конец SortedKeyIndex без поиска места (ключи потока
+  // строго возрастают) и строит TtlIndex в конце из отсортированных времен
+  // протухания. Читает поток по одному блоку и не дальше его конца. Бросает
+  // std::runtime_error, если поток поврежден, оборван или ключи в нем не
+  // возрастают, и std::invalid_argument на запись с TTL без Ttl::Yes;
+  // записи, загруженные до ошибки, остаются.
+  // O(N logN) time complexity; в пустое хранилище O(logN) только на
+  // сортировку времен протухания и веса B+-дерева.
+  std::size_t importStream(StreamReader& reader)
+    requires StreamField<Key> && StreamField<Value>
+  {
+    RecordStreamReader stream(reader);
+    TimePoint now = currentTime();
+    auto wall_now = std::chrono::system_clock::now();
+
+    bool bulk_load = key_index_.empty();
+    if constexpr (kNamespaces) {
+      // Вытеснение по квоте удалило бы записи, которых еще нет в TtlIndex.
+      const NamespaceQuota& quota = namespaces_[kDefaultNamespace].quota;
+      bulk_load = bulk_load && quota.max_entries == kUnlimited &&
+                  quota.max_bytes == kUnlimited;
+    }
+    std::optional<BulkLoad> bulk;
+    std::size_t reserved = 0;
+    auto reserveNext = [&] {
+      reserved = static_cast<std::size_t>(std::min<uint64_t>(
+          stream.sizeHint(), std::max(kImportReserveStep, 2 * reserved)));
+      key_index_.reserve(reserved);
+    };
+    if (bulk_load) {
+      bulk.emplace();
+      reserveNext();
+    }
+
+    std::size_t imported = 0;
+    std::optional<Key> previous;
+    StreamRecordView record;
+    try {
+      while (stream.next(record)) {
+        Key key = streamFieldFrom<Key>(record.key);
+        if (previous.has_value() && !(*previous < key)) {
+          throw std::runtime_error("corrupted stream: keys are not sorted");
+        }
+        previous = key;
+
+        std::optional<TimePoint> expiry;
+        if (record.expiry_unix_ms != 0) {
+          if constexpr (!kTtl) {
+            throw std::invalid_argument("ttl requires Ttl::Yes");
+          }
+          auto left = std::chrono::milliseconds(record.expiry_unix_ms) -
+                      wall_now.time_since_epoch();
+          if (left <= std::chrono::milliseconds::zero()) {
+            continue;
+          }
+          expiry =
+              now + std::chrono::ceil<typename TimePoint::duration>(left);
+        }
+        store(std::move(key), prepare(streamFieldFrom<Value>(record.value)),
+              expiry, now, kDefaultNamespace, bulk ? &*bulk : nullptr);
+        ++imported;
+        if (bulk && key_index_.size() == reserved &&
+            reserved < stream.sizeHint()) {
+          reserveNext();
+        }
+      }
+    } catch (...) {
+      // Записи, загруженные до ошибки, должны попасть в TtlIndex.
+      if (bulk) {
+        finishBulkLoad(*bulk);
+      }
+      throw;
+    }
+    if (bulk) {
+      finishBulkLoad(*bulk);
+    }
+    return imported;
+  }
+
   // Удаляет протухшую запись из структуры и возвращает ее.
   // Если удалять нечего, то вернет std::nullopt.
   // Если на момент вызова метода протухло несколько записей, то можно удалить
-  // любую.
+  // любую. Попутно освобождает до kTombstonesPerExpiry протухших tombstone.
   // amortized O(1) time complexity.
-  std::optional<OutputEntry> removeOneExpiredEntry() {
+  std::optional<OutputEntry> removeOneExpiredEntry()
+    requires kTtl
+  {
+    TimePoint now = currentTime();
+
+    for (std::size_t i = 0; i < kTombstonesPerExpiry; ++i) {
+      auto tombstone_it = tombstone_ttl_index_.begin();
+      if (tombstone_it == tombstone_ttl_index_.end() ||
+          !(tombstone_it->first <= now)) {
+        break;
+      }
+      const TombstoneEntry* tombstone = tombstone_it->second;
+      tombstone_ttl_index_.erase(tombstone_it);
+      tombstones_.erase(tombstone);
+    }
+
     auto expired_it = ttl_index_.begin();
-    if (expired_it == ttl_index_.end() ||
-        !(expired_it->first <= Clock::now())) {
+    if (expired_it == ttl_index_.end() || !(expired_it->first <= now)) {
       return std::nullopt;
     }
 
-    auto entry_it = key_index_.find(expired_it->second);
+    const Entry* entry = expired_it->second;
+    // Протухшие записи, удаленные dropNamespace, освобождаются молча.
+    while (isDropped(entry->mapped())) {
+      unindex(entry);
+      key_index_.erase(entry);
+      expired_it = ttl_index_.begin();
+      if (expired_it == ttl_index_.end() || !(expired_it->first <= now)) {
+        return std::nullopt;
+      }
+      entry = expired_it->second;
+    }
 
-    sorted_index_.erase(entry_it->second.sorted_it);
-    ttl_index_.erase(entry_it->second.ttl_it);
+    unindex(entry);
 
-    auto node_handle = key_index_.extract(entry_it);
+    auto node_handle = key_index_.extract(entry);
 
     return std::make_optional<OutputEntry>(
-        std::move(node_handle.key()), std::move(node_handle.mapped().value));
+        KeyStorage::release(node_handle.key()),
+        release(node_handle.mapped()));
+  }
+
+  // Включает сжатие значений с заданными параметрами или выключает его
+  // (std::nullopt). Влияет только на последующие set: уже сохраненные
+  // значения остаются в своем представлении и читаются как прежде.
+  void setCompression(std::optional<CompressionOptions> options)
+    requires kStringValues
+  {
+    compressor_.setOptions(std::move(options));
+  }
+
+  // Настраивает хранение больших значений в blob'ах (по умолчанию — от
+  // 64 KiB, освобождение в потоке вызывающего) или выключает его
+  // (std::nullopt). Влияет только на последующие set. Большие значения не
+  // сжимаются: их отдают по ссылке.
+  void setBlobOptions(std::optional<BlobOptions> options)
+    requires kStringValues
+  {
+    blobs_.setOptions(options);
   }
 
+  // Включает фильтр Блума перед KeyIndex с заданными параметрами или
+  // выключает его (std::nullopt). С фильтром get, getShared, lookup и remove
+  // отсутствующего ключа обычно не ищут его в хеш-таблице. Фильтр строится
+  // сразу по текущим ключам за O(N) и перестраивается, когда ключей
+  // становится больше его емкости или удаленных ключей — больше половины ее.
+  void setMissFilter(std::optional<BloomFilterOptions> options) {
+    miss_filter_options_ = options;
+    if (options.has_value()) {
+      rebuildMissFilter();
+    } else {
+      miss_filter_ = BlockedBloomFilter();
+    }
+  }
+
+  // Включает сбор статистики обращений с заданными параметрами или
+  // выключает его (std::nullopt). Учитываются get, getShared, lookup, set и
+  // remove: HyperLogLog — каждое обращение, count-min и самые частые
+  // ключи — в среднем каждое sample_rate-е. Включение сбрасывает
+  // накопленную статистику.
+  void setAccessStats(std::optional<AccessStatsOptions> options) {
+    if (options.has_value()) {
+      access_stats_ = std::make_unique<AccessStats<Key>>(*options);
+    } else {
+      access_stats_.reset();
+    }
+  }
+
+  // Статистика обращений с момента включения или resetAccessStats:
+  // например, число различных ключей за минуту, если сбрасывать ее раз в
+  // минуту. std::nullopt, если сбор выключен.
+  std::optional<AccessStatsSnapshot<Key>> accessStats() const {
+    if (access_stats_ == nullptr) {
+      return std::nullopt;
+    }
+    return access_stats_->snapshot();
+  }
+
+  // Оценка сверху числа обращений к ключу key (0, если сбор выключен).
+  uint64_t accessFrequency(KeyView key) const {
+    if (access_stats_ == nullptr) {
+      return 0;
+    }
+    return access_stats_->estimateFrequency(key_index_.hash_function()(key));
+  }
+
+  void resetAccessStats() {
+    if (access_stats_ != nullptr) {
+      access_stats_->clear();
+    }
+  }
+
+  // Метаданные обращений к записи key. Сам вызов обращением не считается.
+  // average-case O(1) time complexity.
+  std::optional<AccessInfo> accessInfo(KeyView key) const
+    requires kAccess
+  {
+    auto entry_it = key_index_.find(key);
+    TimePoint now = currentTime();
+    if (entry_it == key_index_.end() || !isLive(entry_it->second, now)) {
+      return std::nullopt;
+    }
+    return accessInfo(entry_it->second, accessStamp(now));
+  }
+
+  // Ключи, к которым не обращались older_than секунд и дольше, с
+  // метаданными обращений: кандидаты на вытеснение или перенос в более
+  // медленное хранилище. Например, вытеснять сначала ключи с наименьшей
+  // частотой, а среди них — с наибольшим временем простоя. Обращениями
+  // считаются get, getShared, lookup и set; getManySorted и сам обход их не
+  // обновляют. Протухшие записи пропускаются.
+  // O(N) time complexity.
+  std::vector<std::pair<Key, AccessInfo>> idleKeys(uint32_t older_than) const
+    requires kAccess
+  {
+    TimePoint now = currentTime();
+    uint32_t stamp = accessStamp(now);
+
+    std::vector<std::pair<Key, AccessInfo>> result;
+    for (auto it = key_index_.begin(); it != key_index_.end(); ++it) {
+      const ValueMetadata& metadata = it->second;
+      if (!isLive(metadata, now) ||
+          stamp - metadata.last_access < older_than) {
+        continue;
+      }
+      result.emplace_back(KeyStorage::materialize(it->first),
+                          accessInfo(metadata, stamp));
+    }
+    return result;
+  }
+
+  // Создает пространство имен для ключей с префиксом prefix и квотами
+  // quota. Префикс не должен быть пустым, началом префикса другого
+  // пространства или его продолжением, иначе бросает std::invalid_argument:
+  // так каждый ключ относится не более чем к одному пространству. Уже
+  // сохраненные ключи с этим префиксом остаются в kDefaultNamespace, пока их
+  // не перезапишут через set(ns, ...).
+  // O(число пространств) time complexity.
+  NamespaceId createNamespace(std::string prefix, NamespaceQuota quota = {})
+    requires kNamespaces
+  {
+    if (prefix.empty()) {
+      throw std::invalid_argument("namespace prefix must not be empty");
+    }
+    for (const Namespace& space : namespaces_) {
+      if (!space.prefix.empty() && (space.prefix.starts_with(prefix) ||
+                                    prefix.starts_with(space.prefix))) {
+        throw std::invalid_argument("namespace prefix overlaps another one");
+      }
+    }
+    namespaces_.push_back({std::move(prefix), quota, {}, {}, {}, 0});
+    return static_cast<NamespaceId>(namespaces_.size() - 1);
+  }
+
+  // Меняет квоты пространства имен ns и сразу вытесняет лишние записи.
+  void setNamespaceQuota(NamespaceId ns, NamespaceQuota quota)
+    requires kNamespaces
+  {
+    namespaces_.at(ns).quota = quota;
+    enforceQuota(ns);
+  }
+
+  // O(1) time complexity.
+  NamespaceUsage namespaceUsage(NamespaceId ns) const
+    requires kNamespaces
+  {
+    return namespaces_.at(ns).usage;
+  }
+
+  // Удаляет все записи пространства имен ns: они сразу перестают быть
+  // видны get, getShared, lookup, getManySorted и остальным чтениям, а
+  // память освобождает reapDropped. Пространство остается пустым и готовым
+  // к новым set; удаленные записи не входят в его учет и квоты.
+  // O(1) time complexity.
+  void dropNamespace(NamespaceId ns)
+    requires kNamespaces
+  {
+    Namespace& space = namespaces_.at(ns);
+    if (space.live.oldest == nullptr) {
+      return;
+    }
+    if (space.dropped.oldest == nullptr) {
+      reap_queue_.push_back(ns);
+    }
+    splice(space.dropped, space.live);
+    dropped_entries_ += space.usage.entries;
+    ++space.generation;
+    space.usage.entries = 0;
+    space.usage.bytes = 0;
+  }
+
+  // Фоновый шаг очистки после dropNamespace: освобождает не более entries
+  // удаленных записей. Возвращает true, если такие записи еще остались.
+  // O(entries * logN) time complexity.
+  bool reapDropped(std::size_t entries)
+    requires kNamespaces
+  {
+    while (entries != 0 && !reap_queue_.empty()) {
+      const Entry* entry = namespaces_[reap_queue_.back()].dropped.oldest;
+      if (entry == nullptr) {
+        reap_queue_.pop_back();
+        continue;
+      }
+      unindex(entry);
+      key_index_.erase(entry);
+      --entries;
+    }
+    return dropped_entries_ != 0;
+  }
+
+  // Сколько удаленных dropNamespace записей еще занимают память.
+  std::size_t droppedEntries() const
+    requires kNamespaces
+  {
+    return dropped_entries_;
+  }
+
+  // Добавляет вторичный индекс name по атрибуту, который extractor
+  // вычисляет из значения, и строит его по текущим записям. Индекс
+  // обновляют set, remove, протухание и вытеснение, как TtlIndex. extractor
+  // должен быть детерминированным и не бросать исключений: при удалении
+  // записи атрибут вычисляется заново из старого значения. Бросает
+  // std::invalid_argument, если индекс с таким именем уже есть.
+  // O(N logN) time complexity; каждый индекс добавляет к set и remove
+  // вызов extractor и O(logN).
+  void addIndex(std::string name, IndexExtractor extractor) {
+    if (findIndex(name) != nullptr) {
+      throw std::invalid_argument("index already exists");
+    }
+    SecondaryIndex& index = secondary_indexes_.emplace_back(
+        SecondaryIndex{std::move(name), std::move(extractor), {}});
+    for (auto it = key_index_.begin(); it != key_index_.end(); ++it) {
+      if (auto attribute = extractAttribute(index, it->second)) {
+        index.items.emplace(std::move(*attribute), it.node());
+      }
+    }
+  }
+
+  // Удаляет вторичный индекс name. Возвращает false, если его не было.
+  bool removeIndex(std::string_view name) {
+    auto it = std::find_if(
+        secondary_indexes_.begin(), secondary_indexes_.end(),
+        [&](const SecondaryIndex& index) { return index.name == name; });
+    if (it == secondary_indexes_.end()) {
+      return false;
+    }
+    secondary_indexes_.erase(it);
+    return true;
+  }
+
+  // Возвращает до count записей, атрибут которых в индексе name лежит в
+  // [from, to], по возрастанию атрибута, а при равных атрибутах — ключа.
+  // Протухшие и удаленные dropNamespace записи пропускаются. Бросает
+  // std::invalid_argument, если индекса нет.
+  // O(logN + k) time complexity, k — число просмотренных записей.
+  std::vector<OutputEntry> queryIndex(
+      std::string_view name, std::string_view from, std::string_view to,
+      uint32_t count = std::numeric_limits<uint32_t>::max()) const {
+    const SecondaryIndex* index = findIndex(name);
+    if (index == nullptr) {
+      throw std::invalid_argument("no such index");
+    }
+
+    TimePoint now = currentTime();
+    std::vector<OutputEntry> result;
+    for (auto it = index->items.lower_bound(from);
+         it != index->items.end() && it->first <= to && result.size() < count;
+         ++it) {
+      const Entry* entry = it->second;
+      if (isLive(entry->mapped(), now)) {
+        result.emplace_back(KeyStorage::materialize(entry->key()),
+                            load(entry->mapped()));
+      }
+    }
+    return result;
+  }
+
+  // Память фильтра Блума в байтах.
+  std::size_t missFilterBytes() const { return miss_filter_.sizeBytes(); }
+
+  // Готовит хеш-индекс к хранению count записей без роста. Если записи уже
+  // есть, перенос выполняется инкрементально.
+  void reserve(std::size_t count) { key_index_.reserve(count); }
+
+  // Запускает инкрементальное сжатие хеш-индекса под текущее число записей,
+  // например после массового удаления. Корзины переносятся модифицирующими
+  // операциями и вызовами rehashStep.
+  void shrinkToFit() { key_index_.shrink_to_fit(); }
+
+  // Фоновый шаг рехеширования: переносит не более buckets корзин.
+  // Возвращает true, если перенос еще не завершен.
+  bool rehashStep(std::size_t buckets) {
+    return key_index_.rehashStep(buckets);
+  }
+
+  // Максимальное среднее число записей на корзину хеш-индекса. Меньшие
+  // значения ускоряют поиск ценой памяти под корзины.
+  float maxLoadFactor() const { return key_index_.max_load_factor(); }
+  void setMaxLoadFactor(float load_factor) {
+    key_index_.max_load_factor(load_factor);
+  }
+
+  // Суммарное число корзин хеш-индекса (в обеих таблицах во время
+  // рехеширования).
+  std::size_t bucketCount() const { return key_index_.bucket_count(); }
+
  private:
   Clock clock_;
-  TtlIndex ttl_index_;
-  SortedKeyIndex sorted_index_;
+  // Объявлен до индексов, чтобы пережить хранящиеся в них ключи.
+  [[no_unique_address]] typename KeyStorage::Pool key_pool_;
+  [[no_unique_address]] OptionalMember<kStringValues, ValueCompressor>
+      compressor_;
+  [[no_unique_address]] OptionalMember<kStringValues, BlobFactory> blobs_;
+  [[no_unique_address]] OptionalMember<kTtl, TtlIndex> ttl_index_;
+  [[no_unique_address]] OptionalMember<kSorted, SortedKeyIndex> sorted_index_;
   KeyIndex key_index_;
+  // Пуст, если фильтр выключен.
+  BlockedBloomFilter miss_filter_;
+  std::optional<BloomFilterOptions> miss_filter_options_;
+  // Сколько ключей фильтр вмещает до перестройки и сколько ключей в нем
+  // удалено из KeyIndex с последней перестройки.
+  std::size_t miss_filter_capacity_ = 0;
+  std::size_t miss_filter_stale_ = 0;
+  // Изменяется и в константных методах чтения.
+  std::unique_ptr<AccessStats<Key>> access_stats_;
+  // Начало отсчета времени обращений и состояние xorshift64 для счетчиков
+  // частоты.
+  [[no_unique_address]] OptionalMember<kAccess, TimePoint> access_epoch_;
+  [[no_unique_address]] mutable OptionalMember<kAccess, uint64_t>
+      access_random_;
+  [[no_unique_address]] OptionalMember<kTtl, TombstoneTtlIndex>
+      tombstone_ttl_index_;
+  [[no_unique_address]] OptionalMember<kTtl, TombstoneIndex> tombstones_;
+  // Индекс — NamespaceId; kDefaultNamespace создается конструктором.
+  [[no_unique_address]] OptionalMember<kNamespaces, std::vector<Namespace>>
+      namespaces_;
+  // Вторичные индексы по атрибутам значений (addIndex).
+  std::vector<SecondaryIndex> secondary_indexes_;
+  // Пространства с непустым списком удаленных записей и их общее число.
+  [[no_unique_address]] OptionalMember<kNamespaces, std::vector<NamespaceId>>
+      reap_queue_;
+  [[no_unique_address]] OptionalMember<kNamespaces, std::size_t>
+      dropped_entries_;
+  // Оценка длины цепочки KeyIndex для sample. Хранится между вызовами:
+  // выборка равномерна, только пока цепочки не длиннее оценки.
+  mutable std::size_t sample_chain_bound_ = kSampleChainBound;
+
+  // Без TtlIndex и метаданных обращений время не нужно, и чтение не тратит
+  // вызов часов.
+  static TimePoint currentTime() {
+    if constexpr (kTtl || kAccess) {
+      return Clock::now();
+    } else {
+      return TimePoint();
+    }
+  }
+
+  // Секунды от создания хранилища до now.
+  uint32_t accessStamp(TimePoint now) const
+    requires kAccess
+  {
+    auto seconds =
+        std::chrono::duration_cast<Seconds>(now - access_epoch_).count();
+    return static_cast<uint32_t>(std::max<decltype(seconds)>(seconds, 0));
+  }
+
+  // Счетчик частоты с учетом затухания к моменту stamp.
+  static uint8_t decayedFrequency(const ValueMetadata& metadata,
+                                  uint32_t stamp)
+    requires kAccess
+  {
+    uint32_t periods = (stamp - metadata.last_access) / kFrequencyDecaySeconds;
+    return periods >= metadata.frequency
+               ? 0
+               : static_cast<uint8_t>(metadata.frequency - periods);
+  }
+
+  static AccessInfo accessInfo(const ValueMetadata& metadata, uint32_t stamp)
+    requires kAccess
+  {
+    return {stamp - metadata.last_access, decayedFrequency(metadata, stamp)};
+  }
+
+  // Учитывает обращение к записи в ее метаданных (Access::Yes).
+  void touch(const ValueMetadata& metadata, TimePoint now) const {
+    if constexpr (kAccess) {
+      uint32_t stamp = accessStamp(now);
+      uint8_t frequency = decayedFrequency(metadata, stamp);
+      if (frequency < kMaxFrequency) {
+        access_random_ ^= access_random_ << 13;
+        access_random_ ^= access_random_ >> 7;
+        access_random_ ^= access_random_ << 17;
+        if ((access_random_ & ((uint64_t{1} << frequency) - 1)) == 0) {
+          ++frequency;
+        }
+      }
+      metadata.frequency = frequency;
+      metadata.last_access = stamp;
+    }
+  }
+
+  // Ищет запись в KeyIndex и учитывает обращение в статистике. Включенный
+  // фильтр Блума отсекает большинство промахов до поиска в таблице; хеш
+  // ключа считается один раз.
+  typename KeyIndex::iterator findEntry(KeyView key) const {
+    if (miss_filter_.empty() && access_stats_ == nullptr) {
+      return key_index_.find(key);
+    }
+    std::size_t hash = key_index_.hash_function()(key);
+    if (access_stats_ != nullptr) {
+      access_stats_->record(hash, [&] { return Key(key); });
+    }
+    if (!miss_filter_.empty() && !miss_filter_.mayContain(hash)) {
+      return key_index_.end();
+    }
+    return key_index_.find(key, hash);
+  }
+
+  // Строит фильтр по хешам, сохраненным в узлах KeyIndex, с запасом в
+  // половину числа ключей: перестройка за O(N) случается не чаще, чем раз в
+  // Θ(N) изменений.
+  void rebuildMissFilter() {
+    std::size_t size = key_index_.size();
+    miss_filter_capacity_ =
+        std::max(kMinMissFilterCapacity, size + size / 2);
+    miss_filter_ =
+        BlockedBloomFilter(miss_filter_capacity_, *miss_filter_options_);
+    for (auto it = key_index_.begin(); it != key_index_.end(); ++it) {
+      miss_filter_.insert(it.node()->hash);
+    }
+    miss_filter_stale_ = 0;
+  }
+
+  // Удаляет запись из вторичных индексов и учитывает ее в фильтре Блума.
+  void unindex(const Entry* entry) {
+    const ValueMetadata& metadata = entry->mapped();
+    eraseAttributes(entry);
+    if constexpr (kBPlusTree) {
+      sorted_index_.erase(metadata.sorted_it, entry);
+    } else if constexpr (kSorted) {
+      sorted_index_.erase(metadata.sorted_it);
+    }
+    if constexpr (kTtl) {
+      if (metadata.has_expiry) {
+        ttl_index_.erase(metadata.ttl_it);
+      }
+    }
+    detachNamespace(entry);
+    if (!miss_filter_.empty() &&
+        ++miss_filter_stale_ > miss_filter_capacity_ / 2) {
+      rebuildMissFilter();
+    }
+  }
+
+  const SecondaryIndex* findIndex(std::string_view name) const {
+    for (const SecondaryIndex& index : secondary_indexes_) {
+      if (index.name == name) {
+        return &index;
+      }
+    }
+    return nullptr;
+  }
+
+  // Атрибут значения записи для индекса index. Несжатое значение не
+  // копируется.
+  std::optional<std::string> extractAttribute(
+      const SecondaryIndex& index, const ValueMetadata& metadata) const {
+    if constexpr (kStringValues) {
+      if (metadata.isBlob()) {
+        return index.extract(*metadata.blob);
+      }
+      if (metadata.codec != ValueCodec::kRaw) {
+        return index.extract(load(metadata));
+      }
+    }
+    return index.extract(metadata.value);
+  }
+
+  // Добавляет запись в индексы атрибутов.
+  void insertAttributes(const Entry* entry) {
+    for (SecondaryIndex& index : secondary_indexes_) {
+      if (auto attribute = extractAttribute(index, entry->mapped())) {
+        index.items.emplace(std::move(*attribute), entry);
+      }
+    }
+  }
+
+  // Удаляет запись из индексов атрибутов, пока в ней старое значение.
+  void eraseAttributes(const Entry* entry) {
+    for (SecondaryIndex& index : secondary_indexes_) {
+      if (auto attribute = extractAttribute(index, entry->mapped())) {
+        index.items.erase(IndexItem(std::move(*attribute), entry));
+      }
+    }
+  }
+
+  // Атрибуты записи во всех индексах по порядку.
+  std::vector<std::optional<std::string>> attributesOf(
+      const Entry* entry) const {
+    std::vector<std::optional<std::string>> attributes;
+    attributes.reserve(secondary_indexes_.size());
+    for (const SecondaryIndex& index : secondary_indexes_) {
+      attributes.push_back(extractAttribute(index, entry->mapped()));
+    }
+    return attributes;
+  }
+
+  // Обновляет индексы атрибутов после перезаписи значения. Запись, атрибут
+  // которой не изменился, остается на месте.
+  void updateAttributes(const Entry* entry,
+                        std::vector<std::optional<std::string>> old) {
+    for (std::size_t i = 0; i < secondary_indexes_.size(); ++i) {
+      SecondaryIndex& index = secondary_indexes_[i];
+      std::optional<std::string> attribute =
+          extractAttribute(index, entry->mapped());
+      if (attribute == old[i]) {
+        continue;
+      }
+      if (old[i].has_value()) {
+        index.items.erase(IndexItem(std::move(*old[i]), entry));
+      }
+      if (attribute.has_value()) {
+        index.items.emplace(std::move(*attribute), entry);
+      }
+    }
+  }
+
+  // Первая запись SortedKeyIndex с ключом не меньше key.
+  auto sortedLowerBound(KeyView key) const
+    requires kSorted
+  {
+    if constexpr (kBPlusTree) {
+      return sorted_index_.lower_bound(key, orderedPrefix(key));
+    } else {
+      return sorted_index_.lower_bound(key);
+    }
+  }
+
+  // Байты записи для квот и bytesInRange: длина ключа и размер хранимого
+  // значения. Ключи и значения не строк считаются по sizeof.
+  std::size_t entryBytes(const Entry* entry) const {
+    const ValueMetadata& metadata = entry->mapped();
+    std::size_t key_bytes = sizeof(Key);
+    if constexpr (requires { entry->key().size(); }) {
+      key_bytes = entry->key().size();
+    }
+    if constexpr (kStringValues) {
+      return key_bytes + (metadata.isBlob() ? metadata.blob->size()
+                                            : metadata.value.size());
+    } else {
+      return key_bytes + sizeof(Value);
+    }
+  }
+
+  // Бросает std::length_error, если запись с ключом key и значением value
+  // одна превышает квоты пространства ns.
+  void checkQuota(NamespaceId ns, KeyView key,
+                  const PreparedValue& value) const {
+    const NamespaceQuota& quota = namespaces_[ns].quota;
+    std::size_t bytes = key.size();
+    if constexpr (kStringValues) {
+      bytes += value.codec == ValueCodec::kBlob ? value.blob->size()
+                                                : value.bytes.size();
+    } else {
+      bytes += sizeof(Value);
+    }
+    if (quota.max_entries == 0 || bytes > quota.max_bytes) {
+      throw std::length_error("entry exceeds the namespace quota");
+    }
+  }
+
+  // Достраивает TtlIndex после загрузки bulk: по возрастанию времен каждая
+  // вставка идет в конец дерева.
+  void finishBulkLoad(BulkLoad& bulk) {
+    if constexpr (kTtl) {
+      std::sort(bulk.expiries.begin(), bulk.expiries.end(),
+                [](const auto& lhs, const auto& rhs) {
+                  return lhs.first < rhs.first;
+                });
+      for (const auto& [expiry, entry] : bulk.expiries) {
+        const_cast<Entry*>(entry)->mapped().ttl_it =
+            ttl_index_.emplace_hint(ttl_index_.end(), expiry, entry);
+      }
+      bulk.expiries.clear();
+    }
+  }
+
+  // Значение в виде, в котором его пишет exportStream: несжатые строки и
+  // blob'ы без копирования, сжатые — распакованными в scratch.
+  std::string_view storedValueBytes(const ValueMetadata& metadata,
+                                    std::string& scratch) const {
+    if constexpr (kStringValues) {
+      if (metadata.isBlob()) {
+        return *metadata.blob;
+      }
+      if (metadata.codec != ValueCodec::kRaw) {
+        scratch = load(metadata);
+        return scratch;
+      }
+    }
+    return streamFieldBytes(metadata.value);
+  }
+
+  // Оставшийся TTL живой записи в секундах с округлением вверх, 0 — без TTL.
+  uint32_t remainingTtl(const ValueMetadata& metadata, TimePoint now) const {
+    if constexpr (kTtl) {
+      if (metadata.has_expiry) {
+        auto left = std::chrono::ceil<Seconds>(metadata.expiry - now);
+        return static_cast<uint32_t>(std::max<int64_t>(left.count(), 1));
+      }
+    }
+    return 0;
+  }
+
+  // Запись видна чтению: не протухла и не удалена dropNamespace.
+  bool isLive(const ValueMetadata& metadata, TimePoint now) const {
+    return !metadata.isExpired(now) && !isDropped(metadata);
+  }
+
+  bool isDropped(const ValueMetadata& metadata) const {
+    if constexpr (kNamespaces) {
+      return metadata.namespace_generation !=
+             namespaces_[metadata.namespace_id].generation;
+    } else {
+      return false;
+    }
+  }
+
+  static void pushNewest(EntryList& list, const Entry* entry) {
+    entry->mapped().namespace_links = {list.newest, nullptr};
+    if (list.newest != nullptr) {
+      list.newest->mapped().namespace_links.newer = entry;
+    } else {
+      list.oldest = entry;
+    }
+    list.newest = entry;
+  }
+
+  static void unlink(EntryList& list, const Entry* entry) {
+    const NamespaceLinks& links = entry->mapped().namespace_links;
+    if (links.older != nullptr) {
+      links.older->mapped().namespace_links.newer = links.newer;
+    } else {
+      list.oldest = links.newer;
+    }
+    if (links.newer != nullptr) {
+      links.newer->mapped().namespace_links.older = links.older;
+    } else {
+      list.newest = links.older;
+    }
+  }
+
+  // Переносит записи from в конец to.
+  static void splice(EntryList& to, EntryList& from) {
+    if (from.oldest == nullptr) {
+      return;
+    }
+    if (to.newest != nullptr) {
+      to.newest->mapped().namespace_links.newer = from.oldest;
+      from.oldest->mapped().namespace_links.older = to.newest;
+    } else {
+      to.oldest = from.oldest;
+    }
+    to.newest = from.newest;
+    from = EntryList();
+  }
+
+  // Добавляет запись в конец списка ее пространства имен и учитывает ее.
+  void attachNamespace(const Entry* entry) {
+    if constexpr (kNamespaces) {
+      Namespace& space = namespaces_[entry->mapped().namespace_id];
+      pushNewest(space.live, entry);
+      ++space.usage.entries;
+      space.usage.bytes += entryBytes(entry);
+    }
+  }
+
+  // Исключает запись из списка и учета ее пространства имен или из списка
+  // удаленных записей.
+  void detachNamespace(const Entry* entry) {
+    if constexpr (kNamespaces) {
+      Namespace& space = namespaces_[entry->mapped().namespace_id];
+      if (isDropped(entry->mapped())) {
+        unlink(space.dropped, entry);
+        --dropped_entries_;
+        return;
+      }
+      unlink(space.live, entry);
+      --space.usage.entries;
+      space.usage.bytes -= entryBytes(entry);
+    }
+  }
+
+  // Вытесняет самые давно записанные записи пространства ns, пока оно
+  // превышает квоты.
+  void enforceQuota(NamespaceId ns)
+    requires kNamespaces
+  {
+    Namespace& space = namespaces_[ns];
+    while (space.usage.entries > space.quota.max_entries ||
+           space.usage.bytes > space.quota.max_bytes) {
+      const Entry* victim = space.live.oldest;
+      unindex(victim);
+      key_index_.erase(victim);
+      ++space.usage.evictions;
+    }
+  }
+
+  // Удаляет tombstone ключа key. Возвращает false, если его не было.
+  bool eraseTombstone(KeyView key)
+    requires kTtl
+  {
+    if (tombstones_.empty()) {
+      return false;
+    }
+    auto tombstone_it = tombstones_.find(key);
+    if (tombstone_it == tombstones_.end()) {
+      return false;
+    }
+    tombstone_ttl_index_.erase(tombstone_it->second.ttl_it);
+    tombstones_.erase(tombstone_it);
+    return true;
+  }
+
+  PreparedValue prepare(Value value) const {
+    if constexpr (kStringValues) {
+      if (blobs_.isLarge(value.size())) {
+        return {Value(), blobs_.make(std::move(value)), ValueCodec::kBlob};
+      }
+      ValueCodec codec = compressor_.encode(value);
+      return {std::move(value), nullptr, codec};
+    } else {
+      return {std::move(value), BlobSlot(), ValueCodec::kRaw};
+    }
+  }
+
+  PreparedValue prepare(ValueHandle value) const
+    requires kStringValues
+  {
+    if (value == nullptr) {
+      throw std::invalid_argument("null ValueHandle");
+    }
+    if (blobs_.isLarge(value->size())) {
+      return {Value(), std::move(value), ValueCodec::kBlob};
+    }
+    return prepare(Value(*value));
+  }
+
+  // Значение записи в исходном виде.
+  Value load(const ValueMetadata& metadata) const {
+    if constexpr (kStringValues) {
+      if (metadata.isBlob()) {
+        return *metadata.blob;
+      }
+      return compressor_.decode(metadata.value, metadata.codec);
+    } else {
+      return metadata.value;
+    }
+  }
+
+  // Как load, но забирает значение из удаляемой записи без лишних копий.
+  Value release(ValueMetadata& metadata) const {
+    if constexpr (kStringValues) {
+      if (metadata.isBlob()) {
+        return *metadata.blob;
+      }
+      return compressor_.release(metadata.value, metadata.codec);
+    } else {
+      return std::move(metadata.value);
+    }
+  }
 
   // Добавляет запись в хранилище.
   // O(logN) time complexity.
-  void set_impl(Key key, Value value, Seconds ttl, TimePoint now) {
+  void set_impl(Key key, PreparedValue value, Seconds ttl, TimePoint now,
+                NamespaceId ns = kDefaultNamespace) {
+    if constexpr (!kTtl) {
+      if (ttl != kNoExpiry) {
+        throw std::invalid_argument("ttl requires Ttl::Yes");
+      }
+    }
     std::optional<TimePoint> new_expiry =
         (ttl == kNoExpiry)
             ? std::nullopt
             : std::make_optional<TimePoint>(now + static_cast<Duration>(ttl));
+    store(std::move(key), std::move(value), new_expiry, now, ns);
+  }
 
-    auto [entry_it, inserted] =
-        key_index_.try_emplace(std::move(key), std::move(value), new_expiry,
-                               sorted_index_.end(), ttl_index_.end());
+  // Общая часть set_impl и importStream. С bulk ключ больше всех ключей
+  // хранилища (см. BulkLoad).
+  void store(Key key, PreparedValue value, std::optional<TimePoint> new_expiry,
+             TimePoint now, [[maybe_unused]] NamespaceId ns,
+             [[maybe_unused]] BulkLoad* bulk = nullptr) {
+    if constexpr (kNamespaces) {
+      checkQuota(ns, KeyView(key), value);
+    }
 
-    if (inserted) {
-      entry_it->second.sorted_it = sorted_index_.emplace(entry_it->first).first;
-      if (new_expiry.has_value()) {
-        entry_it->second.ttl_it =
-            ttl_index_.emplace(new_expiry.value(), entry_it->first);
-      }
-      return;
+    if constexpr (kTtl) {
+      // Ключ с записью в KeyIndex не может одновременно иметь tombstone.
+      eraseTombstone(KeyView(key));
     }
 
-    entry_it->second.value = std::move(value);
+    // Префикс для B+-дерева берется до того, как ключ переедет в запись.
+    [[maybe_unused]] uint64_t sort_prefix =
+        kBPlusTree ? orderedPrefix(KeyView(key)) : 0;
+
+    auto [entry_it, inserted] = key_index_.lazy_emplace(
+        KeyView(key),
+        [&] { return KeyStorage::make(key_pool_, std::move(key)); },
+        std::move(value), new_expiry);
 
-    auto old_expiry = entry_it->second.expiry;
-    entry_it->second.expiry = new_expiry;
+    const Entry* entry = entry_it.node();
+    ValueMetadata& metadata = entry_it->second;
+    touch(metadata, now);
 
-    if (old_expiry.has_value()) {
-      ttl_index_.erase(entry_it->second.ttl_it);
+    if (access_stats_ != nullptr) {
+      access_stats_->record(entry->hash, [&] {
+        return Key(KeyStorage::materialize(entry->key()));
+      });
     }
 
-    if (new_expiry.has_value()) {
-      entry_it->second.ttl_it =
-          ttl_index_.emplace(new_expiry.value(), entry_it->first);
+    if (inserted) {
+      insertAttributes(entry);
+      if (!miss_filter_.empty()) {
+        miss_filter_.insert(entry->hash);
+        if (key_index_.size() > miss_filter_capacity_) {
+          rebuildMissFilter();
+        }
+      }
+      if constexpr (kBPlusTree) {
+        metadata.sorted_it =
+            bulk != nullptr ? sorted_index_.insertBack(entry, sort_prefix)
+                            : sorted_index_.insert(entry, sort_prefix);
+      } else if constexpr (kSorted) {
+        metadata.sorted_it =
+            bulk != nullptr
+                ? sorted_index_.emplace_hint(sorted_index_.end(), entry)
+                : sorted_index_.emplace(entry).first;
+      }
+      if constexpr (kTtl) {
+        if (new_expiry.has_value() && bulk != nullptr) {
+          bulk->expiries.emplace_back(new_expiry.value(), entry);
+        } else if (new_expiry.has_value()) {
+          metadata.ttl_it = ttl_index_.emplace(new_expiry.value(), entry);
+        }
+      }
     } else {
-      entry_it->second.ttl_it = ttl_index_.end();
+      detachNamespace(entry);
+      std::vector<std::optional<std::string>> old_attributes =
+          attributesOf(entry);
+      metadata.assign(std::move(value));
+      updateAttributes(entry, std::move(old_attributes));
+
+      if constexpr (kTtl) {
+        if (metadata.has_expiry) {
+          ttl_index_.erase(metadata.ttl_it);
+        }
+        metadata.setExpiry(new_expiry);
+        if (new_expiry.has_value()) {
+          metadata.ttl_it = ttl_index_.emplace(new_expiry.value(), entry);
+        }
+      }
+    }
+
+    if constexpr (kNamespaces) {
+      metadata.namespace_id = ns;
+      metadata.namespace_generation = namespaces_[ns].generation;
+      attachNamespace(entry);
+      enforceQuota(ns);
     }
   }
 };
+
+// Краткая форма для строковых ключей и значений с выбранным набором
+// возможностей: KVStorage<Clock, Features<Sorted::No, Ttl::No>>.
+template <KVClock Clock, Sorted S, Ttl T, Access A, Namespaces N>
+class KVStorage<Clock, Features<S, T, A, N>, std::string,
+                KVTraits<Features<S, T, A, N>, std::string>>
+    : public KVStorage<Clock, std::string, std::string,
+                       KVTraits<std::string, std::string, SeededHash,
+                                PlainKeys<>, Features<S, T, A, N>>> {
+ public:
+  using KVStorage<Clock, std::string, std::string,
+                  KVTraits<std::string, std::string, SeededHash, PlainKeys<>,
+                           Features<S, T, A, N>>>::KVStorage;
+};
@@ -0,0 +1,400 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define KV_STORAGE_HAS_CRC32C_INSTRUCTION 1
+#endif
+
+// Поток записей для переноса KVStorage между хостами и начальной загрузки
+// реплик (KVStorage::exportStream и importStream).
+//
+// Формат (все числа little-endian):
+//   заголовок: "KVSTREAM", u32 версия, u64 оценка числа записей сверху,
+//              u32 CRC32C предыдущих 20 байт;
+//   кадры:     u32 размер данных, u32 число записей, u32 CRC32C данных,
+//              u32 CRC32C предыдущих 12 байт заголовка кадра, данные.
+// Данные кадра — записи подряд: varint длина ключа, ключ, varint длина
+// значения, значение, u64 время протухания в миллисекундах Unix time
+// (0 — без TTL). Последний кадр не содержит записей: его данные — u64 общее
+// число записей, так обрыв потока не проходит незамеченным. CRC32C ловит
+// только случайные повреждения, поэтому размеры из потока не определяют
+// выделения памяти напрямую: буфер кадра растет по мере прихода данных, а
+// оценку числа записей importStream использует порциями.
+
+// Приемник байт потока.
+class StreamWriter {
+ public:
+  virtual ~StreamWriter() = default;
+
+  virtual void write(std::string_view bytes) = 0;
+};
+
+// Источник байт потока.
+class StreamReader {
+ public:
+  virtual ~StreamReader() = default;
+
+  // Читает до buffer.size() байт и возвращает их число; 0 — конец потока.
+  virtual std::size_t read(std::span<char> buffer) = 0;
+};
+
+// Дописывает поток в строку.
+class StringStreamWriter : public StreamWriter {
+ public:
+  explicit StringStreamWriter(std::string& out) : out_(out) {}
+
+  void write(std::string_view bytes) override { out_.append(bytes); }
+
+ private:
+  std::string& out_;
+};
+
+// Читает поток из строки; строка должна пережить читателя.
+class StringStreamReader : public StreamReader {
+ public:
+  explicit StringStreamReader(std::string_view in) : in_(in) {}
+
+  std::size_t read(std::span<char> buffer) override {
+    std::size_t size = std::min(buffer.size(), in_.size() - pos_);
+    std::memcpy(buffer.data(), in_.data() + pos_, size);
+    pos_ += size;
+    return size;
+  }
+
+ private:
+  std::string_view in_;
+  std::size_t pos_ = 0;
+};
+
+namespace stream_detail {
+
+inline constexpr char kMagic[8] = {'K', 'V', 'S', 'T', 'R', 'E', 'A', 'M'};
+inline constexpr uint32_t kVersion = 1;
+inline constexpr std::size_t kHeaderBytes = 24;
+inline constexpr std::size_t kFrameHeaderBytes = 16;
+
+// Таблицы CRC32C (полином Кастаньоли) для обработки по 8 байт за шаг.
+inline constexpr auto kCrcTables = [] {
+  std::array<std::array<uint32_t, 256>, 8> tables{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ ((crc & 1) != 0 ? 0x82f63b78U : 0);
+    }
+    tables[0][i] = crc;
+  }
+  for (std::size_t t = 1; t < 8; ++t) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t previous = tables[t - 1][i];
+      tables[t][i] = (previous >> 8) ^ tables[0][previous & 0xff];
+    }
+  }
+  return tables;
+}();
+
+inline uint32_t crc32c(std::string_view data, uint32_t crc = 0) {
+  const auto* p = reinterpret_cast<const unsigned char*>(data.data());
+  std::size_t len = data.size();
+  crc = ~crc;
+#ifdef KV_STORAGE_HAS_CRC32C_INSTRUCTION
+  uint64_t wide = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    wide = _mm_crc32_u64(wide, word);
+  }
+  crc = static_cast<uint32_t>(wide);
+  for (; len > 0; ++p, --len) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+#else
+  const auto& t = kCrcTables;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint32_t low = crc ^ (uint32_t{p[0]} | uint32_t{p[1]} << 8 |
+                          uint32_t{p[2]} << 16 | uint32_t{p[3]} << 24);
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+          t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^ t[3][p[4]] ^
+          t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+  }
+  for (; len > 0; ++p, --len) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+  }
+#endif
+  return ~crc;
+}
+
+[[noreturn]] inline void corrupted(const char* what) {
+  throw std::runtime_error(std::string("corrupted stream: ") + what);
+}
+
+inline void appendFixed(std::string& out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+inline uint64_t readFixed(std::string_view in, std::size_t pos, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value |= uint64_t{static_cast<unsigned char>(in[pos + i])} << (8 * i);
+  }
+  return value;
+}
+
+inline void appendVarint(std::string& out, std::size_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+inline std::size_t readVarint(std::string_view in, std::size_t& pos) {
+  std::size_t value = 0;
+  for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+    auto byte = static_cast<unsigned char>(in[pos++]);
+    value |= static_cast<std::size_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  corrupted("bad record length");
+}
+
+}  // namespace stream_detail
+
+// Типы ключей и значений, которые умеет переносить поток: строки как есть,
+// тривиально копируемые типы — их байтами.
+template <typename T>
+concept StreamField =
+    std::same_as<T, std::string> || std::is_trivially_copyable_v<T>;
+
+template <StreamField T>
+std::string_view streamFieldBytes(const T& field) {
+  if constexpr (std::same_as<T, std::string>) {
+    return field;
+  } else {
+    return {reinterpret_cast<const char*>(&field), sizeof(T)};
+  }
+}
+
+template <StreamField T>
+T streamFieldFrom(std::string_view bytes) {
+  if constexpr (std::same_as<T, std::string>) {
+    return T(bytes);
+  } else {
+    if (bytes.size() != sizeof(T)) {
+      stream_detail::corrupted("field size mismatch");
+    }
+    T field;
+    std::memcpy(&field, bytes.data(), sizeof(T));
+    return field;
+  }
+}
+
+// Запись потока. Ссылается на буфер читателя и валидна до следующего next.
+struct StreamRecordView {
+  std::string_view key;
+  std::string_view value;
+  // Миллисекунды Unix time, 0 — без TTL.
+  uint64_t expiry_unix_ms;
+};
+
+// Пишет записи кадрами примерно по kBlockBytes; запись больше блока
+// занимает кадр целиком. Память — один блок.
+class RecordStreamWriter {
+ public:
+  static constexpr std::size_t kBlockBytes = 64 * 1'024;
+
+  // size_hint — оценка числа записей сверху, по ней читатель заранее
+  // выделяет место.
+  RecordStreamWriter(StreamWriter& out, uint64_t size_hint) : out_(out) {
+    std::string header(stream_detail::kMagic, sizeof(stream_detail::kMagic));
+    stream_detail::appendFixed(header, stream_detail::kVersion, 4);
+    stream_detail::appendFixed(header, size_hint, 8);
+    stream_detail::appendFixed(header, stream_detail::crc32c(header), 4);
+    out_.write(header);
+    block_.reserve(kBlockBytes + stream_detail::kFrameHeaderBytes);
+  }
+
+  void add(std::string_view key, std::string_view value,
+           uint64_t expiry_unix_ms) {
+    stream_detail::appendVarint(block_, key.size());
+    block_.append(key);
+    stream_detail::appendVarint(block_, value.size());
+    block_.append(value);
+    stream_detail::appendFixed(block_, expiry_unix_ms, 8);
+    ++block_records_;
+    ++records_;
+    if (block_.size() >= kBlockBytes) {
+      flush();
+    }
+  }
+
+  // Дописывает оставшиеся записи и финальный кадр. После finish писать
+  // нельзя.
+  void finish() {
+    flush();
+    stream_detail::appendFixed(block_, records_, 8);
+    writeFrame(0);
+  }
+
+  uint64_t records() const { return records_; }
+
+ private:
+  void flush() {
+    if (block_records_ != 0) {
+      writeFrame(block_records_);
+      block_records_ = 0;
+    }
+  }
+
+  void writeFrame(uint32_t records) {
+    if (block_.size() > UINT32_MAX) {
+      throw std::length_error("stream record is too large");
+    }
+    std::string header;
+    stream_detail::appendFixed(header, block_.size(), 4);
+    stream_detail::appendFixed(header, records, 4);
+    stream_detail::appendFixed(header, stream_detail::crc32c(block_), 4);
+    stream_detail::appendFixed(header, stream_detail::crc32c(header), 4);
+    out_.write(header);
+    out_.write(block_);
+    block_.clear();
+  }
+
+  StreamWriter& out_;
+  std::string block_;
+  uint32_t block_records_ = 0;
+  uint64_t records_ = 0;
+};
+
+// Читает записи RecordStreamWriter по одному кадру, проверяя контрольные
+// суммы. Не читает дальше финального кадра, поэтому поток можно передать в
+// составе большего (например, снимок для реплики и следом журнал
+// изменений). При повреждении или обрыве бросает std::runtime_error.
+class RecordStreamReader {
+ public:
+  explicit RecordStreamReader(StreamReader& in) : in_(in) {
+    std::string header;
+    readExact(header, stream_detail::kHeaderBytes);
+    if (std::memcmp(header.data(), stream_detail::kMagic,
+                    sizeof(stream_detail::kMagic)) != 0) {
+      stream_detail::corrupted("bad magic");
+    }
+    if (stream_detail::readFixed(header, 20, 4) !=
+        stream_detail::crc32c(std::string_view(header).substr(0, 20))) {
+      stream_detail::corrupted("header checksum mismatch");
+    }
+    if (stream_detail::readFixed(header, 8, 4) != stream_detail::kVersion) {
+      throw std::runtime_error("unsupported stream version");
+    }
+    size_hint_ = stream_detail::readFixed(header, 12, 8);
+  }
+
+  // Оценка числа записей из заголовка. Контрольная сумма защищает ее
+  // только от случайных повреждений, поэтому выделять память по ней можно
+  // лишь порциями по мере прихода записей.
+  uint64_t sizeHint() const { return size_hint_; }
+
+  // Читает следующую запись; false — поток закончился.
+  bool next(StreamRecordView& record) {
+    while (block_records_ == 0) {
+      if (finished_ || !readFrame()) {
+        return false;
+      }
+    }
+
+    std::string_view block = block_;
+    std::size_t key_size = stream_detail::readVarint(block, pos_);
+    if (key_size > block.size() - pos_) {
+      stream_detail::corrupted("record out of frame");
+    }
+    record.key = block.substr(pos_, key_size);
+    pos_ += key_size;
+    std::size_t value_size = stream_detail::readVarint(block, pos_);
+    if (value_size > block.size() - pos_ ||
+        block.size() - pos_ - value_size < 8) {
+      stream_detail::corrupted("record out of frame");
+    }
+    record.value = block.substr(pos_, value_size);
+    pos_ += value_size;
+    record.expiry_unix_ms = stream_detail::readFixed(block, pos_, 8);
+    pos_ += 8;
+
+    if (--block_records_ == 0 && pos_ != block.size()) {
+      stream_detail::corrupted("trailing bytes in frame");
+    }
+    ++records_;
+    return true;
+  }
+
+ private:
+  // Читает следующий кадр; false — прочитан финальный.
+  bool readFrame() {
+    std::string header;
+    readExact(header, stream_detail::kFrameHeaderBytes);
+    if (stream_detail::readFixed(header, 12, 4) !=
+        stream_detail::crc32c(std::string_view(header).substr(0, 12))) {
+      stream_detail::corrupted("frame header checksum mismatch");
+    }
+    readExact(block_, stream_detail::readFixed(header, 0, 4));
+    if (stream_detail::readFixed(header, 8, 4) !=
+        stream_detail::crc32c(block_)) {
+      stream_detail::corrupted("frame checksum mismatch");
+    }
+    block_records_ =
+        static_cast<uint32_t>(stream_detail::readFixed(header, 4, 4));
+    pos_ = 0;
+    if (block_records_ != 0) {
+      return true;
+    }
+
+    finished_ = true;
+    if (block_.size() != 8 ||
+        stream_detail::readFixed(block_, 0, 8) != records_) {
+      stream_detail::corrupted("record count mismatch");
+    }
+    return false;
+  }
+
+  // Буфер out переиспользуется между кадрами. Он растет по мере прихода
+  // байт, не более чем вдвое за шаг, а не сразу до заявленного size.
+  void readExact(std::string& out, std::size_t size) {
+    out.clear();
+    while (out.size() < size) {
+      std::size_t done = out.size();
+      std::size_t step = std::min(
+          size - done, std::max(done, RecordStreamWriter::kBlockBytes));
+      out.resize(done + step);
+      for (std::size_t filled = done; filled < out.size();) {
+        std::size_t read = in_.read(
+            std::span<char>(out.data() + filled, out.size() - filled));
+        if (read == 0) {
+          stream_detail::corrupted("unexpected end of stream");
+        }
+        filled += read;
+      }
+    }
+  }
+
+  StreamReader& in_;
+  uint64_t size_hint_ = 0;
+  std::string block_;
+  std::size_t pos_ = 0;
+  uint32_t block_records_ = 0;
+  uint64_t records_ = 0;
+  bool finished_ = false;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <concepts>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "hash_policy.hpp"
+#include "key_storage.hpp"
+
+// Тип, которым ключ передается в поиск (get, remove, getManySorted).
+// Строки передаются через std::string_view, небольшие тривиально копируемые
+// ключи (целые числа, UUID) — по значению, остальные — по ссылке.
+template <typename K>
+struct KeyViewOf {
+  using type = std::conditional_t<
+      std::is_trivially_copyable_v<K> && sizeof(K) <= 16, K, const K&>;
+};
+
+template <>
+struct KeyViewOf<std::string> {
+  using type = std::string_view;
+};
+
+// Политика хеширования по умолчанию для типа ключа.
+template <typename K>
+struct DefaultHashOf {
+  using type = SeededHash;
+};
+
+template <std::integral K>
+struct DefaultHashOf<K> {
+  using type = MultiplyShiftHash;
+};
+
+enum class Sorted : uint8_t { No, Yes, BPlusTree };
+enum class Ttl : bool { No, Yes };
+enum class Access : bool { No, Yes };
+enum class Namespaces : bool { No, Yes };
+
+// Набор возможностей KVStorage. Sorted::No убирает SortedKeyIndex и
+// getManySorted, Sorted::BPlusTree строит SortedKeyIndex на B+-дереве
+// (bplus_tree.hpp) вместо std::set. Ttl::No убирает TtlIndex, время
+// протухания в записях и removeOneExpiredEntry. Access::Yes добавляет в
+// записи время последнего обращения и счетчик частоты (accessInfo,
+// idleKeys). Namespaces::Yes добавляет пространства имен с квотами
+// (createNamespace) для строковых ключей. Ненужные поля и индексы не
+// занимают памяти, а set не выполняет работы с деревьями.
+template <Sorted S = Sorted::Yes, Ttl T = Ttl::Yes, Access A = Access::No,
+          Namespaces N = Namespaces::No>
+struct Features {
+  static constexpr bool kSorted = S != Sorted::No;
+  static constexpr bool kBPlusTree = S == Sorted::BPlusTree;
+  static constexpr bool kTtl = T == Ttl::Yes;
+  static constexpr bool kAccess = A == Access::Yes;
+  static constexpr bool kNamespaces = N == Namespaces::Yes;
+};
+
+// Параметры KVStorage, которые не выводятся из типов ключа K и значения V:
+// политика хеширования (hash_policy.hpp), политика хранения ключей
+// (key_storage.hpp) и набор возможностей. Для строковых ключей по умолчанию —
+// SeededHash и PlainKeys, для целочисленных — MultiplyShiftHash (IdentityHash
+// для плотных последовательных идентификаторов можно задать явно).
+template <typename K, typename V,
+          typename Hash = typename DefaultHashOf<K>::type,
+          typename KeyStorage = PlainKeys<K>, typename Enabled = Features<>>
+struct KVTraits {
+  using key_view = typename KeyViewOf<K>::type;
+  using hasher = Hash;
+  using key_storage = KeyStorage;
+  using features = Enabled;
+};
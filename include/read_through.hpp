@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Объединение одновременных загрузок одного ключа (single-flight): первый
+// вызов с ключом выполняет загрузку, остальные ждут ее результата, а не
+// повторяют запрос к медленному хранилищу.
+template <typename Result>
+class SingleFlight {
+ public:
+  // Выполняет load() или дожидается результата уже идущей загрузки key.
+  // Исключение загрузки получают все ее ожидающие.
+  template <typename Load>
+  Result run(std::string_view key, Load&& load) {
+    std::unique_lock lock(mutex_);
+    auto it = flights_.find(std::string(key));
+    if (it != flights_.end()) {
+      std::shared_future<Result> flight = it->second;
+      lock.unlock();
+      return flight.get();
+    }
+    return lead(std::move(lock), key, std::forward<Load>(load));
+  }
+
+  // Как run, но не ждет чужую загрузку: если key уже загружается, сразу
+  // возвращает std::nullopt.
+  template <typename Load>
+  std::optional<Result> tryRun(std::string_view key, Load&& load) {
+    std::unique_lock lock(mutex_);
+    if (flights_.contains(std::string(key))) {
+      return std::nullopt;
+    }
+    return lead(std::move(lock), key, std::forward<Load>(load));
+  }
+
+ private:
+  template <typename Load>
+  Result lead(std::unique_lock<std::mutex> lock, std::string_view key,
+              Load&& load) {
+    std::promise<Result> promise;
+    auto it = flights_.emplace(std::string(key), promise.get_future().share())
+                  .first;
+    lock.unlock();
+
+    try {
+      Result result = load();
+      promise.set_value(result);
+      finish(it);
+      return result;
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+      finish(it);
+      throw;
+    }
+  }
+
+  void finish(
+      typename std::unordered_map<std::string,
+                                  std::shared_future<Result>>::iterator it) {
+    std::lock_guard lock(mutex_);
+    flights_.erase(it);
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_future<Result>> flights_;
+};
+
+// Изменение для медленного хранилища: новое значение ключа или удаление
+// (value == std::nullopt).
+struct BackendWrite {
+  std::string key;
+  std::optional<std::string> value;
+};
+
+// Медленное хранилище, в которое хранилище-кеш отложенно пишет изменения
+// (write-behind).
+class KVBackend {
+ public:
+  virtual ~KVBackend() = default;
+
+  // Записывает пачку изменений. Каждый ключ встречается в пачке не более
+  // одного раза. Вызывается из фонового потока и не должен бросать
+  // исключений.
+  virtual void write(std::span<const BackendWrite> batch) = 0;
+};
+
+struct WriteBehindOptions {
+  // Максимальный размер пачки.
+  std::size_t max_batch = 256;
+  // Сколько изменение может ждать, пока пачка не наполнится.
+  std::chrono::milliseconds max_delay{100};
+};
+
+// Очередь отложенной записи. Изменения одного ключа, накопившиеся до
+// отправки, схлопываются в последнее; фоновый поток отправляет пачку, когда
+// она наполнилась или когда самое старое изменение ждет max_delay.
+class WriteBehindQueue {
+ public:
+  WriteBehindQueue(std::shared_ptr<KVBackend> backend,
+                   WriteBehindOptions options)
+      : backend_(std::move(backend)),
+        options_(options),
+        thread_([this] { run(); }) {}
+
+  WriteBehindQueue(const WriteBehindQueue&) = delete;
+  WriteBehindQueue& operator=(const WriteBehindQueue&) = delete;
+
+  // Отправляет все накопленные изменения.
+  ~WriteBehindQueue() {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    thread_.join();
+  }
+
+  void push(std::string key, std::optional<std::string> value) {
+    bool full;
+    {
+      std::lock_guard lock(mutex_);
+      if (pending_.empty()) {
+        oldest_ = std::chrono::steady_clock::now();
+      }
+      pending_.insert_or_assign(std::move(key), std::move(value));
+      ++pushed_;
+      full = pending_.size() >= options_.max_batch;
+    }
+    if (full) {
+      wakeup_.notify_one();
+    }
+  }
+
+  // Дожидается отправки всех изменений, добавленных до вызова.
+  void flush() {
+    std::unique_lock lock(mutex_);
+    uint64_t target = pushed_;
+    flush_requested_ = true;
+    wakeup_.notify_one();
+    written_.wait(lock, [&] { return sent_ >= target; });
+  }
+
+ private:
+  void run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      auto ready = [this] {
+        return stopping_ || flush_requested_ ||
+               pending_.size() >= options_.max_batch;
+      };
+      while (!ready()) {
+        if (pending_.empty()) {
+          wakeup_.wait(lock);
+        } else if (wakeup_.wait_until(lock, oldest_ + options_.max_delay) ==
+                   std::cv_status::timeout) {
+          break;
+        }
+      }
+
+      auto pending = std::move(pending_);
+      pending_.clear();
+      uint64_t target = pushed_;
+      bool stopping = stopping_;
+      flush_requested_ = false;
+
+      lock.unlock();
+      send(pending);
+      lock.lock();
+
+      sent_ = target;
+      written_.notify_all();
+      if (stopping && pending_.empty()) {
+        return;
+      }
+    }
+  }
+
+  void send(std::unordered_map<std::string, std::optional<std::string>>&
+                pending) {
+    std::vector<BackendWrite> batch;
+    batch.reserve(std::min(pending.size(), options_.max_batch));
+    for (auto& [key, value] : pending) {
+      batch.push_back({key, std::move(value)});
+      if (batch.size() == options_.max_batch) {
+        backend_->write(batch);
+        batch.clear();
+      }
+    }
+    if (!batch.empty()) {
+      backend_->write(batch);
+    }
+  }
+
+  std::shared_ptr<KVBackend> backend_;
+  WriteBehindOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable written_;
+  std::unordered_map<std::string, std::optional<std::string>> pending_;
+  std::chrono::steady_clock::time_point oldest_;
+  // Сколько изменений добавлено и сколько из них отправлено.
+  uint64_t pushed_ = 0;
+  uint64_t sent_ = 0;
+  bool flush_requested_ = false;
+  bool stopping_ = false;
+
+  std::thread thread_;
+};
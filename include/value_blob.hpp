@@ -0,0 +1,112 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Разделяемая ссылка на неизменяемое значение. Большие значения хранятся в
+// KVStorage в виде таких blob'ов: get может отдать ссылку вместо копии, а
+// память освобождается, когда пропадает последняя ссылка — у хранилища
+// (перезапись, удаление) или у читателя.
+using ValueHandle = std::shared_ptr<const std::string>;
+
+// Фоновый поток, освобождающий blob'ы. Нужен, чтобы перезапись или удаление
+// значения в сотни KB не освобождала большой блок в потоке вызывающего.
+class BlobReclaimer {
+ public:
+  BlobReclaimer() : thread_([this] { run(); }) {}
+
+  BlobReclaimer(const BlobReclaimer&) = delete;
+  BlobReclaimer& operator=(const BlobReclaimer&) = delete;
+
+  // Освобождает все оставшиеся в очереди blob'ы.
+  ~BlobReclaimer() {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    thread_.join();
+  }
+
+  void retire(const std::string* blob) {
+    {
+      std::lock_guard lock(mutex_);
+      queue_.push_back(blob);
+    }
+    wakeup_.notify_one();
+  }
+
+ private:
+  void run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      wakeup_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+
+      std::vector<const std::string*> batch = std::move(queue_);
+      queue_.clear();
+      bool stopping = stopping_;
+
+      lock.unlock();
+      for (const std::string* blob : batch) {
+        delete blob;
+      }
+      lock.lock();
+
+      if (stopping && queue_.empty()) {
+        return;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::vector<const std::string*> queue_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+struct BlobOptions {
+  // Значения не короче min_size хранятся как blob, остальные — в записи.
+  std::size_t min_size = 64 * 1024;
+  // Освобождать blob'ы в фоновом потоке.
+  bool background_free = false;
+};
+
+// Создает blob'ы по BlobOptions.
+class BlobFactory {
+ public:
+  void setOptions(std::optional<BlobOptions> options) {
+    options_ = options;
+    reclaimer_.reset();
+    if (options_.has_value() && options_->background_free) {
+      reclaimer_ = std::make_shared<BlobReclaimer>();
+    }
+  }
+
+  bool isLarge(std::size_t size) const {
+    return options_.has_value() && size >= options_->min_size;
+  }
+
+  ValueHandle make(std::string value) const {
+    auto* blob = new std::string(std::move(value));
+    if (reclaimer_ == nullptr) {
+      return ValueHandle(blob);
+    }
+    // Deleter держит reclaimer, поэтому тот переживает хранилище, пока у
+    // читателей остаются ссылки.
+    return ValueHandle(blob, [reclaimer = reclaimer_](const std::string* p) {
+      reclaimer->retire(p);
+    });
+  }
+
+ private:
+  std::optional<BlobOptions> options_ = BlobOptions{};
+  std::shared_ptr<BlobReclaimer> reclaimer_;
+};
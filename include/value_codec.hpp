@@ -0,0 +1,470 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Способ хранения значения внутри записи.
+enum class ValueCodec : uint8_t {
+  // Значение хранится как есть.
+  kRaw,
+  // Встроенный LZ77.
+  kLz,
+  // Встроенный LZ77 с общим словарем (для небольших значений).
+  kLzDictionary,
+  // Разделяемый неизменяемый blob (см. value_blob.hpp).
+  kBlob,
+};
+
+namespace codec_detail {
+
+inline constexpr std::size_t kMinMatch = 4;
+inline constexpr std::size_t kMaxOffset = 65'535;
+inline constexpr int kHashBits = 12;
+
+inline void appendVarint(std::string& out, std::size_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+[[noreturn]] inline void corrupted() {
+  throw std::runtime_error("corrupted compressed value");
+}
+
+inline std::size_t readVarint(std::string_view in, std::size_t& pos) {
+  std::size_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos >= in.size()) {
+      corrupted();
+    }
+    auto byte = static_cast<unsigned char>(in[pos++]);
+    value |= static_cast<std::size_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  corrupted();
+}
+
+// Длина сверх 15 кодируется байтами по 255 и остатком, как в LZ4.
+inline void appendLength(std::string& out, std::size_t length) {
+  for (; length >= 255; length -= 255) {
+    out.push_back(static_cast<char>(255));
+  }
+  out.push_back(static_cast<char>(length));
+}
+
+inline std::size_t readLength(std::string_view in, std::size_t& pos,
+                              std::size_t length) {
+  if (length != 15) {
+    return length;
+  }
+  while (true) {
+    if (pos >= in.size()) {
+      corrupted();
+    }
+    auto byte = static_cast<unsigned char>(in[pos++]);
+    length += byte;
+    if (byte != 255) {
+      return length;
+    }
+  }
+}
+
+inline uint32_t read32(const char* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint32_t hash4(const char* p) {
+  return (read32(p) * 2654435761u) >> (32 - kHashBits);
+}
+
+inline void appendSequence(std::string& out, std::string_view literals,
+                           std::size_t offset, std::size_t match_length) {
+  std::size_t extra = match_length - kMinMatch;
+  out.push_back(static_cast<char>((std::min<std::size_t>(literals.size(), 15)
+                                   << 4) |
+                                  std::min<std::size_t>(extra, 15)));
+  if (literals.size() >= 15) {
+    appendLength(out, literals.size() - 15);
+  }
+  out.append(literals);
+  out.push_back(static_cast<char>(offset & 0xFF));
+  out.push_back(static_cast<char>(offset >> 8));
+  if (extra >= 15) {
+    appendLength(out, extra - 15);
+  }
+}
+
+inline void appendLastLiterals(std::string& out, std::string_view literals) {
+  out.push_back(
+      static_cast<char>(std::min<std::size_t>(literals.size(), 15) << 4));
+  if (literals.size() >= 15) {
+    appendLength(out, literals.size() - 15);
+  }
+  out.append(literals);
+}
+
+// Позиция + 1 последнего вхождения каждого хеша 4-байтового префикса,
+// 0 — нет.
+using MatchTable = std::vector<uint32_t>;
+
+inline MatchTable buildMatchTable(std::string_view data) {
+  MatchTable table(std::size_t{1} << kHashBits, 0);
+  for (std::size_t i = 0; i + kMinMatch <= data.size(); ++i) {
+    table[hash4(data.data() + i)] = static_cast<uint32_t>(i + 1);
+  }
+  return table;
+}
+
+// Жадный LZ77 в формате последовательностей LZ4: токен (длины литералов и
+// совпадения), литералы, 2 B смещения. Последняя последовательность состоит
+// только из литералов. Совпадения могут ссылаться в dictionary, который
+// логически предшествует input; dictionary_table — его заранее построенная
+// таблица (buildMatchTable), поэтому сжатие не зависит от размера словаря.
+inline void lzCompress(std::string_view input, std::string_view dictionary,
+                       std::span<const uint32_t> dictionary_table,
+                       std::string& out) {
+  MatchTable table(std::size_t{1} << kHashBits, 0);
+  const char* data = input.data();
+  // Позиции совпадений отсчитываются от начала dictionary: input[i] имеет
+  // позицию base + i.
+  const std::size_t base = dictionary.size();
+
+  // Длина совпадения с позиции i input с позиции match. Совпадение из
+  // словаря может продолжиться в начало input.
+  auto extend = [&](std::size_t match, std::size_t i) {
+    std::size_t length = kMinMatch;
+    for (; i + length < input.size() && match + length < base; ++length) {
+      if (dictionary[match + length] != data[i + length]) {
+        return length;
+      }
+    }
+    while (i + length < input.size() &&
+           data[match + length - base] == data[i + length]) {
+      ++length;
+    }
+    return length;
+  };
+
+  std::size_t anchor = 0;
+  std::size_t i = 0;
+  while (i + kMinMatch <= input.size()) {
+    uint32_t prefix = read32(data + i);
+    uint32_t hash = hash4(data + i);
+    std::size_t candidate = table[hash];
+    table[hash] = static_cast<uint32_t>(i + 1);
+
+    std::size_t match;
+    if (candidate != 0 && i - (candidate - 1) <= kMaxOffset &&
+        read32(data + candidate - 1) == prefix) {
+      match = base + candidate - 1;
+    } else if (!dictionary_table.empty() &&
+               (candidate = dictionary_table[hash]) != 0 &&
+               base + i - (candidate - 1) <= kMaxOffset &&
+               read32(dictionary.data() + candidate - 1) == prefix) {
+      match = candidate - 1;
+    } else {
+      ++i;
+      continue;
+    }
+
+    std::size_t length = extend(match, i);
+    appendSequence(out, input.substr(anchor, i - anchor), base + i - match,
+                   length);
+    i += length;
+    anchor = i;
+  }
+
+  appendLastLiterals(out, input.substr(anchor));
+}
+
+inline std::string lzDecompress(std::string_view in, std::size_t pos,
+                                std::size_t size, std::string_view dictionary) {
+  std::string out(size, '\0');
+  std::size_t op = 0;
+
+  while (true) {
+    if (pos >= in.size()) {
+      corrupted();
+    }
+    auto token = static_cast<unsigned char>(in[pos++]);
+
+    std::size_t literals = readLength(in, pos, token >> 4);
+    if (literals > in.size() - pos || literals > size - op) {
+      corrupted();
+    }
+    std::memcpy(out.data() + op, in.data() + pos, literals);
+    pos += literals;
+    op += literals;
+
+    if (pos == in.size()) {
+      break;
+    }
+
+    if (in.size() - pos < 2) {
+      corrupted();
+    }
+    std::size_t offset = static_cast<unsigned char>(in[pos]) |
+                         (static_cast<std::size_t>(
+                              static_cast<unsigned char>(in[pos + 1]))
+                          << 8);
+    pos += 2;
+    std::size_t length = readLength(in, pos, token & 0x0F) + kMinMatch;
+
+    if (offset == 0 || offset > op + dictionary.size() || length > size - op) {
+      corrupted();
+    }
+
+    // Начало совпадения в словаре.
+    if (offset > op) {
+      std::size_t from = dictionary.size() - (offset - op);
+      std::size_t chunk = std::min(length, dictionary.size() - from);
+      std::memcpy(out.data() + op, dictionary.data() + from, chunk);
+      op += chunk;
+      length -= chunk;
+    }
+
+    if (offset >= length) {
+      std::memcpy(out.data() + op, out.data() + op - offset, length);
+      op += length;
+      continue;
+    }
+
+    // Совпадение перекрывается с самим собой, поэтому копируем по байту.
+    for (; length > 0; --length, ++op) {
+      out[op] = out[op - offset];
+    }
+  }
+
+  if (op != size) {
+    corrupted();
+  }
+  return out;
+}
+
+}  // namespace codec_detail
+
+// Неизменяемый общий словарь для сжатия небольших значений. Значения из
+// словаря используются как уже "распакованный" контекст перед каждым
+// значением, поэтому повторяющиеся между значениями фрагменты (ключи JSON,
+// общие заголовки) кодируются ссылками.
+class CompressionDictionary {
+ public:
+  static constexpr std::size_t kMaxSize = codec_detail::kMaxOffset;
+
+  explicit CompressionDictionary(std::string bytes) : bytes_(std::move(bytes)) {
+    if (bytes_.size() > kMaxSize) {
+      bytes_.erase(0, bytes_.size() - kMaxSize);
+    }
+    match_table_ = codec_detail::buildMatchTable(bytes_);
+  }
+
+  // Упрощенный вариант COVER из zstd: образцы режутся на сегменты, сегмент
+  // оценивается суммой частот его 8-грамм по всем образцам. Жадно берутся
+  // лучшие сегменты, 8-граммы которых еще не покрыты словарем. Самые ценные
+  // сегменты кладутся в конец, ближе к сжимаемым данным.
+  static std::shared_ptr<const CompressionDictionary> train(
+      std::span<const std::string> samples, std::size_t capacity = 16 * 1024) {
+    constexpr std::size_t kGram = 8;
+    constexpr std::size_t kSegment = 64;
+
+    auto gram = [](const char* p) {
+      uint64_t value;
+      std::memcpy(&value, p, sizeof(value));
+      return value;
+    };
+
+    std::unordered_map<uint64_t, uint32_t> frequency;
+    for (const auto& sample : samples) {
+      for (std::size_t i = 0; i + kGram <= sample.size(); ++i) {
+        ++frequency[gram(sample.data() + i)];
+      }
+    }
+
+    struct Segment {
+      std::string_view text;
+      uint64_t score;
+    };
+    std::vector<Segment> segments;
+    for (const auto& sample : samples) {
+      for (std::size_t i = 0; i + kSegment <= sample.size();
+           i += kSegment / 2) {
+        std::string_view text(sample.data() + i, kSegment);
+        uint64_t score = 0;
+        for (std::size_t j = 0; j + kGram <= text.size(); ++j) {
+          score += frequency[gram(text.data() + j)] - 1;
+        }
+        segments.push_back({text, score});
+      }
+    }
+    std::sort(segments.begin(), segments.end(),
+              [](const Segment& lhs, const Segment& rhs) {
+                return lhs.score > rhs.score;
+              });
+
+    std::unordered_set<uint64_t> covered;
+    std::vector<std::string_view> chosen;
+    std::size_t size = 0;
+    for (const auto& segment : segments) {
+      if (size + kSegment > capacity || segment.score == 0) {
+        break;
+      }
+
+      std::size_t fresh = 0;
+      for (std::size_t j = 0; j + kGram <= kSegment; ++j) {
+        fresh += covered.count(gram(segment.text.data() + j)) == 0 ? 1 : 0;
+      }
+      if (fresh * 2 < kSegment - kGram + 1) {
+        continue;
+      }
+
+      for (std::size_t j = 0; j + kGram <= kSegment; ++j) {
+        covered.insert(gram(segment.text.data() + j));
+      }
+      chosen.push_back(segment.text);
+      size += kSegment;
+    }
+
+    std::string bytes;
+    bytes.reserve(size);
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) {
+      bytes.append(*it);
+    }
+    return std::make_shared<const CompressionDictionary>(std::move(bytes));
+  }
+
+  std::string_view bytes() const { return bytes_; }
+
+  // Таблица совпадений по bytes(), строится один раз при создании словаря.
+  std::span<const uint32_t> matchTable() const { return match_table_; }
+
+ private:
+  std::string bytes_;
+  codec_detail::MatchTable match_table_;
+};
+
+struct CompressionOptions {
+  // Значения не короче min_size сжимаются без словаря.
+  std::size_t min_size = 1024;
+  // Если задан словарь, значения от dictionary_min_size до min_size
+  // сжимаются с ним.
+  std::shared_ptr<const CompressionDictionary> dictionary = nullptr;
+  std::size_t dictionary_min_size = 64;
+  // Сжатое значение сохраняется, только если оно не больше
+  // max_ratio * исходного размера. Иначе значение считается несжимаемым и
+  // хранится как есть.
+  double max_ratio = 0.875;
+};
+
+// Выбирает кодек для каждого значения и (раз)жимает значения. Словари,
+// которыми когда-либо сжимались значения, остаются зарегистрированы: их
+// номер хранится в сжатом значении, поэтому словарь можно сменить без
+// перекодирования старых записей.
+class ValueCompressor {
+ public:
+  bool enabled() const { return options_.has_value(); }
+
+  void setOptions(std::optional<CompressionOptions> options) {
+    options_ = std::move(options);
+    dictionary_id_ = 0;
+    if (options_.has_value() && options_->dictionary != nullptr) {
+      dictionary_id_ = registerDictionary(options_->dictionary);
+    }
+  }
+
+  // Заменяет value сжатым представлением, если это выгодно, и возвращает
+  // выбранный кодек.
+  ValueCodec encode(std::string& value) const {
+    if (!options_.has_value() || value.size() < minCompressedSize()) {
+      return ValueCodec::kRaw;
+    }
+
+    ValueCodec codec = ValueCodec::kLz;
+    std::string_view dictionary;
+    std::span<const uint32_t> dictionary_table;
+    std::string out;
+    codec_detail::appendVarint(out, value.size());
+
+    if (value.size() < options_->min_size) {
+      codec = ValueCodec::kLzDictionary;
+      const auto& current = *dictionaries_[dictionary_id_ - 1];
+      dictionary = current.bytes();
+      dictionary_table = current.matchTable();
+      codec_detail::appendVarint(out, dictionary_id_);
+    }
+
+    codec_detail::lzCompress(value, dictionary, dictionary_table, out);
+    if (out.size() > value.size() * options_->max_ratio) {
+      return ValueCodec::kRaw;
+    }
+
+    out.shrink_to_fit();
+    value = std::move(out);
+    return codec;
+  }
+
+  std::string decode(const std::string& stored, ValueCodec codec) const {
+    if (codec == ValueCodec::kRaw) {
+      return stored;
+    }
+
+    std::size_t pos = 0;
+    std::size_t size = codec_detail::readVarint(stored, pos);
+    std::string_view dictionary;
+    if (codec == ValueCodec::kLzDictionary) {
+      std::size_t id = codec_detail::readVarint(stored, pos);
+      if (id == 0 || id > dictionaries_.size()) {
+        codec_detail::corrupted();
+      }
+      dictionary = dictionaries_[id - 1]->bytes();
+    }
+    return codec_detail::lzDecompress(stored, pos, size, dictionary);
+  }
+
+  // Как decode, но забирает несжатое значение без копирования.
+  std::string release(std::string& stored, ValueCodec codec) const {
+    if (codec == ValueCodec::kRaw) {
+      return std::move(stored);
+    }
+    return decode(stored, codec);
+  }
+
+ private:
+  std::size_t minCompressedSize() const {
+    return dictionary_id_ != 0
+               ? std::min(options_->dictionary_min_size, options_->min_size)
+               : options_->min_size;
+  }
+
+  std::size_t registerDictionary(
+      std::shared_ptr<const CompressionDictionary> dictionary) {
+    auto it = std::find(dictionaries_.begin(), dictionaries_.end(), dictionary);
+    if (it == dictionaries_.end()) {
+      dictionaries_.push_back(std::move(dictionary));
+      return dictionaries_.size();
+    }
+    return static_cast<std::size_t>(it - dictionaries_.begin()) + 1;
+  }
+
+  std::optional<CompressionOptions> options_;
+  // Номер текущего словаря в dictionaries_, начиная с 1; 0 — словаря нет.
+  std::size_t dictionary_id_ = 0;
+  std::vector<std::shared_ptr<const CompressionDictionary>> dictionaries_;
+};
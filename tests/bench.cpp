@@ -0,0 +1,323 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "concurrent_kv_storage.hpp"
+#include "concurrent_skip_list.hpp"
+#include "kv_storage.hpp"
+
+// Бенчмарки масштабирования по потокам. Ничего не проверяют и имеют смысл
+// только на многоядерной машине, поэтому не входят в ctest: запускаются
+// вручную (./bin/bench_tests).
+
+TEST(ConcurrentSkipListBenchmark, MixedInsertScanScaling) {
+  constexpr int kOperations = 128'000;
+  constexpr uint64_t kKeySpace = 100'000;
+
+  // Каждый поток выполняет kOperations / threads операций: 90% вставок и
+  // удалений случайных ключей, 10% сканирований по 16 ключей.
+  auto run = [&](int threads, auto insert, auto erase, auto scan) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t] {
+        std::mt19937_64 rng(t);
+        for (int i = 0; i < kOperations / threads; ++i) {
+          uint64_t key = rng() % kKeySpace;
+          switch (rng() % 10) {
+            case 0:
+              scan(key);
+              break;
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+              erase(key);
+              break;
+            default:
+              insert(key);
+          }
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return kOperations /
+           std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+    ConcurrentSkipList<uint64_t> list;
+    double lock_free = run(
+        threads, [&](uint64_t key) { list.insert(key); },
+        [&](uint64_t key) { list.erase(key); },
+        [&](uint64_t key) {
+          std::size_t sum = 0;
+          list.scan(key, 16, [&](uint64_t k) { sum += k; });
+          EXPECT_GE(sum + 1, 1);
+        });
+
+    std::set<uint64_t> set;
+    std::shared_mutex mutex;
+    double locked = run(
+        threads,
+        [&](uint64_t key) {
+          std::unique_lock lock(mutex);
+          set.insert(key);
+        },
+        [&](uint64_t key) {
+          std::unique_lock lock(mutex);
+          set.erase(key);
+        },
+        [&](uint64_t key) {
+          std::shared_lock lock(mutex);
+          std::size_t sum = 0;
+          auto it = set.lower_bound(key);
+          for (int i = 0; i < 16 && it != set.end(); ++i, ++it) {
+            sum += *it;
+          }
+          EXPECT_GE(sum + 1, 1);
+        });
+
+    std::cout << threads << " threads, mixed insert/erase/scan: skip list —— "
+              << lock_free << " ops/ms, std::set + shared_mutex —— " << locked
+              << " ops/ms" << std::endl;
+  }
+}
+
+TEST(ConcurrentKVStorageBenchmark, MixedGetSetScaling) {
+  constexpr int kOperations = 400'000;
+  constexpr int kKeys = 100'000;
+
+  std::vector<std::string> keys;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    data.emplace_back(keys.back(), "value" + std::to_string(i), 0);
+  }
+
+  // Каждый поток выполняет kOperations / threads операций: 90% get, 10% set
+  // случайных ключей.
+  auto run = [&](int threads, auto get, auto set) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t] {
+        std::mt19937 rng(t);
+        std::size_t found = 0;
+        for (int i = 0; i < kOperations / threads; ++i) {
+          const std::string& key = keys[rng() % kKeys];
+          if (rng() % 10 == 0) {
+            set(key);
+          } else {
+            found += get(key);
+          }
+        }
+        EXPECT_GT(found, 0);
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return kOperations /
+           std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  for (int threads : {1, 2, 4, 8, 16}) {
+    auto concurrent_data = data;
+    ConcurrentKVStorage<std::chrono::steady_clock> concurrent(concurrent_data);
+    double striped = run(
+        threads,
+        [&](const std::string& key) { return concurrent.get(key).has_value(); },
+        [&](const std::string& key) { concurrent.set(key, "updated", 0); });
+
+    auto locked_data = data;
+    KVStorage<std::chrono::steady_clock> storage(locked_data);
+    std::shared_mutex mutex;
+    double locked = run(
+        threads,
+        [&](const std::string& key) {
+          std::shared_lock lock(mutex);
+          return storage.get(key).has_value();
+        },
+        [&](const std::string& key) {
+          std::unique_lock lock(mutex);
+          storage.set(key, "updated", 0);
+        });
+
+    std::cout << threads
+              << " threads, 90% get / 10% set: ConcurrentKVStorage —— "
+              << striped << " ops/ms, KVStorage + shared_mutex —— " << locked
+              << " ops/ms" << std::endl;
+  }
+}
+
+TEST(ConcurrentKVStorageBenchmark, InlineValueReaderScaling) {
+  constexpr int kReads = 400'000;
+  constexpr int kKeys = 100'000;
+
+  std::vector<std::string> keys;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    data.emplace_back(keys.back(), std::string(32, 'a' + i % 26), 0);
+  }
+
+  // Читатели выполняют kReads / threads get 32-байтовых значений, пока один
+  // писатель обновляет случайные ключи.
+  auto run = [&](int threads, auto get, auto set) {
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+      std::mt19937 rng(100);
+      while (!done.load(std::memory_order_relaxed)) {
+        set(keys[rng() % kKeys]);
+      }
+    });
+    std::vector<std::thread> readers;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      readers.emplace_back([&, t] {
+        std::mt19937 rng(t);
+        std::size_t bytes = 0;
+        for (int i = 0; i < kReads / threads; ++i) {
+          bytes += get(keys[rng() % kKeys]);
+        }
+        EXPECT_GT(bytes, 0);
+      });
+    }
+    for (auto& reader : readers) {
+      reader.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    done.store(true);
+    writer.join();
+    return kReads /
+           std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  std::string update(32, 'z');
+  for (int threads : {1, 2, 4, 8}) {
+    auto inline_data = data;
+    ConcurrentKVStorage<std::chrono::steady_clock, SeededHash, 64> inlined(
+        inline_data);
+    double seqlock = run(
+        threads,
+        [&](const std::string& key) { return inlined.get(key)->size(); },
+        [&](const std::string& key) { inlined.set(key, update, 0); });
+
+    auto version_data = data;
+    ConcurrentKVStorage<std::chrono::steady_clock> versioned(version_data);
+    double version = run(
+        threads,
+        [&](const std::string& key) { return versioned.get(key)->size(); },
+        [&](const std::string& key) { versioned.set(key, update, 0); });
+
+    auto locked_data = data;
+    KVStorage<std::chrono::steady_clock> storage(locked_data);
+    std::shared_mutex mutex;
+    double locked = run(
+        threads,
+        [&](const std::string& key) {
+          std::shared_lock lock(mutex);
+          return storage.get(key)->size();
+        },
+        [&](const std::string& key) {
+          std::unique_lock lock(mutex);
+          storage.set(key, update, 0);
+        });
+
+    std::cout << threads << " readers + 1 writer, 32 B values: seqlock —— "
+              << seqlock << " ops/ms, versions —— " << version
+              << " ops/ms, KVStorage + shared_mutex —— " << locked
+              << " ops/ms" << std::endl;
+  }
+}
+
+TEST(HotKeyReplicasBenchmark, ZipfGetScaling) {
+  constexpr int kOperations = 1'000'000;
+  constexpr int kKeys = 100'000;
+  constexpr double kTheta = 0.99;
+
+  std::vector<std::string> keys;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    data.emplace_back(keys.back(), std::string(32, 'a' + i % 26), 0);
+  }
+
+  // Распределение Zipf: ключ с рангом r выбирается с вероятностью,
+  // пропорциональной 1 / r^theta. Индексы выбираются заранее, чтобы
+  // генерация не попала в замер.
+  std::vector<double> cdf(kKeys);
+  double sum = 0;
+  for (int i = 0; i < kKeys; ++i) {
+    sum += 1 / std::pow(i + 1, kTheta);
+    cdf[i] = sum;
+  }
+  std::vector<int> picks(kOperations);
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<double> uniform(0, sum);
+  for (int& pick : picks) {
+    pick = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) -
+           cdf.begin();
+  }
+
+  // Каждый поток выполняет kOperations / threads операций: 99% get, 1% set.
+  auto run = [&](int threads, auto& storage) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t] {
+        std::size_t found = 0;
+        int begin = t * (kOperations / threads);
+        for (int i = begin; i < begin + kOperations / threads; ++i) {
+          const std::string& key = keys[picks[i]];
+          if (i % 100 == 0) {
+            storage.set(key, std::string(32, 'z'), 0);
+          } else {
+            found += storage.get(key).has_value();
+          }
+        }
+        EXPECT_GT(found, 0);
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return kOperations /
+           std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  for (int threads : {1, 2, 4, 8}) {
+    auto plain_data = data;
+    ConcurrentKVStorage<std::chrono::steady_clock, SeededHash, 64> plain(
+        plain_data);
+    double without = run(threads, plain);
+
+    auto replicated_data = data;
+    ConcurrentKVStorage<std::chrono::steady_clock, SeededHash, 64> replicated(
+        replicated_data);
+    replicated.setHotKeyReplication(HotKeyOptions{});
+    double with = run(threads, replicated);
+
+    std::cout << threads << " threads, Zipf 0.99, 99% get / 1% set: "
+              << "without replicas —— " << without << " ops/ms, with "
+              << replicated.hotKeyCount() << " hot keys —— " << with
+              << " ops/ms" << std::endl;
+  }
+}
@@ -1,8 +1,15 @@
 #include <gtest/gtest.h>
+#include <malloc.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
 #include <memory>
 #include <random>
+#include <shared_mutex>
+#include <thread>
 
+#include "concurrent_kv_storage.hpp"
 #include "kv_storage.hpp"
 
 class KVStorageStressTest : public testing::Test {
@@ -100,3 +107,1165 @@ TEST_F(KVStorageStressTest, MixedWorkload) {
 
   EXPECT_LT(duration.count(), 100);
 }
+
+namespace {
+
+// Верхняя граница задержки одного set: 20 ms или значение переменной
+// окружения KV_MAX_SET_LATENCY_MS (положительное число миллисекунд). При
+// полном рехешировании std::unordered_map на миллионе ключей отдельные
+// вызовы занимают 30-80 ms.
+std::chrono::milliseconds maxSetLatency() {
+  constexpr std::chrono::milliseconds kDefault{20};
+  const char* bound = std::getenv("KV_MAX_SET_LATENCY_MS");
+  if (bound == nullptr) {
+    return kDefault;
+  }
+  char* end = nullptr;
+  long value = std::strtol(bound, &end, 10);
+  if (end == bound || *end != '\0' || value <= 0) {
+    ADD_FAILURE() << "KV_MAX_SET_LATENCY_MS must be a positive integer";
+    return kDefault;
+  }
+  return std::chrono::milliseconds(value);
+}
+
+}  // namespace
+
+TEST(KVStorageLatencyTest, InsertOnlyGrowth) {
+  // Задержка измеряется по steady_clock: в нее входят и вытеснение
+  // планировщиком, и блокировки, которые видит вызывающий.
+  const std::chrono::milliseconds kMaxSetLatency = maxSetLatency();
+  constexpr int kInserts = 1'000'000;
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> storage(data);
+
+  std::vector<std::string> keys;
+  keys.reserve(kInserts);
+  for (int i = 0; i < kInserts; ++i) {
+    keys.push_back("key" + std::to_string(i));
+  }
+
+  std::chrono::nanoseconds max_latency{0};
+
+  for (int i = 0; i < kInserts; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    storage.set(std::move(keys[i]), "value", 0);
+    auto end = std::chrono::steady_clock::now();
+
+    max_latency = std::max(max_latency, end - start);
+  }
+
+  std::cout << "1'000'000 set operations, max latency —— "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   max_latency)
+                   .count()
+            << " microseconds (bound " << kMaxSetLatency.count() << " ms)"
+            << std::endl;
+
+  EXPECT_LT(max_latency, kMaxSetLatency);
+}
+
+TEST(KVStorageLoadFactorTest, LookupCost) {
+  constexpr int kKeys = 200'000;
+
+  for (float load_factor : {0.5f, 1.0f, 2.0f, 4.0f}) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    KVStorage<std::chrono::steady_clock> storage(data);
+    storage.setMaxLoadFactor(load_factor);
+
+    for (int i = 0; i < kKeys; ++i) {
+      storage.set("key" + std::to_string(i), "value", 0);
+    }
+    while (storage.rehashStep(1'024)) {
+    }
+
+    std::vector<std::string> keys;
+    keys.reserve(kKeys);
+    for (int i = 0; i < kKeys; ++i) {
+      keys.push_back("key" + std::to_string(i));
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& key : keys) {
+      EXPECT_TRUE(storage.get(key).has_value());
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::cout << "max load factor " << load_factor << ": "
+              << storage.bucketCount() * sizeof(void*) / 1'024
+              << " KiB of buckets, 200'000 get operations —— "
+              << std::chrono::duration_cast<std::chrono::microseconds>(end -
+                                                                       start)
+                     .count()
+              << " microseconds" << std::endl;
+  }
+}
+
+TEST(KVStorageLoadFactorTest, ShrinkReclaimsBuckets) {
+  constexpr int kKeys = 500'000;
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> storage(data);
+
+  for (int i = 0; i < kKeys; ++i) {
+    storage.set("key" + std::to_string(i), "value", 0);
+  }
+  // Удаляем 99% записей, как после удаления крупного тенанта.
+  for (int i = 0; i < kKeys; ++i) {
+    if (i % 100 != 0) {
+      storage.remove("key" + std::to_string(i));
+    }
+  }
+  while (storage.rehashStep(1'024)) {
+  }
+
+  std::size_t bytes_before = storage.bucketCount() * sizeof(void*);
+
+  storage.shrinkToFit();
+  int steps = 0;
+  while (storage.rehashStep(64)) {
+    ++steps;
+  }
+
+  std::size_t bytes_after = storage.bucketCount() * sizeof(void*);
+
+  std::cout << "shrinkToFit: " << bytes_before / 1'024 << " KiB -> "
+            << bytes_after / 1'024 << " KiB of buckets in " << steps
+            << " background steps" << std::endl;
+
+  EXPECT_LT(bytes_after * 10, bytes_before);
+}
+
+TEST(HashPolicyBenchmark, KeyLengths) {
+  constexpr int kKeys = 1'024;
+  constexpr int kRounds = 40;
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> byte('a', 'z');
+
+  auto measure = [&](const auto& hash, const std::vector<std::string>& keys) {
+    std::size_t sink = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int round = 0; round < kRounds; ++round) {
+      for (const auto& key : keys) {
+        sink += hash(key);
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    EXPECT_NE(sink, 0);
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           (kKeys * kRounds);
+  };
+
+  for (std::size_t len : {8, 16, 32, 64, 128, 256}) {
+    std::vector<std::string> keys(kKeys);
+    for (auto& key : keys) {
+      for (std::size_t i = 0; i < len; ++i) {
+        key.push_back(static_cast<char>(byte(rng)));
+      }
+    }
+
+    // Лучшее из нескольких чередующихся замеров, чтобы единичная пауза
+    // планировщика не решала сравнение.
+    double std_hash = std::numeric_limits<double>::max();
+    double seeded = std::numeric_limits<double>::max();
+    for (int attempt = 0; attempt < 5; ++attempt) {
+      std_hash = std::min(std_hash, measure(StdHash{}, keys));
+      seeded = std::min(seeded, measure(SeededHash{}, keys));
+    }
+    std::cout << len << " B keys: std::hash —— " << std_hash
+              << " ns, SeededHash —— " << seeded << " ns" << std::endl;
+
+#ifdef __OPTIMIZE__
+    // Без оптимизаций время определяется не алгоритмом, а вызовами
+    // неинлайненных функций.
+    if (len >= 64) {
+      EXPECT_LT(seeded, std_hash);
+    }
+#endif
+  }
+}
+
+TEST(KVStorageLongKeysBenchmark, InternalLookups) {
+  constexpr int kKeys = 200'000;
+  // Общий длинный префикс, как у иерархических ключей: > 64 B.
+  const std::string prefix(80, 'p');
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  data.reserve(kKeys);
+  for (int i = 0; i < kKeys; ++i) {
+    data.emplace_back(prefix + std::to_string(i), "value", 1);
+  }
+
+  auto build_start = std::chrono::high_resolution_clock::now();
+  KVStorage<std::chrono::steady_clock> storage(data);
+  for (int i = 0; i < kKeys; ++i) {
+    storage.set(prefix + "extra" + std::to_string(i), "value", 0);
+  }
+  auto build_end = std::chrono::high_resolution_clock::now();
+
+  auto scan_start = std::chrono::high_resolution_clock::now();
+  std::size_t scanned = 0;
+  for (int round = 0; round < 5; ++round) {
+    scanned += storage.getManySorted("", 2 * kKeys).size();
+  }
+  auto scan_end = std::chrono::high_resolution_clock::now();
+
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+
+  auto drain_start = std::chrono::high_resolution_clock::now();
+  int drained = 0;
+  while (storage.removeOneExpiredEntry().has_value()) {
+    ++drained;
+  }
+  auto drain_end = std::chrono::high_resolution_clock::now();
+
+  auto ms = [](auto duration) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(duration)
+        .count();
+  };
+
+  std::cout << "400'000 inserts of 85+ B keys with growth —— "
+            << ms(build_end - build_start) << " ms" << std::endl;
+  std::cout << "5 full getManySorted scans —— " << ms(scan_end - scan_start)
+            << " ms" << std::endl;
+  std::cout << "200'000 removeOneExpiredEntry —— "
+            << ms(drain_end - drain_start) << " ms" << std::endl;
+
+  EXPECT_GE(scanned, 5 * kKeys);
+  EXPECT_EQ(drained, kKeys);
+}
+
+namespace {
+
+std::size_t heapInUse() { return mallinfo2().uordblks; }
+
+// Иерархические ключи вида org/<id>/bucket/<id>/objects/2024/10/17/<name>,
+// в среднем ~70 B.
+std::vector<std::string> hierarchicalKeys(int count) {
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  for (int i = 0; i < count; ++i) {
+    std::string org = std::to_string(100'000 + i / 50'000);
+    std::string bucket = std::to_string(1'000'000 + i / 1'000);
+    keys.push_back("org/" + org + "/bucket/" + bucket +
+                   "/objects/2024/10/17/reports/object-" + std::to_string(i) +
+                   ".json");
+  }
+  return keys;
+}
+
+}  // namespace
+
+TEST(InternedKeysBenchmark, KeyMemoryAndGetLatency) {
+  constexpr int kKeys = 200'000;
+  const auto keys = hierarchicalKeys(kKeys);
+
+  std::size_t total_length = 0;
+  for (const auto& key : keys) {
+    total_length += key.size();
+  }
+
+  // Память только под ключи: объекты ключей и все, что они аллоцируют.
+  std::size_t plain_bytes = 0;
+  {
+    std::vector<std::string> stored;
+    stored.reserve(kKeys);
+    PlainKeys<>::Pool pool;
+    std::size_t before = heapInUse();
+    for (const auto& key : keys) {
+      stored.push_back(PlainKeys<>::make(pool, std::string(key)));
+    }
+    plain_bytes = heapInUse() - before + kKeys * sizeof(std::string);
+  }
+
+  std::size_t interned_bytes = 0;
+  {
+    using Policy = InternedPrefixKeys<'/'>;
+    std::vector<Policy::stored_type> stored;
+    stored.reserve(kKeys);
+    Policy::Pool pool;
+    std::size_t before = heapInUse();
+    for (const auto& key : keys) {
+      stored.push_back(Policy::make(pool, std::string(key)));
+    }
+    interned_bytes =
+        heapInUse() - before + kKeys * sizeof(Policy::stored_type);
+  }
+
+  std::cout << "average key " << total_length / kKeys << " B; key memory: "
+            << "plain —— " << plain_bytes / kKeys << " B/key, interned —— "
+            << interned_bytes / kKeys << " B/key" << std::endl;
+
+  EXPECT_LT(interned_bytes * 10, plain_bytes * 6);
+
+  auto measure_get = [&](const auto& storage) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& key : keys) {
+      EXPECT_TRUE(storage.get(key).has_value());
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+        .count();
+  };
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  for (const auto& key : keys) {
+    data.emplace_back(key, "value", 0);
+  }
+  auto data_copy = data;
+
+  KVStorage<std::chrono::steady_clock> plain(data);
+  KVStorage<std::chrono::steady_clock, std::string, std::string,
+            KVTraits<std::string, std::string, SeededHash,
+                     InternedPrefixKeys<'/'>>>
+      interned(data_copy);
+
+  std::cout << "200'000 get operations: plain —— " << measure_get(plain)
+            << " microseconds, interned —— " << measure_get(interned)
+            << " microseconds" << std::endl;
+}
+
+namespace {
+
+// JSON-документ размером около size байт со случайными числами.
+std::string jsonDocument(std::mt19937& rng, std::size_t size) {
+  std::uniform_int_distribution<int> number(0, 1'000'000);
+  std::string doc = "{\"events\":[";
+  while (doc.size() < size) {
+    doc += "{\"user_id\":" + std::to_string(number(rng)) +
+           ",\"type\":\"page_view\",\"duration_ms\":" +
+           std::to_string(number(rng) % 5'000) +
+           ",\"country\":\"DE\",\"device\":{\"os\":\"android\",\"version\":"
+           "\"14.1\"}},";
+  }
+  doc += "]}";
+  return doc;
+}
+
+}  // namespace
+
+TEST(ValueCompressionBenchmark, MemoryAndGetLatency) {
+  constexpr int kValues = 2'000;
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<std::size_t> size(1'024, 50 * 1'024);
+  std::vector<std::string> values;
+  std::size_t raw_bytes = 0;
+  for (int i = 0; i < kValues; ++i) {
+    values.push_back(jsonDocument(rng, size(rng)));
+    raw_bytes += values.back().size();
+  }
+
+  auto run = [&](std::optional<CompressionOptions> options) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    std::size_t before = heapInUse();
+    KVStorage<std::chrono::steady_clock> storage(data);
+    storage.setCompression(options);
+    for (int i = 0; i < kValues; ++i) {
+      storage.set("key" + std::to_string(i), values[i], 0);
+    }
+    std::size_t bytes = heapInUse() - before;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < kValues; ++i) {
+      EXPECT_EQ(storage.get("key" + std::to_string(i))->size(),
+                values[i].size());
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    return std::make_pair(
+        bytes,
+        std::chrono::duration<double, std::micro>(end - start).count() /
+            kValues);
+  };
+
+  auto [raw_memory, raw_get] = run(std::nullopt);
+  auto [compressed_memory, compressed_get] = run(CompressionOptions{});
+
+  std::cout << raw_bytes / 1'024 << " KiB of JSON values: raw —— "
+            << raw_memory / 1'024 << " KiB, " << raw_get
+            << " us/get; compressed —— " << compressed_memory / 1'024
+            << " KiB, " << compressed_get << " us/get" << std::endl;
+
+  EXPECT_LT(compressed_memory * 2, raw_memory);
+}
+
+TEST(ValueCompressionBenchmark, SmallValuesWithDictionary) {
+  constexpr int kValues = 20'000;
+
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<std::size_t> size(100, 400);
+  std::vector<std::string> values;
+  for (int i = 0; i < kValues; ++i) {
+    values.push_back(jsonDocument(rng, size(rng)));
+  }
+
+  auto dictionary = CompressionDictionary::train(
+      std::span<const std::string>(values.data(), 500));
+
+  auto run = [&](std::optional<CompressionOptions> options) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    std::size_t before = heapInUse();
+    KVStorage<std::chrono::steady_clock> storage(data);
+    storage.setCompression(options);
+    for (int i = 0; i < kValues; ++i) {
+      storage.set("key" + std::to_string(i), values[i], 0);
+    }
+    return heapInUse() - before;
+  };
+
+  std::size_t raw_memory = run(std::nullopt);
+  std::size_t plain_lz_memory = run(CompressionOptions{.min_size = 64});
+  std::size_t dictionary_memory =
+      run(CompressionOptions{.dictionary = dictionary});
+
+  std::cout << "20'000 small JSON values: raw —— " << raw_memory / 1'024
+            << " KiB, LZ —— " << plain_lz_memory / 1'024
+            << " KiB, LZ with " << dictionary->bytes().size()
+            << " B dictionary —— " << dictionary_memory / 1'024 << " KiB"
+            << std::endl;
+
+  EXPECT_LT(dictionary_memory, plain_lz_memory);
+}
+
+TEST(LargeValueBenchmark, SharedGet) {
+  constexpr int kGets = 2'000;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> storage(data);
+  storage.set("large", std::string(512 * 1'024, 'v'), 0);
+
+  auto measure = [&](auto get) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < kGets; ++i) {
+      get();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() /
+           kGets;
+  };
+
+  double copy = measure([&] { EXPECT_TRUE(storage.get("large")); });
+  double shared = measure([&] { EXPECT_TRUE(storage.getShared("large")); });
+
+  std::cout << "512 KiB value: get —— " << copy << " us, getShared —— "
+            << shared << " us" << std::endl;
+
+  EXPECT_LT(shared, copy);
+}
+
+TEST(GenericTypesBenchmark, IntegerKeysAndValues) {
+  constexpr int kKeys = 200'000;
+  std::mt19937_64 rng(7);
+  std::vector<uint64_t> ids(kKeys);
+  for (auto& id : ids) {
+    id = rng();
+  }
+
+  auto measure = [&](auto make_key, auto make_value) {
+    using Key = decltype(make_key(uint64_t{}));
+    using Value = decltype(make_value(uint64_t{}));
+
+    std::vector<std::tuple<Key, Value, uint32_t>> data;
+    std::size_t before = heapInUse();
+    KVStorage<std::chrono::steady_clock, Key, Value> storage(data);
+    for (uint64_t id : ids) {
+      storage.set(make_key(id), make_value(id), 0);
+    }
+    std::size_t memory = heapInUse() - before;
+
+    std::vector<Key> keys;
+    keys.reserve(kKeys);
+    for (uint64_t id : ids) {
+      keys.push_back(make_key(id));
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& key : keys) {
+      EXPECT_TRUE(storage.get(key).has_value());
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double latency =
+        std::chrono::duration<double, std::nano>(end - start).count() / kKeys;
+    return std::make_pair(memory, latency);
+  };
+
+  auto [string_memory, string_latency] =
+      measure([](uint64_t id) { return std::to_string(id); },
+              [](uint64_t id) { return std::to_string(id); });
+  auto [integer_memory, integer_latency] =
+      measure([](uint64_t id) { return id; }, [](uint64_t id) { return id; });
+
+  std::cout << "200'000 64-bit ids: strings —— " << string_memory / kKeys
+            << " B/entry, " << string_latency << " ns/get; integers —— "
+            << integer_memory / kKeys << " B/entry, " << integer_latency
+            << " ns/get" << std::endl;
+
+  EXPECT_LT(integer_memory, string_memory);
+}
+
+TEST(FeaturesBenchmark, HashOnlyFootprint) {
+  constexpr int kKeys = 200'000;
+  std::vector<std::string> keys;
+  keys.reserve(kKeys);
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+  }
+
+  auto measure = [&]<typename Storage>(std::type_identity<Storage>) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    std::size_t before = heapInUse();
+    Storage storage(data);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& key : keys) {
+      storage.set(key, "value", 0);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double latency =
+        std::chrono::duration<double, std::nano>(end - start).count() / kKeys;
+    return std::make_pair((heapInUse() - before) / kKeys, latency);
+  };
+
+  auto [full_memory, full_latency] =
+      measure(std::type_identity<KVStorage<std::chrono::steady_clock>>());
+  auto [lean_memory, lean_latency] =
+      measure(std::type_identity<KVStorage<std::chrono::steady_clock,
+                                           Features<Sorted::No, Ttl::No>>>());
+
+  std::cout << "200'000 set operations: all indexes —— " << full_memory
+            << " B/entry, " << full_latency << " ns/set; hash only —— "
+            << lean_memory << " B/entry, " << lean_latency << " ns/set"
+            << std::endl;
+
+  EXPECT_LT(lean_memory + 48, full_memory);
+}
+
+TEST(SortedIndexBenchmark, BPlusTreeScanAndMemory) {
+  constexpr int kKeys = 200'000;
+  constexpr int kScans = 2'000;
+  std::mt19937 rng(11);
+  std::vector<std::string> keys;
+  keys.reserve(kKeys);
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("user:" + std::to_string(rng()));
+  }
+
+  auto measure = [&]<typename Storage>(std::type_identity<Storage>) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    std::size_t before = heapInUse();
+    Storage storage(data);
+    for (const auto& key : keys) {
+      storage.set(key, "v", 0);
+    }
+    std::size_t memory = heapInUse() - before;
+
+    std::size_t scanned = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < kScans; ++i) {
+      scanned += storage.getManySorted(keys[i * 97], 100).size();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    EXPECT_GT(scanned, 0);
+    double latency =
+        std::chrono::duration<double, std::micro>(end - start).count() /
+        kScans;
+    return std::make_pair(memory / kKeys, latency);
+  };
+
+  auto [set_memory, set_latency] =
+      measure(std::type_identity<KVStorage<std::chrono::steady_clock>>());
+  auto [tree_memory, tree_latency] = measure(
+      std::type_identity<KVStorage<std::chrono::steady_clock,
+                                   Features<Sorted::BPlusTree, Ttl::Yes>>>());
+
+  std::cout << "200'000 keys, getManySorted(key, 100): std::set —— "
+            << set_memory << " B/entry, " << set_latency
+            << " us/scan; B+tree —— " << tree_memory << " B/entry, "
+            << tree_latency << " us/scan" << std::endl;
+
+  EXPECT_LT(tree_memory, set_memory);
+}
+
+TEST(HotKeyReplicasBenchmark, SkewedGets) {
+  constexpr int kOperations = 100'000;
+  constexpr int kKeys = 10'000;
+  constexpr int kHotKeys = 8;
+
+  std::vector<std::string> keys;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    data.emplace_back(keys.back(), std::string(32, 'a' + i % 26), 0);
+  }
+
+  // 90% обращений к kHotKeys ключам, остальные — к случайным ключам.
+  std::vector<int> picks(kOperations);
+  std::mt19937 rng(3);
+  for (int& pick : picks) {
+    pick = rng() % 10 != 0 ? static_cast<int>(rng() % kHotKeys)
+                           : static_cast<int>(rng() % kKeys);
+  }
+
+  // Каждый поток выполняет kOperations / threads операций: 99% get, 1% set.
+  auto run = [&](int threads, bool replicated) {
+    auto copy = data;
+    ConcurrentKVStorage<std::chrono::steady_clock, SeededHash, 64> storage(
+        copy);
+    if (replicated) {
+      storage.setHotKeyReplication(HotKeyOptions{});
+      while (storage.hotKeyCount() < kHotKeys) {
+        for (int i = 0; i < kHotKeys; ++i) {
+          storage.get(keys[i]);
+        }
+      }
+    }
+
+    std::vector<std::thread> workers;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t] {
+        std::size_t found = 0;
+        int begin = t * (kOperations / threads);
+        for (int i = begin; i < begin + kOperations / threads; ++i) {
+          const std::string& key = keys[picks[i]];
+          if (i % 100 == 0) {
+            storage.set(key, std::string(32, 'z'), 0);
+          } else {
+            found += storage.get(key).has_value();
+          }
+        }
+        EXPECT_GT(found, 0);
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return kOperations /
+           std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  for (int threads : {1, 4}) {
+    // Лучший из нескольких чередующихся замеров.
+    double without = 0;
+    double with = 0;
+    for (int attempt = 0; attempt < 9; ++attempt) {
+      without = std::max(without, run(threads, false));
+      with = std::max(with, run(threads, true));
+    }
+    std::cout << threads << " threads, 90% of gets to " << kHotKeys
+              << " keys: without replicas —— " << without
+              << " ops/ms, with replicas —— " << with << " ops/ms"
+              << std::endl;
+
+    EXPECT_GT(with, without);
+  }
+}
+
+TEST(MissFilterBenchmark, MissLatencyAndFalsePositiveRate) {
+  constexpr int kKeys = 200'000;
+  std::vector<std::string> hits;
+  std::vector<std::string> misses;
+  for (int i = 0; i < kKeys; ++i) {
+    hits.push_back("user:" + std::to_string(i) + ":profile");
+    misses.push_back("user:" + std::to_string(i) + ":missing");
+  }
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> storage(data);
+  for (const auto& key : hits) {
+    storage.set(key, "value", 0);
+  }
+
+  auto measure = [&](const std::vector<std::string>& keys, bool expected) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& key : keys) {
+      EXPECT_EQ(storage.get(key).has_value(), expected);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           keys.size();
+  };
+
+  double miss_without = measure(misses, false);
+  double hit_without = measure(hits, true);
+
+  storage.setMissFilter(BloomFilterOptions{});
+  double miss_with = measure(misses, false);
+  double hit_with = measure(hits, true);
+
+  // Доля ложных срабатываний — на фильтре той же емкости и с тем же
+  // хешем, что фильтр внутри хранилища.
+  BlockedBloomFilter filter(kKeys + kKeys / 2, BloomFilterOptions{});
+  SeededHash hash;
+  for (const auto& key : hits) {
+    filter.insert(hash(key));
+  }
+  int false_positives = 0;
+  for (const auto& key : misses) {
+    false_positives += filter.mayContain(hash(key));
+  }
+
+  std::cout << "200'000 keys, miss filter " << storage.missFilterBytes() / 1'024
+            << " KiB, false positives —— "
+            << 100.0 * false_positives / kKeys << "%" << std::endl;
+  std::cout << "miss get: without filter —— " << miss_without
+            << " ns, with filter —— " << miss_with << " ns; hit get: "
+            << "without filter —— " << hit_without << " ns, with filter —— "
+            << hit_with << " ns" << std::endl;
+}
+
+TEST(AccessStatsBenchmark, SketchOverhead) {
+  constexpr int kKeys = 200'000;
+  std::vector<std::string> keys;
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+  }
+
+  auto measure = [&](std::optional<AccessStatsOptions> options) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    KVStorage<std::chrono::steady_clock> storage(data);
+    storage.setAccessStats(options);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& key : keys) {
+      storage.set(key, "value", 0);
+    }
+    auto middle = std::chrono::high_resolution_clock::now();
+    for (int round = 0; round < 5; ++round) {
+      for (const auto& key : keys) {
+        EXPECT_TRUE(storage.get(key).has_value());
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    if (options.has_value()) {
+      EXPECT_NEAR(storage.accessStats()->distinct_keys, kKeys, kKeys / 20);
+    }
+    return std::make_pair(
+        std::chrono::duration<double, std::nano>(middle - start).count() /
+            kKeys,
+        std::chrono::duration<double, std::nano>(end - middle).count() /
+            (5 * kKeys));
+  };
+
+  auto [set_without, get_without] = measure(std::nullopt);
+  auto [set_with, get_with] = measure(AccessStatsOptions{});
+
+  // Сами скетчи без поиска в хранилище: разница выше тонет в шуме get.
+  SeededHash hash;
+  std::vector<uint64_t> hashes;
+  for (const auto& key : keys) {
+    hashes.push_back(hash(key));
+  }
+  AccessStats<std::string> stats(AccessStatsOptions{});
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int round = 0; round < 5; ++round) {
+    for (int i = 0; i < kKeys; ++i) {
+      stats.record(hashes[i], [&] { return keys[i]; });
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  double record =
+      std::chrono::duration<double, std::nano>(end - start).count() /
+      (5 * kKeys);
+
+  std::cout << "200'000 keys: set without stats —— " << set_without
+            << " ns, with stats —— " << set_with
+            << " ns; get without stats —— " << get_without
+            << " ns, with stats —— " << get_with << " ns" << std::endl;
+  std::cout << "AccessStats::record, sample_rate 16 —— " << record << " ns"
+            << std::endl;
+  EXPECT_LT(record, 50);
+}
+
+TEST(FeaturesBenchmark, AccessMetadataGet) {
+  constexpr int kKeys = 200'000;
+  std::vector<std::string> keys;
+  keys.reserve(kKeys);
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("key" + std::to_string(i));
+  }
+  std::vector<std::string> order = keys;
+  std::shuffle(order.begin(), order.end(), std::mt19937(11));
+
+  auto measure = [&]<typename Storage>(std::type_identity<Storage>) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    std::size_t before = heapInUse();
+    Storage storage(data);
+    for (const auto& key : keys) {
+      storage.set(key, "value", 0);
+    }
+    std::size_t memory = (heapInUse() - before) / kKeys;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int round = 0; round < 5; ++round) {
+      for (const auto& key : order) {
+        EXPECT_TRUE(storage.get(key).has_value());
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double latency =
+        std::chrono::duration<double, std::nano>(end - start).count() /
+        (5 * kKeys);
+    return std::make_pair(memory, latency);
+  };
+
+  // Первое заполнение растит кучу и занимает в ней меньше, чем
+  // последующие, поэтому его результат отбрасываем.
+  measure(std::type_identity<KVStorage<std::chrono::steady_clock>>());
+  auto [plain_memory, plain_latency] =
+      measure(std::type_identity<KVStorage<std::chrono::steady_clock>>());
+  auto [access_memory, access_latency] = measure(
+      std::type_identity<KVStorage<
+          std::chrono::steady_clock,
+          Features<Sorted::Yes, Ttl::Yes, Access::Yes>>>());
+
+  std::cout << "200'000 keys, random get: without access metadata —— "
+            << plain_memory << " B/entry, " << plain_latency
+            << " ns/get; with access metadata —— " << access_memory
+            << " B/entry, " << access_latency << " ns/get" << std::endl;
+
+  EXPECT_EQ(access_memory, plain_memory);
+}
+
+TEST(FeaturesBenchmark, NamespaceQuotas) {
+  constexpr int kTenants = 100;
+  constexpr int kKeys = 200'000;
+  std::mt19937 random(5);
+  std::vector<std::pair<int, std::string>> writes;
+  writes.reserve(kKeys);
+  for (int i = 0; i < kKeys; ++i) {
+    int tenant = static_cast<int>(random() % kTenants);
+    writes.emplace_back(tenant, "tenant" + std::to_string(tenant) + "/key" +
+                                    std::to_string(random() % kKeys));
+  }
+
+  auto measure = [&]<typename Storage>(std::type_identity<Storage>,
+                                       bool namespaces) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    std::size_t before = heapInUse();
+    Storage storage(data);
+    std::vector<NamespaceId> ids;
+    if constexpr (requires { storage.createNamespace(""); }) {
+      for (int tenant = 0; tenant < kTenants && namespaces; ++tenant) {
+        // Квота меньше среднего числа ключей тенанта, чтобы часть set
+        // вытесняла записи.
+        ids.push_back(storage.createNamespace(
+            "tenant" + std::to_string(tenant) + "/",
+            {.max_entries = kKeys / kTenants / 2}));
+      }
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& [tenant, key] : writes) {
+      if constexpr (requires { storage.createNamespace(""); }) {
+        if (namespaces) {
+          storage.set(ids[tenant], key, "value", 0);
+          continue;
+        }
+      }
+      storage.set(key, "value", 0);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::size_t entries = storage.getManySorted("", kKeys).size();
+    std::size_t memory = (heapInUse() - before) / entries;
+    double latency =
+        std::chrono::duration<double, std::nano>(end - start).count() /
+        kKeys;
+    return std::make_tuple(entries, memory, latency);
+  };
+
+  using Plain = KVStorage<std::chrono::steady_clock>;
+  using WithNamespaces =
+      KVStorage<std::chrono::steady_clock,
+                Features<Sorted::Yes, Ttl::Yes, Access::No, Namespaces::Yes>>;
+  // Первое заполнение кучи отбрасываем (см. AccessMetadataGet).
+  measure(std::type_identity<Plain>(), false);
+  auto [plain_entries, plain_memory, plain_latency] =
+      measure(std::type_identity<Plain>(), false);
+  auto [default_entries, default_memory, default_latency] =
+      measure(std::type_identity<WithNamespaces>(), false);
+  auto [quota_entries, quota_memory, quota_latency] =
+      measure(std::type_identity<WithNamespaces>(), true);
+
+  std::cout << "200'000 set over 100 tenants: without namespaces —— "
+            << plain_latency << " ns/set, " << plain_memory
+            << " B/entry; Namespaces::Yes, default namespace —— "
+            << default_latency << " ns/set, " << default_memory
+            << " B/entry; 100 namespaces with quotas —— " << quota_latency
+            << " ns/set, " << quota_entries << " entries left" << std::endl;
+
+  EXPECT_EQ(default_entries, plain_entries);
+  EXPECT_LE(quota_entries, kKeys / 2);
+}
+
+TEST(FeaturesBenchmark, DropNamespace) {
+  constexpr int kKeys = 500'000;
+  using Storage =
+      KVStorage<std::chrono::steady_clock,
+                Features<Sorted::Yes, Ttl::Yes, Access::No, Namespaces::Yes>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Storage storage(data);
+  NamespaceId tenant = storage.createNamespace("tenant/");
+  NamespaceId other = storage.createNamespace("other/");
+  for (int i = 0; i < kKeys; ++i) {
+    storage.set(tenant, "tenant/key" + std::to_string(i), "value", 0);
+  }
+  storage.set(other, "other/key", "value", 0);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  storage.dropNamespace(tenant);
+  auto dropped = std::chrono::high_resolution_clock::now();
+  EXPECT_FALSE(storage.get("tenant/key1").has_value());
+  EXPECT_EQ(storage.getManySorted("", 1).front().first, "other/key");
+
+  std::size_t steps = 0;
+  auto reap_start = std::chrono::high_resolution_clock::now();
+  while (storage.reapDropped(1'024)) {
+    ++steps;
+  }
+  auto reap_end = std::chrono::high_resolution_clock::now();
+  EXPECT_EQ(storage.namespaceUsage(other).entries, 1);
+
+  // Для сравнения — удаление тех же ключей по одному.
+  for (int i = 0; i < kKeys; ++i) {
+    storage.set(tenant, "tenant/key" + std::to_string(i), "value", 0);
+  }
+  auto remove_start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < kKeys; ++i) {
+    storage.remove("tenant/key" + std::to_string(i));
+  }
+  auto remove_end = std::chrono::high_resolution_clock::now();
+
+  auto micros = [](auto duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+  };
+  std::cout << "500'000-key namespace: dropNamespace —— "
+            << micros(dropped - start) << " us; reapDropped(1'024) —— "
+            << micros(reap_end - reap_start) / (steps + 1)
+            << " us/step; remove by key —— "
+            << micros(remove_end - remove_start) / 1'000 << " ms" << std::endl;
+}
+
+TEST(SecondaryIndexBenchmark, WriteAmplification) {
+  constexpr int kKeys = 20'000;
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+  for (int i = 0; i < kKeys; ++i) {
+    keys.push_back("user" + std::to_string(i));
+    values.push_back("{\"status\":\"s" + std::to_string(i % 7) +
+                     "\",\"city\":\"c" + std::to_string(i % 1'000) + "\"}");
+  }
+  // Значение поля JSON-подобной строки без полноценного разбора.
+  auto field = [](std::string name) {
+    return [name = "\"" + name + "\":\""](const std::string& value) {
+      std::size_t begin = value.find(name);
+      if (begin == std::string::npos) {
+        return std::optional<std::string>();
+      }
+      begin += name.size();
+      return std::make_optional(
+          value.substr(begin, value.find('"', begin) - begin));
+    };
+  };
+
+  auto measure = [&](int indexes) {
+    std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+    std::size_t before = heapInUse();
+    KVStorage<std::chrono::steady_clock> storage(data);
+    if (indexes >= 1) {
+      storage.addIndex("status", field("status"));
+    }
+    if (indexes >= 2) {
+      storage.addIndex("city", field("city"));
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < kKeys; ++i) {
+      storage.set(keys[i], values[i], 0);
+    }
+    auto inserted = std::chrono::high_resolution_clock::now();
+    // Перезапись вычисляет атрибуты старого и нового значения.
+    for (int i = 0; i < kKeys; ++i) {
+      storage.set(keys[i], values[(i + 1) % kKeys], 0);
+    }
+    auto overwritten = std::chrono::high_resolution_clock::now();
+    std::size_t memory = (heapInUse() - before) / kKeys;
+
+    if (indexes >= 1) {
+      EXPECT_EQ(storage.queryIndex("status", "s3", "s3").size(),
+                (kKeys + 3) / 7);
+    }
+    auto nanos = [&](auto duration) {
+      return std::chrono::duration<double, std::nano>(duration).count() /
+             kKeys;
+    };
+    return std::to_string(indexes) + " indexes —— insert " +
+           std::to_string(nanos(inserted - start)) + " ns/set, overwrite " +
+           std::to_string(nanos(overwritten - inserted)) + " ns/set, " +
+           std::to_string(memory) + " B/entry";
+  };
+
+  // Первое заполнение кучи отбрасываем (см. AccessMetadataGet).
+  measure(0);
+  std::cout << "20'000 keys, secondary index maintenance:" << std::endl;
+  for (int indexes = 0; indexes <= 2; ++indexes) {
+    std::cout << measure(indexes) << std::endl;
+  }
+}
+
+TEST(RangeAggregatesBenchmark, CountWithoutMaterialization) {
+  constexpr int kKeys = 200'000;
+  constexpr int kQueries = 200;
+  using Storage = KVStorage<std::chrono::steady_clock,
+                            Features<Sorted::BPlusTree, Ttl::Yes>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Storage storage(data);
+  std::mt19937 rng(13);
+  for (int i = 0; i < kKeys; ++i) {
+    storage.set("user:" + std::to_string(rng() % 1'000'000),
+                std::string(100, 'v'), 0);
+  }
+  // Диапазоны ключей с общим двузначным префиксом, примерно по 2'200.
+  std::vector<std::pair<std::string, std::string>> ranges;
+  for (int i = 0; i < kQueries; ++i) {
+    int begin = 10 + static_cast<int>(rng() % 89);
+    ranges.emplace_back("user:" + std::to_string(begin),
+                        "user:" + std::to_string(begin + 1));
+  }
+
+  auto micros = [](auto start, auto end) {
+    return std::chrono::duration<double, std::micro>(end - start).count() /
+           kQueries;
+  };
+
+  std::size_t total = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto& [begin, end] : ranges) {
+    for (const auto& [key, value] : storage.getManySorted(begin, 5'000)) {
+      if (!(key < end)) {
+        break;
+      }
+      ++total;
+    }
+  }
+  auto scanned = std::chrono::high_resolution_clock::now();
+  std::size_t counted = 0;
+  for (const auto& [begin, end] : ranges) {
+    counted += storage.countRange(begin, end);
+  }
+  auto counted_end = std::chrono::high_resolution_clock::now();
+  std::size_t bytes = 0;
+  for (const auto& [begin, end] : ranges) {
+    bytes += storage.bytesInRange(begin, end);
+  }
+  auto bytes_end = std::chrono::high_resolution_clock::now();
+  std::size_t pages = 0;
+  for (int i = 0; i < kQueries; ++i) {
+    pages += storage.select(storage.rank(ranges[i].first) + 100).has_value();
+  }
+  auto pages_end = std::chrono::high_resolution_clock::now();
+
+  EXPECT_EQ(counted, total);
+  EXPECT_GT(bytes, 100 * total);
+  EXPECT_EQ(pages, kQueries);
+  std::cout << "200'000 keys, ranges of ~" << total / kQueries
+            << " keys: getManySorted().size() —— " << micros(start, scanned)
+            << " us; countRange —— " << micros(scanned, counted_end)
+            << " us; bytesInRange —— " << micros(counted_end, bytes_end)
+            << " us; rank + select —— " << micros(bytes_end, pages_end)
+            << " us" << std::endl;
+}
+
+TEST(SampleBenchmark, SampleVersusFullScan) {
+  constexpr int kKeys = 200'000;
+  constexpr int kRounds = 10'000;
+  constexpr std::size_t kSampleSize = 16;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> storage(data);
+  std::mt19937_64 rng(17);
+  std::size_t exact_bytes = 0;
+  for (int i = 0; i < kKeys; ++i) {
+    std::string key = "user:" + std::to_string(i);
+    std::size_t size = rng() % 1'000;
+    exact_bytes += key.size() + size;
+    storage.set(std::move(key), std::string(size, 'v'),
+                static_cast<uint32_t>(60 + rng() % 3'600));
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  std::size_t sampled = 0;
+  std::size_t sampled_bytes = 0;
+  for (int i = 0; i < kRounds; ++i) {
+    for (const auto& item : storage.sample(kSampleSize, rng)) {
+      ++sampled;
+      sampled_bytes += item.bytes;
+    }
+  }
+  auto sampled_end = std::chrono::high_resolution_clock::now();
+  std::size_t scanned = storage.getManySorted("", kKeys).size();
+  auto scanned_end = std::chrono::high_resolution_clock::now();
+
+  EXPECT_EQ(sampled, kRounds * kSampleSize);
+  EXPECT_EQ(scanned, kKeys);
+  double exact_mean = static_cast<double>(exact_bytes) / kKeys;
+  double sampled_mean = static_cast<double>(sampled_bytes) / sampled;
+  EXPECT_NEAR(sampled_mean, exact_mean, exact_mean * 0.02);
+  std::cout << "200'000 keys: sample(16) —— "
+            << std::chrono::duration<double, std::micro>(sampled_end - start)
+                       .count() /
+                   kRounds
+            << " us; full scan —— "
+            << std::chrono::duration<double, std::milli>(scanned_end -
+                                                         sampled_end)
+                   .count()
+            << " ms; mean entry bytes sampled / exact —— " << sampled_mean
+            << " / " << exact_mean << std::endl;
+}
+
+TEST(StreamBenchmark, ExportImportVersusSetLoop) {
+  constexpr int kKeys = 200'000;
+  using Storage = KVStorage<std::chrono::steady_clock,
+                            Features<Sorted::BPlusTree, Ttl::Yes>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Storage source(data);
+  std::mt19937 rng(31);
+  for (int i = 0; i < kKeys; ++i) {
+    source.set("user:" + std::to_string(rng()), std::string(100, 'v'),
+               i % 3 == 0 ? 3'600 : 0);
+  }
+  auto millis = [](auto start, auto end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  // Прежний способ: выгрузка getManySorted и set на каждую запись. TTL
+  // getManySorted не отдает; здесь они выставляются той же долей записей.
+  auto start = std::chrono::high_resolution_clock::now();
+  auto dump = source.getManySorted("", kKeys);
+  Storage by_set(data);
+  int i = 0;
+  for (auto& [key, value] : dump) {
+    by_set.set(std::move(key), std::move(value), i++ % 3 == 0 ? 3'600 : 0);
+  }
+  auto by_set_end = std::chrono::high_resolution_clock::now();
+
+  std::string stream;
+  StringStreamWriter writer(stream);
+  std::size_t exported = source.exportStream(writer);
+  auto exported_end = std::chrono::high_resolution_clock::now();
+  Storage imported(data);
+  StringStreamReader reader(stream);
+  std::size_t loaded = imported.importStream(reader);
+  auto imported_end = std::chrono::high_resolution_clock::now();
+
+  EXPECT_EQ(exported, source.countRange("", "~"));
+  EXPECT_EQ(loaded, exported);
+  EXPECT_EQ(imported.countRange("", "~"), by_set.countRange("", "~"));
+  std::cout << exported << " keys: getManySorted + set loop —— "
+            << millis(start, by_set_end) << " ms; exportStream —— "
+            << millis(by_set_end, exported_end) << " ms ("
+            << stream.size() / 1'000'000.0 << " MB); importStream —— "
+            << millis(exported_end, imported_end) << " ms" << std::endl;
+}
@@ -1,7 +1,12 @@
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <map>
 #include <memory>
+#include <random>
+#include <thread>
 
+#include "concurrent_kv_storage.hpp"
 #include "kv_storage.hpp"
 
 class ManualClock {
@@ -107,3 +112,445 @@ TEST_F(KVStorageTimeTest, GetManySortedSkipsExpired) {
     EXPECT_NE(key, "short");
   }
 }
+
+TEST(InternedKeysTimeTest, RemoveExpiredEntry) {
+  ManualClock clock;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"org/1/short", "value", 10}, {"org/1/infinite", "value", 0}};
+  KVStorage<ManualClock, std::string, std::string,
+            KVTraits<std::string, std::string, SeededHash,
+                     InternedPrefixKeys<>>>
+      storage(data, clock);
+
+  clock.advance(std::chrono::seconds(11));
+
+  auto expired = storage.removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->first, "org/1/short");
+  EXPECT_FALSE(storage.removeOneExpiredEntry().has_value());
+  EXPECT_TRUE(storage.get("org/1/infinite").has_value());
+}
+
+TEST_F(KVStorageTimeTest, RemoveExpiredCompressedEntry) {
+  storage_->setCompression(CompressionOptions{.min_size = 64});
+  std::string value(1'000, 'z');
+  storage_->set("compressed", value, 5);
+
+  clock_.advance(std::chrono::seconds(6));
+
+  auto expired = storage_->removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->first, "compressed");
+  EXPECT_EQ(expired->second, value);
+}
+
+TEST(GenericTypesTimeTest, RemoveExpiredIntegerEntry) {
+  ManualClock clock;
+  std::vector<std::tuple<uint64_t, double, uint32_t>> data = {
+      {1, 0.5, 10}, {2, 1.5, 0}};
+  KVStorage<ManualClock, uint64_t, double> storage(data, clock);
+
+  clock.advance(std::chrono::seconds(11));
+
+  EXPECT_FALSE(storage.get(1).has_value());
+  auto expired = storage.removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->first, 1);
+  EXPECT_EQ(expired->second, 0.5);
+  EXPECT_EQ(*storage.get(2), 1.5);
+}
+
+TEST(FeaturesTimeTest, TtlWithoutSortedIndex) {
+  ManualClock clock;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"short", "value", 10}, {"infinite", "value", 0}};
+  KVStorage<ManualClock, Features<Sorted::No, Ttl::Yes>> storage(data, clock);
+
+  storage.set("short", "updated", 20);
+  clock.advance(std::chrono::seconds(11));
+  EXPECT_EQ(*storage.get("short"), "updated");
+
+  clock.advance(std::chrono::seconds(10));
+  EXPECT_FALSE(storage.get("short").has_value());
+
+  auto expired = storage.removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->first, "short");
+  EXPECT_FALSE(storage.removeOneExpiredEntry().has_value());
+  EXPECT_TRUE(storage.remove("infinite"));
+}
+
+TEST(BPlusTreeTimeTest, RemoveExpiredEntry) {
+  ManualClock clock;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  for (int i = 0; i < 1'000; ++i) {
+    data.emplace_back("key" + std::to_string(i), "value", i % 2 == 0 ? 10 : 0);
+  }
+  KVStorage<ManualClock, Features<Sorted::BPlusTree, Ttl::Yes>> storage(data,
+                                                                        clock);
+
+  clock.advance(std::chrono::seconds(11));
+
+  int removed = 0;
+  while (storage.removeOneExpiredEntry().has_value()) {
+    ++removed;
+  }
+  EXPECT_EQ(removed, 500);
+
+  auto sorted = storage.getManySorted("", 1'000);
+  ASSERT_EQ(sorted.size(), 500);
+  EXPECT_EQ(sorted.front().first, "key1");
+}
+
+TEST_F(KVStorageTimeTest, TombstoneExpiration) {
+  storage_->setAbsent("missing", 10);
+  storage_->setAbsent("long", 20);
+  EXPECT_EQ(storage_->lookup("missing").first, KeyState::kKnownAbsent);
+  EXPECT_EQ(storage_->lookup("long").first, KeyState::kKnownAbsent);
+  EXPECT_FALSE(storage_->get("long").has_value());
+  EXPECT_EQ(storage_->lookup("unknown").first, KeyState::kAbsent);
+  EXPECT_EQ(storage_->lookup("infinite"),
+            std::make_pair(KeyState::kPresent,
+                           std::optional<std::string>("value")));
+  EXPECT_EQ(storage_->tombstoneCount(), 2);
+
+  clock_.advance(std::chrono::seconds(10));
+  EXPECT_EQ(storage_->lookup("missing").first, KeyState::kAbsent);
+  EXPECT_EQ(storage_->lookup("long").first, KeyState::kKnownAbsent);
+
+  // Протухшие tombstone освобождаются вместе с протухшими записями, но не
+  // возвращаются.
+  auto expired = storage_->removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->first, "short");
+  EXPECT_EQ(storage_->tombstoneCount(), 1);
+
+  clock_.advance(std::chrono::seconds(10));
+  EXPECT_FALSE(storage_->removeOneExpiredEntry().has_value());
+  EXPECT_EQ(storage_->tombstoneCount(), 0);
+  EXPECT_EQ(storage_->lookup("long").first, KeyState::kAbsent);
+}
+
+TEST_F(KVStorageTimeTest, TombstoneTtlIsUpdated) {
+  storage_->setAbsent("missing", 10);
+  storage_->setAbsent("missing", 100);
+  clock_.advance(std::chrono::seconds(50));
+  EXPECT_EQ(storage_->lookup("missing").first, KeyState::kKnownAbsent);
+
+  storage_->setAbsent("missing", 0);
+  clock_.advance(std::chrono::seconds(1'000));
+  EXPECT_EQ(storage_->lookup("missing").first, KeyState::kKnownAbsent);
+  while (storage_->removeOneExpiredEntry().has_value()) {
+  }
+  EXPECT_EQ(storage_->tombstoneCount(), 1);
+}
+
+// Как ManualClock, но время можно двигать во время работы других потоков.
+class AtomicManualClock {
+ public:
+  using time_point = std::chrono::steady_clock::time_point;
+  using duration = std::chrono::seconds;
+
+  static time_point now() { return time_.load(); }
+
+  static void advance(std::chrono::seconds seconds) {
+    time_point expected = time_.load();
+    while (!time_.compare_exchange_weak(expected, expected + seconds)) {
+    }
+  }
+
+ private:
+  inline static std::atomic<time_point> time_{
+      std::chrono::steady_clock::now()};
+};
+
+TEST(ConcurrentKVStorageTimeTest, MixedOperationsWithConcurrentExpiry) {
+  constexpr int kWriters = 3;
+  constexpr int kKeys = 3'000;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  ConcurrentKVStorage<AtomicManualClock> storage(data);
+
+  // Нечетные ключи живут 1 секунду, каждый пятый удаляется. Часы идут, пока
+  // писатели работают, а отдельные потоки удаляют протухшие записи.
+  std::atomic<bool> done{false};
+  std::atomic<int> expired{0};
+  std::vector<std::thread> writers;
+  for (int t = 0; t < kWriters; ++t) {
+    writers.emplace_back([&, t] {
+      for (int i = 0; i < kKeys; ++i) {
+        std::string key = std::to_string(t) + "-" + std::to_string(i);
+        storage.set(key, "v" + key, i % 2);
+        if (i % 5 == 0) {
+          storage.remove(key);
+        }
+      }
+    });
+  }
+  std::vector<std::thread> helpers;
+  helpers.emplace_back([&] {
+    while (!done.load()) {
+      AtomicManualClock::advance(std::chrono::seconds(1));
+      std::this_thread::yield();
+    }
+  });
+  for (int e = 0; e < 2; ++e) {
+    helpers.emplace_back([&] {
+      while (!done.load()) {
+        if (auto entry = storage.removeOneExpiredEntry()) {
+          EXPECT_EQ(entry->second, "v" + entry->first);
+          EXPECT_EQ(std::stoi(entry->first.substr(2)) % 2, 1);
+          expired.fetch_add(1);
+        }
+      }
+    });
+  }
+  helpers.emplace_back([&] {
+    while (!done.load()) {
+      for (const auto& [key, value] : storage.getManySorted("1-", 10)) {
+        EXPECT_EQ(value, "v" + key);
+      }
+    }
+  });
+
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  done.store(true);
+  for (auto& helper : helpers) {
+    helper.join();
+  }
+
+  AtomicManualClock::advance(std::chrono::seconds(2));
+  while (storage.removeOneExpiredEntry().has_value()) {
+    expired.fetch_add(1);
+  }
+
+  int expected_expired = 0;
+  for (int t = 0; t < kWriters; ++t) {
+    for (int i = 0; i < kKeys; ++i) {
+      std::string key = std::to_string(t) + "-" + std::to_string(i);
+      bool alive = i % 2 == 0 && i % 5 != 0;
+      EXPECT_EQ(storage.get(key).has_value(), alive);
+      expected_expired += i % 2 == 1 && i % 5 != 0;
+    }
+  }
+  // Удаляемая запись могла протухнуть и быть удаленной раньше remove.
+  EXPECT_GE(expired.load(), expected_expired);
+  EXPECT_LE(expired.load(), kWriters * kKeys / 2);
+  EXPECT_EQ(storage.size(), storage.getManySorted("", 100'000).size());
+}
+
+TEST(ConcurrentKVStorageTimeTest, InlineValueExpiration) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"small", "value", 10}, {"large", std::string(100, 'x'), 10}};
+  ConcurrentKVStorage<AtomicManualClock, SeededHash, 64> storage(data);
+
+  EXPECT_EQ(storage.get("small"), "value");
+  storage.set("small", "new", 20);
+  AtomicManualClock::advance(std::chrono::seconds(10));
+
+  EXPECT_EQ(storage.get("small"), "new");
+  EXPECT_FALSE(storage.get("large").has_value());
+  auto expired = storage.removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->first, "large");
+  EXPECT_FALSE(storage.removeOneExpiredEntry().has_value());
+
+  AtomicManualClock::advance(std::chrono::seconds(10));
+  EXPECT_FALSE(storage.get("small").has_value());
+  expired = storage.removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(*expired, std::make_pair(std::string("small"), std::string("new")));
+}
+
+TEST(HotKeyReplicasTimeTest, HotKeyExpires) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"hot", "value", 10}};
+  ConcurrentKVStorage<AtomicManualClock> storage(data);
+  storage.setHotKeyReplication(
+      HotKeyOptions{.replicas = 1, .sample_rate = 1, .threshold = 2});
+
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(storage.get("hot"), "value");
+  }
+  EXPECT_EQ(storage.hotKeyCount(), 1);
+
+  AtomicManualClock::advance(std::chrono::seconds(10));
+  EXPECT_FALSE(storage.get("hot").has_value());
+  auto expired = storage.removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->second, "value");
+  EXPECT_EQ(storage.hotKeyCount(), 0);
+}
+
+TEST(ReadThroughTimeTest, RefreshAheadBeforeExpiry) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  ConcurrentKVStorage<AtomicManualClock> storage(data);
+  storage.setRefreshAhead(0.5);
+  int loads = 0;
+  auto loader = [&](std::string_view) -> std::optional<std::string> {
+    return "value" + std::to_string(++loads);
+  };
+
+  EXPECT_EQ(storage.getOrLoad("key", loader, 10), "value1");
+  AtomicManualClock::advance(std::chrono::seconds(4));
+  EXPECT_EQ(storage.getOrLoad("key", loader, 10), "value1");
+  EXPECT_EQ(loads, 1);
+
+  // До протухания осталось не больше половины ttl: вызов отдает текущее
+  // значение и перезагружает его с новым временем жизни.
+  AtomicManualClock::advance(std::chrono::seconds(2));
+  EXPECT_EQ(storage.getOrLoad("key", loader, 10), "value1");
+  EXPECT_EQ(loads, 2);
+  EXPECT_EQ(storage.get("key"), "value2");
+
+  AtomicManualClock::advance(std::chrono::seconds(6));
+  EXPECT_EQ(storage.get("key"), "value2");
+  AtomicManualClock::advance(std::chrono::seconds(4));
+  EXPECT_EQ(storage.get("key"), std::nullopt);
+  EXPECT_EQ(storage.getOrLoad("key", loader, 10), "value3");
+}
+
+TEST(AccessMetadataTimeTest, IdleKeysAndFrequency) {
+  ManualClock clock;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"hot", "value", 0}, {"cold", "value", 0}, {"expiring", "value", 30}};
+  KVStorage<ManualClock, Features<Sorted::Yes, Ttl::Yes, Access::Yes>>
+      storage(data, clock);
+
+  for (int i = 0; i < 1'000; ++i) {
+    storage.get("hot");
+  }
+  // Логарифмический счетчик: ~log2(1'000) для 1'000 обращений.
+  EXPECT_GE(storage.accessInfo("hot")->frequency, 6);
+  EXPECT_LE(storage.accessInfo("hot")->frequency, 12);
+  EXPECT_EQ(storage.accessInfo("cold")->frequency, 1);
+
+  clock.advance(std::chrono::seconds(100));
+  storage.get("hot");
+  storage.getManySorted("", 10);
+  EXPECT_EQ(storage.accessInfo("hot")->idle_seconds, 0);
+  EXPECT_EQ(storage.accessInfo("cold")->idle_seconds, 100);
+  EXPECT_EQ(storage.accessInfo("cold")->frequency, 0);
+  EXPECT_FALSE(storage.accessInfo("expiring").has_value());
+
+  auto idle = storage.idleKeys(50);
+  ASSERT_EQ(idle.size(), 1);
+  EXPECT_EQ(idle[0].first, "cold");
+  EXPECT_EQ(idle[0].second.idle_seconds, 100);
+
+  // set тоже считается обращением.
+  storage.set("cold", "value", 0);
+  EXPECT_TRUE(storage.idleKeys(50).empty());
+  EXPECT_EQ(storage.idleKeys(0).size(), 2);
+
+  // Без обращений счетчик затухает на 1 в минуту.
+  uint8_t frequency = storage.accessInfo("hot")->frequency;
+  clock.advance(std::chrono::seconds(180));
+  EXPECT_EQ(storage.accessInfo("hot")->frequency, frequency - 3);
+}
+
+TEST(AccessMetadataTimeTest, WithoutTtl) {
+  ManualClock clock;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"key", "value", 0}};
+  KVStorage<ManualClock, Features<Sorted::No, Ttl::No, Access::Yes>> storage(
+      data, clock);
+
+  clock.advance(std::chrono::seconds(10));
+  EXPECT_EQ(storage.idleKeys(10).size(), 1);
+  storage.get("key");
+  EXPECT_TRUE(storage.idleKeys(10).empty());
+  EXPECT_EQ(storage.accessInfo("key")->idle_seconds, 0);
+}
+
+TEST(NamespacesTimeTest, ExpiredDroppedEntriesAreNotReturned) {
+  ManualClock clock;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<ManualClock,
+            Features<Sorted::Yes, Ttl::Yes, Access::No, Namespaces::Yes>>
+      storage(data, clock);
+  NamespaceId a = storage.createNamespace("a/");
+
+  storage.set(a, "a/1", "value", 5);
+  storage.set(a, "a/2", "value", 5);
+  storage.set("b", "value", 10);
+  storage.dropNamespace(a);
+  storage.set(a, "a/3", "value", 15);
+
+  clock.advance(std::chrono::seconds(20));
+  auto expired = storage.removeOneExpiredEntry();
+  ASSERT_TRUE(expired.has_value());
+  EXPECT_EQ(expired->first, "b");
+  EXPECT_EQ(storage.droppedEntries(), 0);
+  EXPECT_EQ(storage.removeOneExpiredEntry()->first, "a/3");
+  EXPECT_FALSE(storage.removeOneExpiredEntry().has_value());
+  EXPECT_EQ(storage.namespaceUsage(a).entries, 0);
+}
+
+TEST_F(KVStorageTimeTest, SecondaryIndexSkipsAndDropsExpired) {
+  storage_->addIndex("prefix", [](const std::string& value) {
+    return std::make_optional(value.substr(0, 1));
+  });
+  storage_->set("a", "x1", 5);
+  storage_->set("b", "x2", 0);
+
+  clock_.advance(std::chrono::seconds(5));
+  std::vector<std::pair<std::string, std::string>> expected = {{"b", "x2"}};
+  EXPECT_EQ(storage_->queryIndex("prefix", "x", "x"), expected);
+
+  // removeOneExpiredEntry удаляет запись и из вторичного индекса, поэтому
+  // новое значение ключа не встречается в индексе дважды.
+  ASSERT_EQ(storage_->removeOneExpiredEntry()->first, "a");
+  storage_->set("a", "x3", 0);
+  EXPECT_EQ(storage_->queryIndex("prefix", "x", "x").size(), 2);
+}
+
+TEST_F(KVStorageTimeTest, SampleSkipsExpired) {
+  clock_.advance(std::chrono::seconds(4));
+  std::mt19937_64 rng(1);
+  std::map<std::string, uint32_t> ttls;
+  for (const auto& item : storage_->sample(300, rng)) {
+    ttls[item.key] = item.ttl;
+  }
+  std::map<std::string, uint32_t> expected = {
+      {"infinite", 0}, {"short", 6}, {"long", 996}};
+  EXPECT_EQ(ttls, expected);
+
+  clock_.advance(std::chrono::seconds(6));
+  for (const auto& item : storage_->sample(300, rng)) {
+    EXPECT_NE(item.key, "short");
+  }
+
+  // Когда живых записей не осталось, выборка конечна и пуста.
+  storage_->remove("infinite");
+  clock_.advance(std::chrono::seconds(1'000));
+  EXPECT_TRUE(storage_->sample(10, rng).empty());
+}
+
+TEST_F(KVStorageTimeTest, StreamKeepsAbsoluteExpiry) {
+  clock_.advance(std::chrono::seconds(4));
+  std::string stream;
+  StringStreamWriter writer(stream);
+  EXPECT_EQ(storage_->exportStream(writer), 3);
+
+  // Время протухания пишется по system_clock, поэтому копия протухает
+  // тогда же, когда оригинал, с точностью до миллисекунд.
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<ManualClock> copy(data, clock_);
+  StringStreamReader reader(stream);
+  EXPECT_EQ(copy.importStream(reader), 3);
+
+  clock_.advance(std::chrono::seconds(5));
+  EXPECT_TRUE(copy.get("short").has_value());
+  clock_.advance(std::chrono::seconds(2));
+  EXPECT_FALSE(copy.get("short").has_value());
+  EXPECT_TRUE(copy.get("long").has_value());
+  EXPECT_TRUE(copy.get("infinite").has_value());
+  EXPECT_EQ(copy.removeOneExpiredEntry()->first, "short");
+
+  // Протухшие к моменту экспорта записи в поток не попадают.
+  std::string later;
+  StringStreamWriter later_writer(later);
+  EXPECT_EQ(storage_->exportStream(later_writer), 2);
+}
@@ -1,7 +1,17 @@
 #include <gtest/gtest.h>
 
+#include <array>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
+#include "concurrent_kv_storage.hpp"
+#include "concurrent_skip_list.hpp"
 #include "kv_storage.hpp"
 
 class KVStorageUnitTest : public testing::Test {
@@ -114,3 +124,1745 @@ TEST_F(KVStorageUnitTest, Empty) {
 
   EXPECT_FALSE(storage_->removeOneExpiredEntry().has_value());
 }
+
+TEST_F(KVStorageUnitTest, GrowthKeepsAllEntries) {
+  for (int i = 0; i < 10'000; ++i) {
+    storage_->set("grow" + std::to_string(i), std::to_string(i), 0);
+  }
+
+  for (int i = 0; i < 10'000; i += 2) {
+    EXPECT_TRUE(storage_->remove("grow" + std::to_string(i)));
+  }
+
+  for (int i = 0; i < 10'000; ++i) {
+    auto value = storage_->get("grow" + std::to_string(i));
+    if (i % 2 == 0) {
+      EXPECT_FALSE(value.has_value());
+    } else {
+      ASSERT_TRUE(value.has_value());
+      EXPECT_EQ(*value, std::to_string(i));
+    }
+  }
+
+  EXPECT_EQ(storage_->getManySorted("", 20'000).size(), 5'003);
+}
+
+TEST_F(KVStorageUnitTest, ShrinkToFit) {
+  for (int i = 0; i < 10'000; ++i) {
+    storage_->set("tmp" + std::to_string(i), "value", 0);
+  }
+  for (int i = 0; i < 10'000; ++i) {
+    storage_->remove("tmp" + std::to_string(i));
+  }
+
+  std::size_t buckets_before = storage_->bucketCount();
+
+  storage_->shrinkToFit();
+  while (storage_->rehashStep(16)) {
+  }
+
+  EXPECT_LT(storage_->bucketCount(), buckets_before);
+  EXPECT_EQ(*storage_->get("key1"), "value1");
+  EXPECT_EQ(*storage_->get("key3"), "value3");
+}
+
+TEST_F(KVStorageUnitTest, ReserveAndLoadFactor) {
+  storage_->setMaxLoadFactor(0.5f);
+  storage_->reserve(1'000);
+  while (storage_->rehashStep(16)) {
+  }
+
+  EXPECT_GE(storage_->bucketCount(), 2'000);
+  EXPECT_EQ(*storage_->get("key2"), "value2");
+
+  EXPECT_THROW(storage_->setMaxLoadFactor(0.0f), std::invalid_argument);
+}
+
+TEST(HashPolicyTest, Seeded) {
+  SeededHash first(42);
+  SeededHash same(42);
+  SeededHash other(43);
+
+  for (std::size_t len : {0, 1, 3, 8, 16, 17, 33, 64, 100, 256}) {
+    std::string key(len, 'k');
+    EXPECT_EQ(first(key), same(key));
+    EXPECT_NE(first(key), other(key));
+  }
+
+  EXPECT_NE(first("key1"), first("key2"));
+}
+
+TEST(HashPolicyTest, IntegerPolicies) {
+  MultiplyShiftHash first(42);
+  MultiplyShiftHash same(42);
+  EXPECT_EQ(first(uint64_t{1} << 40), same(uint64_t{1} << 40));
+
+  // Ключи с шагом 2^20 не должны собираться в одних корзинах.
+  std::set<std::size_t> buckets;
+  for (uint64_t i = 0; i < 1'024; ++i) {
+    buckets.insert(first(i << 20) & 1'023);
+  }
+  EXPECT_GT(buckets.size(), 512);
+
+  EXPECT_EQ(IdentityHash{}(uint32_t{7}), 7);
+
+  using Uuid = std::array<uint8_t, 16>;
+  Uuid uuid{1, 2, 3};
+  Uuid other{1, 2, 4};
+  EXPECT_NE(SeededHash(42)(uuid), SeededHash(42)(other));
+}
+
+TEST(HashPolicyTest, CustomPolicy) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"key1", "value1", 0}};
+  KVStorage<std::chrono::steady_clock, std::string, std::string,
+            KVTraits<std::string, std::string, StdHash>>
+      storage(data);
+
+  storage.set("key2", "value2", 0);
+  EXPECT_EQ(*storage.get("key1"), "value1");
+  EXPECT_EQ(*storage.get("key2"), "value2");
+}
+
+TEST(InternedKeysTest, MatchesPlainStorage) {
+  using Interned =
+      KVStorage<std::chrono::steady_clock, std::string, std::string,
+                KVTraits<std::string, std::string, SeededHash,
+                         InternedPrefixKeys<'/'>>>;
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"org/1/bucket/2/a", "1", 0},
+      {"org/1/bucket/2/b", "2", 0},
+      {"org/1/bucket/10/a", "3", 0},
+      {"org/1/", "4", 0},
+      {"plain", "5", 0},
+      {"", "6", 0},
+      {"org/1/bucket/2/a-very-long-object-name.json", "7", 0}};
+  std::vector<std::tuple<std::string, std::string, uint32_t>> copy = data;
+
+  Interned interned(data);
+  KVStorage<std::chrono::steady_clock> plain(copy);
+
+  for (const auto& key :
+       {"org/1/bucket/2/a", "org/1/", "plain", "", "org/1/bucket/2/",
+        "org/1/bucket/2/a-very-long-object-name.json", "org/1/bucket/2/c"}) {
+    EXPECT_EQ(interned.get(key), plain.get(key)) << key;
+  }
+
+  EXPECT_EQ(interned.getManySorted("", 100), plain.getManySorted("", 100));
+  EXPECT_EQ(interned.getManySorted("org/1/bucket/2", 3),
+            plain.getManySorted("org/1/bucket/2", 3));
+
+  interned.set("org/1/bucket/2/a", "updated", 0);
+  EXPECT_EQ(*interned.get("org/1/bucket/2/a"), "updated");
+
+  EXPECT_TRUE(interned.remove("org/1/bucket/2/a"));
+  EXPECT_TRUE(interned.remove("org/1/bucket/2/b"));
+  EXPECT_TRUE(
+      interned.remove("org/1/bucket/2/a-very-long-object-name.json"));
+  EXPECT_FALSE(interned.get("org/1/bucket/2/a").has_value());
+  EXPECT_EQ(interned.getManySorted("", 100).size(), 4);
+}
+
+namespace {
+
+std::string jsonBlob(int id, std::size_t size) {
+  std::string blob = "{\"items\":[";
+  for (int i = 0; blob.size() < size; ++i) {
+    blob += "{\"id\":" + std::to_string(id * 1'000 + i) +
+            ",\"name\":\"item-" + std::to_string(i % 17) +
+            "\",\"enabled\":true,\"tags\":[\"alpha\",\"beta\"]},";
+  }
+  blob += "]}";
+  return blob;
+}
+
+}  // namespace
+
+TEST_F(KVStorageUnitTest, Tombstones) {
+  storage_->setAbsent("key1", 0);
+  EXPECT_FALSE(storage_->get("key1").has_value());
+  EXPECT_EQ(storage_->lookup("key1").first, KeyState::kKnownAbsent);
+  EXPECT_EQ(storage_->getManySorted("", 10).size(), 2);
+
+  // set заменяет tombstone записью, remove удаляет tombstone.
+  storage_->set("key1", "value", 0);
+  EXPECT_EQ(storage_->lookup("key1"),
+            std::make_pair(KeyState::kPresent,
+                           std::optional<std::string>("value")));
+  EXPECT_EQ(storage_->tombstoneCount(), 0);
+
+  storage_->setAbsent("key4", 0);
+  EXPECT_TRUE(storage_->remove("key4"));
+  EXPECT_FALSE(storage_->remove("key4"));
+  EXPECT_EQ(storage_->lookup("key4").first, KeyState::kAbsent);
+}
+
+TEST(InternedKeysTest, Tombstones) {
+  using Storage =
+      KVStorage<std::chrono::steady_clock, std::string, std::string,
+                KVTraits<std::string, std::string, SeededHash,
+                         InternedPrefixKeys<>>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Storage storage(data);
+
+  std::string long_key(100, 'k');
+  storage.setAccessStats(AccessStatsOptions{.sample_rate = 1});
+  storage.set(long_key + "1", "value", 0);
+  storage.setAbsent(long_key + "1", 0);
+  storage.setAbsent(long_key + "2", 0);
+  EXPECT_EQ(storage.lookup(long_key + "1").first, KeyState::kKnownAbsent);
+  EXPECT_EQ(storage.lookup(long_key + "2").first, KeyState::kKnownAbsent);
+  storage.set(long_key + "2", "value", 0);
+  EXPECT_EQ(storage.get(long_key + "2"), "value");
+  EXPECT_EQ(storage.tombstoneCount(), 1);
+  EXPECT_EQ(storage.accessStats()->top_keys.size(), 2);
+}
+
+TEST(ValueCodecTest, RoundTrip) {
+  std::mt19937 rng(42);
+  std::string random(5'000, '\0');
+  for (char& c : random) {
+    c = static_cast<char>(rng());
+  }
+
+  ValueCompressor compressor;
+  compressor.setOptions(CompressionOptions{.min_size = 16});
+
+  for (const std::string& value :
+       {jsonBlob(1, 20'000), std::string(100'000, 'a'), random,
+        std::string("abcabcabcabcabcabcabcabcabc"), jsonBlob(2, 300)}) {
+    std::string stored = value;
+    ValueCodec codec = compressor.encode(stored);
+    EXPECT_EQ(compressor.decode(stored, codec), value);
+    if (value == random) {
+      EXPECT_EQ(codec, ValueCodec::kRaw);
+    } else {
+      EXPECT_EQ(codec, ValueCodec::kLz);
+      EXPECT_LT(stored.size(), value.size());
+    }
+  }
+}
+
+TEST(ValueCodecTest, Dictionary) {
+  std::vector<std::string> samples;
+  for (int i = 0; i < 100; ++i) {
+    samples.push_back(jsonBlob(i, 400));
+  }
+  auto dictionary = CompressionDictionary::train(samples);
+  EXPECT_FALSE(dictionary->bytes().empty());
+
+  ValueCompressor compressor;
+  compressor.setOptions(CompressionOptions{.dictionary = dictionary});
+
+  std::string value = jsonBlob(1'000, 200);
+  std::string stored = value;
+  ValueCodec codec = compressor.encode(stored);
+  EXPECT_EQ(codec, ValueCodec::kLzDictionary);
+  EXPECT_LT(stored.size() * 3, value.size());
+
+  // Старые значения читаются и после смены словаря.
+  compressor.setOptions(CompressionOptions{
+      .dictionary = CompressionDictionary::train(std::vector<std::string>{
+          std::string(1'000, 'x')})});
+  EXPECT_EQ(compressor.decode(stored, codec), value);
+
+  EXPECT_THROW(compressor.decode(stored.substr(0, stored.size() / 2), codec),
+               std::runtime_error);
+}
+
+TEST(ValueCodecTest, MatchesAcrossDictionaryEnd) {
+  // Словарь почти максимального размера: совпадение с его последними
+  // байтами продолжается в уже закодированную часть значения.
+  std::string bytes = jsonBlob(3, 60'000);
+  auto dictionary = std::make_shared<const CompressionDictionary>(bytes);
+  EXPECT_EQ(dictionary->matchTable().size(), std::size_t{1} << 12);
+
+  ValueCompressor compressor;
+  compressor.setOptions(CompressionOptions{.dictionary = dictionary});
+
+  std::string tail = bytes.substr(bytes.size() - 40);
+  for (const std::string& value :
+       {tail + tail + tail, tail + "0123456789" + tail.substr(0, 30),
+        jsonBlob(4, 500)}) {
+    std::string stored = value;
+    ValueCodec codec = compressor.encode(stored);
+    EXPECT_EQ(codec, ValueCodec::kLzDictionary);
+    EXPECT_LT(stored.size() * 2, value.size());
+    EXPECT_EQ(compressor.decode(stored, codec), value);
+  }
+}
+
+TEST_F(KVStorageUnitTest, Compression) {
+  storage_->setCompression(CompressionOptions{.min_size = 256});
+
+  std::string large = jsonBlob(7, 10'000);
+  storage_->set("large", large, 0);
+  storage_->set("small", "value", 0);
+  storage_->set("key1", jsonBlob(8, 1'000), 0);
+
+  EXPECT_EQ(*storage_->get("large"), large);
+  EXPECT_EQ(*storage_->get("small"), "value");
+  EXPECT_EQ(*storage_->get("key1"), jsonBlob(8, 1'000));
+
+  auto results = storage_->getManySorted("l", 1);
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].second, large);
+
+  storage_->setCompression(std::nullopt);
+  EXPECT_EQ(*storage_->get("large"), large);
+}
+
+TEST_F(KVStorageUnitTest, LargeValuesAreShared) {
+  storage_->setBlobOptions(BlobOptions{.min_size = 1'024});
+
+  std::string large(100'000, 'x');
+  storage_->set("large", large, 0);
+
+  auto first = storage_->getShared("large");
+  auto second = storage_->getShared("large");
+  ASSERT_TRUE(first.has_value() && second.has_value());
+  EXPECT_EQ(first->get(), second->get());
+  EXPECT_EQ(**first, large);
+  EXPECT_EQ(*storage_->get("large"), large);
+
+  // Читатель сохраняет старое значение после перезаписи и удаления.
+  storage_->set("large", std::string(50'000, 'y'), 0);
+  EXPECT_EQ(**first, large);
+  EXPECT_TRUE(storage_->remove("large"));
+  EXPECT_EQ(**second, large);
+
+  // Маленькие значения остаются в записи.
+  auto small = storage_->getShared("key1");
+  ASSERT_TRUE(small.has_value());
+  EXPECT_EQ(**small, "value1");
+  EXPECT_NE(small->get(), storage_->getShared("key1")->get());
+}
+
+TEST_F(KVStorageUnitTest, SetSharedValue) {
+  storage_->setBlobOptions(BlobOptions{.min_size = 1'024});
+
+  auto blob = std::make_shared<const std::string>(10'000, 'z');
+  storage_->set("blob", blob, 0);
+  EXPECT_EQ(storage_->getShared("blob")->get(), blob.get());
+
+  storage_->set("small", std::make_shared<const std::string>("abc"), 0);
+  EXPECT_EQ(*storage_->get("small"), "abc");
+
+  // Пустая ссылка отвергается и не трогает ни новую, ни старую запись.
+  EXPECT_THROW(storage_->set("null", ValueHandle(), 0),
+               std::invalid_argument);
+  EXPECT_FALSE(storage_->get("null").has_value());
+  ValueHandle moved = std::move(blob);
+  EXPECT_THROW(storage_->set("small", std::move(blob), 0),
+               std::invalid_argument);
+  EXPECT_EQ(*storage_->get("small"), "abc");
+}
+
+TEST_F(KVStorageUnitTest, BackgroundBlobFree) {
+  storage_->setBlobOptions(
+      BlobOptions{.min_size = 1'024, .background_free = true});
+
+  for (int i = 0; i < 100; ++i) {
+    storage_->set("large", std::string(10'000 + i, 'a'), 0);
+  }
+  auto handle = storage_->getShared("large");
+  EXPECT_TRUE(storage_->remove("large"));
+  storage_->setBlobOptions(std::nullopt);
+
+  ASSERT_TRUE(handle.has_value());
+  EXPECT_EQ((*handle)->size(), 10'099);
+}
+
+TEST(GenericTypesTest, IntegerKeys) {
+  std::vector<std::tuple<uint64_t, uint64_t, uint32_t>> data = {
+      {100, 1, 0}, {2, 2, 0}, {10, 3, 0}};
+  KVStorage<std::chrono::steady_clock, uint64_t, uint64_t> storage(data);
+
+  storage.set(7, 4, 0);
+  storage.set(2, 5, 0);
+  EXPECT_EQ(*storage.get(2), 5);
+  EXPECT_EQ(storage.get(3), std::nullopt);
+
+  // Числовой, а не лексикографический порядок.
+  std::vector<std::pair<uint64_t, uint64_t>> expected = {{7, 4}, {10, 3},
+                                                         {100, 1}};
+  EXPECT_EQ(storage.getManySorted(3, 10), expected);
+
+  EXPECT_TRUE(storage.remove(10));
+  EXPECT_FALSE(storage.remove(10));
+  EXPECT_EQ(storage.getManySorted(0, 10).size(), 3);
+}
+
+TEST(GenericTypesTest, FixedSizeKeysAndValues) {
+  using Uuid = std::array<uint8_t, 16>;
+  struct Point {
+    double x;
+    double y;
+  };
+
+  std::vector<std::tuple<Uuid, Point, uint32_t>> data = {
+      {Uuid{2}, Point{1.0, 2.0}, 0}, {Uuid{1}, Point{3.0, 4.0}, 0}};
+  KVStorage<std::chrono::steady_clock, Uuid, Point> storage(data);
+
+  storage.set(Uuid{1, 5}, Point{5.0, 6.0}, 0);
+  ASSERT_TRUE(storage.get(Uuid{2}).has_value());
+  EXPECT_EQ(storage.get(Uuid{2})->y, 2.0);
+
+  auto sorted = storage.getManySorted(Uuid{}, 10);
+  ASSERT_EQ(sorted.size(), 3);
+  EXPECT_EQ(sorted[0].first, Uuid{1});
+  EXPECT_EQ(sorted[1].first, (Uuid{1, 5}));
+  EXPECT_EQ(sorted[2].second.x, 1.0);
+}
+
+TEST(GenericTypesTest, IdentityHash) {
+  using Traits = KVTraits<int32_t, std::string, IdentityHash>;
+  std::vector<std::tuple<int32_t, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock, int32_t, std::string, Traits> storage(
+      data);
+
+  for (int32_t i = -1'000; i < 1'000; ++i) {
+    storage.set(i, std::to_string(i), 0);
+  }
+  EXPECT_EQ(*storage.get(-5), "-5");
+  EXPECT_EQ(storage.getManySorted(-1'000, 1).front().second, "-1000");
+}
+
+template <typename Storage>
+concept HasSortedIndex = requires(const Storage& storage) {
+  storage.getManySorted("", 1);
+};
+
+template <typename Storage>
+concept HasTtlIndex = requires(Storage& storage) {
+  storage.removeOneExpiredEntry();
+};
+
+TEST(FeaturesTest, HashOnly) {
+  using HashOnly =
+      KVStorage<std::chrono::steady_clock, Features<Sorted::No, Ttl::No>>;
+  static_assert(!HasSortedIndex<HashOnly> && !HasTtlIndex<HashOnly>);
+  static_assert(HasSortedIndex<KVStorage<std::chrono::steady_clock>>);
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"key1", "value1", 0}};
+  HashOnly storage(data);
+
+  storage.set("key2", "value2", 0);
+  EXPECT_EQ(*storage.get("key1"), "value1");
+  EXPECT_EQ(*storage.get("key2"), "value2");
+  EXPECT_THROW(storage.set("key3", "value3", 10), std::invalid_argument);
+  EXPECT_FALSE(storage.get("key3").has_value());
+
+  EXPECT_TRUE(storage.remove("key1"));
+  EXPECT_FALSE(storage.get("key1").has_value());
+}
+
+TEST(FeaturesTest, SortedWithoutTtl) {
+  using Traits = KVTraits<uint64_t, uint64_t, MultiplyShiftHash,
+                          PlainKeys<uint64_t>, Features<Sorted::Yes, Ttl::No>>;
+  std::vector<std::tuple<uint64_t, uint64_t, uint32_t>> data = {
+      {3, 30, 0}, {1, 10, 0}, {2, 20, 0}};
+  KVStorage<std::chrono::steady_clock, uint64_t, uint64_t, Traits> storage(
+      data);
+
+  EXPECT_TRUE(storage.remove(2));
+  std::vector<std::pair<uint64_t, uint64_t>> expected = {{1, 10}, {3, 30}};
+  EXPECT_EQ(storage.getManySorted(0, 10), expected);
+}
+
+TEST(NamespacesTest, QuotasEvictOldestWrites) {
+  using Storage =
+      KVStorage<std::chrono::steady_clock,
+                Features<Sorted::Yes, Ttl::Yes, Access::No, Namespaces::Yes>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"a/1", "old", 0}, {"b/1", "value", 0}};
+  Storage storage(data);
+
+  NamespaceId a = storage.createNamespace("a/", {.max_entries = 3});
+  NamespaceId b = storage.createNamespace("b/", {.max_bytes = 20});
+  EXPECT_THROW(storage.createNamespace("a/x/"), std::invalid_argument);
+  EXPECT_THROW(storage.createNamespace("b"), std::invalid_argument);
+  EXPECT_THROW(storage.createNamespace(""), std::invalid_argument);
+  EXPECT_THROW(storage.set(a, "b/2", "value", 0), std::invalid_argument);
+
+  // Записи из конструктора принадлежат kDefaultNamespace, пока их не
+  // перезапишут в пространство.
+  EXPECT_EQ(storage.namespaceUsage(kDefaultNamespace).entries, 2);
+  storage.set(a, "a/1", "v1", 0);
+  EXPECT_EQ(storage.namespaceUsage(kDefaultNamespace).entries, 1);
+
+  storage.set(a, "a/2", "v2", 0);
+  storage.set(a, "a/3", "v3", 0);
+  // Перезапись делает a/1 самой новой, поэтому вытесняется a/2.
+  storage.set(a, "a/1", "v1", 0);
+  storage.set(a, "a/4", "v4", 0);
+  EXPECT_FALSE(storage.get("a/2").has_value());
+  EXPECT_EQ(*storage.get("a/1"), "v1");
+  NamespaceUsage usage = storage.namespaceUsage(a);
+  EXPECT_EQ(usage.entries, 3);
+  EXPECT_EQ(usage.bytes, 3 * 5);
+  EXPECT_EQ(usage.evictions, 1);
+
+  // Квота в байтах: 3 + 7 = 10 байт на запись.
+  storage.set(b, "b/2", "1234567", 0);
+  storage.set(b, "b/3", "1234567", 0);
+  storage.set(b, "b/4", "1234567", 0);
+  EXPECT_FALSE(storage.get("b/2").has_value());
+  EXPECT_EQ(storage.namespaceUsage(b).bytes, 20);
+  EXPECT_THROW(storage.set(b, "b/5", std::string(18, 'x'), 0),
+               std::length_error);
+  EXPECT_EQ(*storage.get("b/3"), "1234567");
+
+  // Удаление, tombstone и протухание тоже уменьшают учет.
+  EXPECT_TRUE(storage.remove("a/3"));
+  storage.setAbsent("a/4", 0);
+  EXPECT_EQ(storage.namespaceUsage(a).entries, 1);
+
+  storage.setNamespaceQuota(b, {.max_entries = 1});
+  EXPECT_FALSE(storage.get("b/3").has_value());
+  EXPECT_EQ(*storage.get("b/4"), "1234567");
+  EXPECT_EQ(storage.namespaceUsage(b).evictions, 2);
+}
+
+TEST(NamespacesTest, DropIsImmediateAndReapedLazily) {
+  using Storage =
+      KVStorage<std::chrono::steady_clock,
+                Features<Sorted::Yes, Ttl::Yes, Access::No, Namespaces::Yes>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"b/1", "value", 0}};
+  Storage storage(data);
+  NamespaceId a = storage.createNamespace("a/", {.max_entries = 100});
+  for (int i = 0; i < 10; ++i) {
+    storage.set(a, "a/" + std::to_string(i), "old", 0);
+  }
+
+  storage.dropNamespace(a);
+  EXPECT_EQ(storage.droppedEntries(), 10);
+  EXPECT_EQ(storage.namespaceUsage(a).entries, 0);
+  EXPECT_FALSE(storage.get("a/1").has_value());
+  EXPECT_EQ(storage.lookup("a/1").first, KeyState::kAbsent);
+  std::vector<std::pair<std::string, std::string>> expected = {
+      {"b/1", "value"}};
+  EXPECT_EQ(storage.getManySorted("", 100), expected);
+
+  // Новое поколение пространства: перезапись удаленного ключа снова видна,
+  // remove удаленного ключа освобождает его, но дает false.
+  storage.set(a, "a/1", "new", 0);
+  storage.set(a, "a/20", "new", 0);
+  EXPECT_FALSE(storage.remove("a/2"));
+  EXPECT_EQ(*storage.get("a/1"), "new");
+  EXPECT_EQ(storage.droppedEntries(), 8);
+  EXPECT_EQ(storage.namespaceUsage(a).entries, 2);
+
+  // Повторное удаление до очистки добавляет записи к уже удаленным.
+  storage.dropNamespace(a);
+  EXPECT_EQ(storage.droppedEntries(), 10);
+  storage.set(a, "a/30", "newest", 0);
+
+  EXPECT_TRUE(storage.reapDropped(4));
+  EXPECT_EQ(storage.droppedEntries(), 6);
+  EXPECT_FALSE(storage.reapDropped(100));
+  EXPECT_EQ(storage.droppedEntries(), 0);
+  expected = {{"a/30", "newest"}, {"b/1", "value"}};
+  EXPECT_EQ(storage.getManySorted("", 100), expected);
+  EXPECT_EQ(storage.namespaceUsage(a).entries, 1);
+  EXPECT_EQ(storage.namespaceUsage(kDefaultNamespace).entries, 1);
+}
+
+TEST(NamespacesTest, AccountingMatchesScanUnderChurn) {
+  using Storage =
+      KVStorage<std::chrono::steady_clock, std::string, std::string,
+                KVTraits<std::string, std::string, SeededHash,
+                         InternedPrefixKeys<'/'>,
+                         Features<Sorted::Yes, Ttl::Yes, Access::No,
+                                  Namespaces::Yes>>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Storage storage(data);
+
+  std::vector<std::string> prefixes = {"t0/", "t1/", "t2/", "t3/"};
+  std::vector<NamespaceId> ids;
+  for (const auto& prefix : prefixes) {
+    ids.push_back(storage.createNamespace(
+        prefix, {.max_entries = 50, .max_bytes = 1'000}));
+  }
+
+  std::mt19937 random(7);
+  for (int i = 0; i < 20'000; ++i) {
+    std::size_t tenant = random() % prefixes.size();
+    std::string key =
+        prefixes[tenant] + "dir/" + std::to_string(random() % 200);
+    if (random() % 1'000 == 0) {
+      storage.dropNamespace(ids[tenant]);
+    } else if (random() % 8 == 0) {
+      storage.reapDropped(random() % 20);
+    } else if (random() % 4 == 0) {
+      storage.remove(key);
+    } else {
+      storage.set(ids[tenant], key, std::string(random() % 30, 'v'), 0);
+    }
+  }
+
+  for (std::size_t tenant = 0; tenant < prefixes.size(); ++tenant) {
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+    for (const auto& [key, value] :
+         storage.getManySorted(prefixes[tenant], 1'000)) {
+      if (!key.starts_with(prefixes[tenant])) {
+        break;
+      }
+      ++entries;
+      bytes += key.size() + value.size();
+    }
+    NamespaceUsage usage = storage.namespaceUsage(ids[tenant]);
+    EXPECT_EQ(usage.entries, entries);
+    EXPECT_EQ(usage.bytes, bytes);
+    EXPECT_LE(usage.entries, 50);
+    EXPECT_LE(usage.bytes, 1'000);
+    EXPECT_GT(usage.evictions, 0);
+  }
+}
+
+namespace {
+
+// Значение поля field из строки вида "field1=value1;field2=value2".
+std::optional<std::string> fieldOf(std::string_view value,
+                                   std::string_view field) {
+  for (std::size_t begin = 0; begin < value.size();) {
+    std::size_t end = std::min(value.find(';', begin), value.size());
+    std::string_view pair = value.substr(begin, end - begin);
+    if (pair.starts_with(field) && pair.size() > field.size() &&
+        pair[field.size()] == '=') {
+      return std::string(pair.substr(field.size() + 1));
+    }
+    begin = end + 1;
+  }
+  return std::nullopt;
+}
+
+}  // namespace
+
+TEST_F(KVStorageUnitTest, SecondaryIndex) {
+  storage_->set("user1", "status=active;city=paris", 0);
+  storage_->set("user2", "status=banned;city=rome", 0);
+  storage_->set("user3", "status=active;city=rome", 0);
+  storage_->addIndex("status", [](const std::string& value) {
+    return fieldOf(value, "status");
+  });
+  storage_->addIndex("city", [](const std::string& value) {
+    return fieldOf(value, "city");
+  });
+  EXPECT_THROW(storage_->addIndex("city", [](const std::string&) {
+    return std::optional<std::string>();
+  }),
+               std::invalid_argument);
+  EXPECT_THROW(storage_->queryIndex("age", "1", "2"), std::invalid_argument);
+
+  using Entries = std::vector<std::pair<std::string, std::string>>;
+  EXPECT_EQ(storage_->queryIndex("status", "active", "active"),
+            (Entries{{"user1", "status=active;city=paris"},
+                     {"user3", "status=active;city=rome"}}));
+  EXPECT_EQ(storage_->queryIndex("city", "r", "s").size(), 2);
+  EXPECT_EQ(storage_->queryIndex("status", "active", "active", 1).size(), 1);
+
+  // Перезапись переносит запись между атрибутами, remove удаляет ее.
+  storage_->set("user1", "status=banned;city=paris", 0);
+  storage_->set("user4", "city=oslo", 0);
+  EXPECT_TRUE(storage_->remove("user3"));
+  EXPECT_TRUE(storage_->queryIndex("status", "active", "active").empty());
+  EXPECT_EQ(storage_->queryIndex("status", "", "z").size(), 2);
+  EXPECT_EQ(storage_->queryIndex("city", "", "z").size(), 3);
+
+  EXPECT_TRUE(storage_->removeIndex("city"));
+  EXPECT_FALSE(storage_->removeIndex("city"));
+  storage_->set("user5", "status=active", 0);
+  EXPECT_EQ(storage_->queryIndex("status", "active", "active"),
+            (Entries{{"user5", "status=active"}}));
+}
+
+TEST(SecondaryIndexTest, QueryMatchesScanUnderChurn) {
+  using Storage = KVStorage<std::chrono::steady_clock, uint64_t, uint64_t>;
+  std::vector<std::tuple<uint64_t, uint64_t, uint32_t>> data;
+  Storage storage(data);
+  // Атрибут — последняя цифра значения; нечетные значения не индексируются.
+  storage.addIndex("digit", [](const uint64_t& value) {
+    return value % 2 == 0 ? std::make_optional(std::to_string(value % 10))
+                          : std::nullopt;
+  });
+
+  std::mt19937 random(3);
+  std::map<uint64_t, uint64_t> reference;
+  for (int i = 0; i < 20'000; ++i) {
+    uint64_t key = random() % 500;
+    if (random() % 4 == 0) {
+      EXPECT_EQ(storage.remove(key), reference.erase(key) == 1);
+    } else {
+      uint64_t value = random() % 1'000;
+      storage.set(key, value, 0);
+      reference[key] = value;
+    }
+  }
+
+  for (std::string digit : {"0", "2", "4", "6", "8"}) {
+    std::vector<std::pair<uint64_t, uint64_t>> expected;
+    for (auto [key, value] : reference) {
+      if (value % 2 == 0 && std::to_string(value % 10) == digit) {
+        expected.emplace_back(key, value);
+      }
+    }
+    EXPECT_EQ(storage.queryIndex("digit", digit, digit), expected) << digit;
+  }
+  EXPECT_TRUE(storage.queryIndex("digit", "1", "1").empty());
+}
+
+namespace {
+
+struct RecordingRelocate {
+  std::unordered_map<uint64_t, const void*>* handles;
+
+  template <typename Leaf>
+  void operator()(uint64_t value, Leaf* leaf) const {
+    (*handles)[value] = leaf;
+  }
+};
+
+}  // namespace
+
+TEST(BlockedBloomFilterTest, NoFalseNegatives) {
+  constexpr int kKeys = 100'000;
+  BlockedBloomFilter filter(kKeys, BloomFilterOptions{});
+  SeededHash hash;
+  for (int i = 0; i < kKeys; ++i) {
+    filter.insert(hash("key" + std::to_string(i)));
+  }
+
+  int false_positives = 0;
+  for (int i = 0; i < kKeys; ++i) {
+    EXPECT_TRUE(filter.mayContain(hash("key" + std::to_string(i))));
+    false_positives += filter.mayContain(hash("miss" + std::to_string(i)));
+  }
+  EXPECT_LT(false_positives, kKeys / 50);
+}
+
+TEST(BlockedBloomFilterTest, StorageMatchesReferenceUnderChurn) {
+  using Traits = KVTraits<int32_t, std::string, IdentityHash>;
+  std::vector<std::tuple<int32_t, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock, int32_t, std::string, Traits> storage(
+      data);
+  storage.setMissFilter(BloomFilterOptions{.bits_per_key = 4});
+  std::unordered_map<int32_t, std::string> reference;
+
+  // Вставки перестраивают фильтр при росте, удаления — при накоплении
+  // удаленных ключей.
+  std::mt19937 rng(3);
+  for (int i = 0; i < 50'000; ++i) {
+    int32_t key = static_cast<int32_t>(rng() % 8'000);
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(storage.remove(key), reference.erase(key) == 1);
+    } else {
+      storage.set(key, std::to_string(i), 0);
+      reference[key] = std::to_string(i);
+    }
+    int32_t probe = static_cast<int32_t>(rng() % 10'000);
+    auto it = reference.find(probe);
+    EXPECT_EQ(storage.get(probe), it != reference.end()
+                                      ? std::make_optional(it->second)
+                                      : std::nullopt);
+  }
+
+  EXPECT_GT(storage.missFilterBytes(), 0);
+  storage.setMissFilter(std::nullopt);
+  EXPECT_EQ(storage.missFilterBytes(), 0);
+  for (const auto& [key, value] : reference) {
+    EXPECT_EQ(storage.get(key), value);
+  }
+}
+
+TEST(AccessStatsTest, HyperLogLogAccuracy) {
+  HyperLogLog distinct(12);
+  SeededHash hash;
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 100'000; ++i) {
+      distinct.add(finalizeHash(hash("key" + std::to_string(i))));
+    }
+  }
+  EXPECT_NEAR(distinct.estimate(), 100'000, 5'000);
+
+  distinct.clear();
+  for (int i = 0; i < 100; ++i) {
+    distinct.add(finalizeHash(hash("key" + std::to_string(i))));
+  }
+  EXPECT_NEAR(distinct.estimate(), 100, 5);
+}
+
+TEST(AccessStatsTest, StorageReportsDistinctAndTopKeys) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> storage(data);
+  storage.setAccessStats(AccessStatsOptions{.sample_rate = 4, .top_k = 16});
+
+  // 5 горячих ключей получают по 4'000 обращений, 20'000 холодных — по
+  // одному.
+  std::mt19937 rng(5);
+  for (int i = 0; i < 40'000; ++i) {
+    if (i % 2 == 0) {
+      storage.get("hot" + std::to_string(rng() % 5));
+    } else {
+      storage.set("cold" + std::to_string(i / 2), "value", 0);
+    }
+  }
+
+  auto stats = storage.accessStats();
+  ASSERT_TRUE(stats.has_value());
+  EXPECT_EQ(stats->operations, 40'000);
+  EXPECT_NEAR(stats->distinct_keys, 20'005, 1'000);
+  ASSERT_GE(stats->top_keys.size(), 5);
+  std::set<std::string> top;
+  for (int i = 0; i < 5; ++i) {
+    top.insert(stats->top_keys[i].key);
+    EXPECT_GE(stats->top_keys[i].count, 3'000);
+  }
+  EXPECT_EQ(top, (std::set<std::string>{"hot0", "hot1", "hot2", "hot3",
+                                        "hot4"}));
+  EXPECT_GE(storage.accessFrequency("hot0"), 3'000);
+  EXPECT_LE(storage.accessFrequency("cold7"), 1'000);
+
+  storage.resetAccessStats();
+  EXPECT_EQ(storage.accessStats()->operations, 0);
+  storage.setAccessStats(std::nullopt);
+  EXPECT_FALSE(storage.accessStats().has_value());
+}
+
+TEST(BPlusTreeTest, MatchesStdSet) {
+  // Маленькие узлы, чтобы дерево было глубоким.
+  using Tree = BPlusTree<uint64_t, std::less<>, RecordingRelocate, 256>;
+  std::unordered_map<uint64_t, const void*> handles;
+  Tree tree(std::less<>(), RecordingRelocate{&handles});
+  std::set<uint64_t> expected;
+
+  std::mt19937_64 rng(17);
+  for (int i = 0; i < 30'000; ++i) {
+    uint64_t value = rng() % 5'000;
+    if (expected.insert(value).second) {
+      handles[value] = tree.insert(value, orderedPrefix(value));
+    } else {
+      tree.erase(
+          static_cast<Tree::handle>(const_cast<void*>(handles.at(value))),
+          value);
+      expected.erase(value);
+      handles.erase(value);
+    }
+
+    if (i % 1'000 == 0) {
+      ASSERT_TRUE(std::equal(tree.begin(), tree.end(), expected.begin(),
+                             expected.end()));
+      uint64_t key = rng() % 5'100;
+      auto it = tree.lower_bound(key, orderedPrefix(key));
+      auto expected_it = expected.lower_bound(key);
+      if (expected_it == expected.end()) {
+        EXPECT_EQ(it, tree.end());
+      } else {
+        ASSERT_NE(it, tree.end());
+        EXPECT_EQ(*it, *expected_it);
+      }
+
+      std::size_t rank = std::distance(expected.begin(), expected_it);
+      EXPECT_EQ(tree.rank(key, orderedPrefix(key)), rank);
+      if (expected_it != expected.end()) {
+        EXPECT_EQ(*tree.select(rank), *expected_it);
+      }
+      EXPECT_EQ(tree.select(expected.size()), tree.end());
+    }
+  }
+  EXPECT_EQ(tree.size(), expected.size());
+  std::size_t index = 0;
+  for (uint64_t value : expected) {
+    ASSERT_EQ(*tree.select(index), value);
+    ASSERT_EQ(tree.rank(value, orderedPrefix(value)), index);
+    ++index;
+  }
+
+  for (uint64_t value : expected) {
+    tree.erase(static_cast<Tree::handle>(const_cast<void*>(handles.at(value))),
+               value);
+  }
+  EXPECT_TRUE(tree.empty());
+  EXPECT_EQ(tree.begin(), tree.end());
+}
+
+TEST(BPlusTreeTest, InsertBackThenChurn) {
+  using Tree = BPlusTree<uint64_t, std::less<>, RecordingRelocate, 256>;
+  std::unordered_map<uint64_t, const void*> handles;
+  Tree tree(std::less<>(), RecordingRelocate{&handles});
+  std::set<uint64_t> expected;
+
+  for (uint64_t value = 0; value < 10'000; value += 2) {
+    handles[value] = tree.insertBack(value, orderedPrefix(value));
+    expected.insert(value);
+  }
+  ASSERT_TRUE(
+      std::equal(tree.begin(), tree.end(), expected.begin(), expected.end()));
+
+  // Обычные вставки и удаления по handle поверх дерева из insertBack.
+  std::mt19937_64 rng(5);
+  for (int i = 0; i < 10'000; ++i) {
+    uint64_t value = rng() % 10'000;
+    if (expected.insert(value).second) {
+      handles[value] = tree.insert(value, orderedPrefix(value));
+    } else {
+      tree.erase(
+          static_cast<Tree::handle>(const_cast<void*>(handles.at(value))),
+          value);
+      expected.erase(value);
+      handles.erase(value);
+    }
+  }
+  ASSERT_TRUE(
+      std::equal(tree.begin(), tree.end(), expected.begin(), expected.end()));
+  std::size_t index = 0;
+  for (uint64_t value : expected) {
+    ASSERT_EQ(*tree.select(index), value);
+    ASSERT_EQ(tree.rank(value, orderedPrefix(value)), index);
+    ++index;
+  }
+}
+
+TEST(BPlusTreeTest, OrderedPrefix) {
+  EXPECT_LT(orderedPrefix(std::string_view("ab")),
+            orderedPrefix(std::string_view("b")));
+  EXPECT_EQ(orderedPrefix(std::string_view("abcdefgh1")),
+            orderedPrefix(std::string_view("abcdefgh2")));
+  EXPECT_LT(orderedPrefix(std::string_view("\x7f")),
+            orderedPrefix(std::string_view("\x80")));
+  EXPECT_LT(orderedPrefix(int64_t{-5}), orderedPrefix(int64_t{3}));
+  EXPECT_LT(orderedPrefix(uint32_t{5}), orderedPrefix(uint32_t{70'000}));
+}
+
+TEST(BPlusTreeTest, StorageMatchesStdSetIndex) {
+  using Tree = KVStorage<std::chrono::steady_clock,
+                         Features<Sorted::BPlusTree, Ttl::Yes>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Tree tree(data);
+  KVStorage<std::chrono::steady_clock> set(data);
+
+  std::mt19937 rng(3);
+  for (int i = 0; i < 20'000; ++i) {
+    // Общие префиксы длиннее 8 байт проверяют сравнение после префикса.
+    std::string key = "shared/prefix/" + std::to_string(rng() % 3'000);
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(tree.remove(key), set.remove(key));
+    } else {
+      tree.set(key, std::to_string(i), 0);
+      set.set(key, std::to_string(i), 0);
+    }
+  }
+
+  EXPECT_EQ(tree.getManySorted("", 5'000), set.getManySorted("", 5'000));
+  for (const char* key : {"shared/prefix/15", "shared/prefix/2", "a", "z"}) {
+    EXPECT_EQ(tree.getManySorted(key, 50), set.getManySorted(key, 50));
+  }
+}
+
+namespace {
+
+template <typename Storage>
+void checkRangeAggregates(bool with_rank) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Storage storage(data);
+  std::map<std::string, std::string> reference;
+
+  std::mt19937 random(23);
+  auto randomKey = [&] { return "key" + std::to_string(random() % 3'000); };
+  for (int i = 0; i < 10'000; ++i) {
+    std::string key = randomKey();
+    if (random() % 3 == 0) {
+      storage.remove(key);
+      reference.erase(key);
+    } else {
+      std::string value(random() % 40, 'v');
+      storage.set(key, value, 0);
+      reference[key] = value;
+    }
+  }
+
+  for (int i = 0; i < 200; ++i) {
+    std::string begin = randomKey();
+    std::string end = randomKey();
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+    for (auto it = reference.lower_bound(begin);
+         it != reference.end() && it->first < end; ++it) {
+      ++count;
+      bytes += it->first.size() + it->second.size();
+    }
+    EXPECT_EQ(storage.countRange(begin, end), count) << begin << " " << end;
+    EXPECT_EQ(storage.bytesInRange(begin, end), bytes);
+
+    if constexpr (requires { storage.rank(begin); }) {
+      ASSERT_TRUE(with_rank);
+      std::size_t rank = std::distance(reference.begin(),
+                                       reference.lower_bound(begin));
+      EXPECT_EQ(storage.rank(begin), rank);
+      if (rank < reference.size()) {
+        EXPECT_EQ(storage.select(rank), reference.lower_bound(begin)->first);
+      }
+    }
+  }
+  if constexpr (requires { storage.select(0); }) {
+    EXPECT_EQ(storage.select(reference.size()), std::nullopt);
+  }
+}
+
+}  // namespace
+
+TEST(RangeAggregatesTest, BPlusTreeIndex) {
+  checkRangeAggregates<KVStorage<std::chrono::steady_clock,
+                                 Features<Sorted::BPlusTree, Ttl::Yes>>>(
+      true);
+}
+
+TEST(RangeAggregatesTest, SetIndex) {
+  checkRangeAggregates<KVStorage<std::chrono::steady_clock>>(false);
+}
+
+TEST(SampleTest, UniformOverLiveKeys) {
+  KVStorage<std::chrono::steady_clock> storage({});
+  std::mt19937_64 rng(7);
+  EXPECT_TRUE(storage.sample(10, rng).empty());
+
+  // Удаления оставляют в таблице пустые корзины и цепочки разной длины.
+  for (int i = 0; i < 200; ++i) {
+    storage.set("key" + std::to_string(i), std::string(i % 7, 'v'), 0);
+  }
+  for (int i = 0; i < 200; i += 3) {
+    storage.remove("key" + std::to_string(i));
+  }
+
+  constexpr std::size_t kSamples = 133 * 1'000;
+  std::map<std::string, std::size_t> counts;
+  for (const auto& item : storage.sample(kSamples, rng)) {
+    int i = std::stoi(item.key.substr(3));
+    EXPECT_NE(i % 3, 0);
+    EXPECT_EQ(item.bytes, item.key.size() + i % 7);
+    EXPECT_EQ(item.ttl, 0);
+    ++counts[item.key];
+  }
+  // Ожидается по 1'000 на ключ при стандартном отклонении около 32.
+  ASSERT_EQ(counts.size(), 133);
+  for (const auto& [key, count] : counts) {
+    EXPECT_GT(count, 850) << key;
+    EXPECT_LT(count, 1'150) << key;
+  }
+}
+
+TEST(SampleTest, UniformAcrossCallsWithLongChains) {
+  KVStorage<std::chrono::steady_clock> storage({});
+  // Цепочки в среднем по 8 записей: оценка их длины, найденная одним
+  // вызовом, нужна следующим.
+  storage.setMaxLoadFactor(8);
+  for (int i = 0; i < 400; ++i) {
+    storage.set("key" + std::to_string(i), "value", 0);
+  }
+
+  std::mt19937_64 rng(11);
+  std::map<std::string, std::size_t> counts;
+  for (int call = 0; call < 100'000; ++call) {
+    for (const auto& item : storage.sample(4, rng)) {
+      ++counts[item.key];
+    }
+  }
+  // Ожидается по 1'000 на ключ при стандартном отклонении около 32.
+  ASSERT_EQ(counts.size(), 400);
+  for (const auto& [key, count] : counts) {
+    EXPECT_GT(count, 850) << key;
+    EXPECT_LT(count, 1'150) << key;
+  }
+}
+
+namespace {
+
+// Отдает поток маленькими кусками и считает прочитанные байты.
+class ChunkedReader : public StreamReader {
+ public:
+  explicit ChunkedReader(std::string_view in) : in_(in) {}
+
+  std::size_t read(std::span<char> buffer) override {
+    std::size_t size = std::min({buffer.size(), in_.size() - pos_,
+                                 std::size_t{7}});
+    std::copy_n(in_.data() + pos_, size, buffer.data());
+    pos_ += size;
+    return size;
+  }
+
+  std::size_t consumed() const { return pos_; }
+
+ private:
+  std::string_view in_;
+  std::size_t pos_ = 0;
+};
+
+template <typename Storage>
+std::string exportToString(const Storage& storage) {
+  std::string stream;
+  StringStreamWriter writer(stream);
+  storage.exportStream(writer);
+  return stream;
+}
+
+}  // namespace
+
+TEST(StreamTest, RoundTripAcrossIndexes) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock,
+            Features<Sorted::BPlusTree, Ttl::Yes>>
+      source(data);
+  source.setCompression(CompressionOptions{});
+  source.setBlobOptions(BlobOptions{.min_size = 100'000});
+  std::map<std::string, std::string> reference;
+  std::mt19937 rng(29);
+  for (int i = 0; i < 5'000; ++i) {
+    std::string key = "key/" + std::to_string(rng() % 20'000);
+    // Несжимаемые, сжатые и blob-значения.
+    std::string value = std::to_string(rng());
+    if (i % 100 == 0) {
+      value = std::string(i % 200 == 0 ? 200'000 : 5'000, 'z');
+    }
+    source.set(key, value, i % 3 == 0 ? 1'000 : 0);
+    reference[key] = value;
+  }
+  source.remove("key/1");
+  reference.erase("key/1");
+  std::vector<std::pair<std::string, std::string>> expected(
+      reference.begin(), reference.end());
+
+  std::string stream = exportToString(source);
+  KVStorage<std::chrono::steady_clock,
+            Features<Sorted::BPlusTree, Ttl::Yes>>
+      tree(data);
+  KVStorage<std::chrono::steady_clock> set(data);
+  KVStorage<std::chrono::steady_clock, Features<Sorted::No, Ttl::Yes>>
+      unsorted(data);
+  StringStreamReader tree_reader(stream);
+  StringStreamReader set_reader(stream);
+  ChunkedReader unsorted_reader(stream);
+  EXPECT_EQ(tree.importStream(tree_reader), expected.size());
+  EXPECT_EQ(set.importStream(set_reader), expected.size());
+  EXPECT_EQ(unsorted.importStream(unsorted_reader), expected.size());
+
+  EXPECT_EQ(tree.getManySorted("", 10'000), expected);
+  EXPECT_EQ(set.getManySorted("", 10'000), expected);
+  for (const auto& [key, value] : expected) {
+    ASSERT_EQ(unsorted.get(key), value);
+  }
+  // Дерево, собранное insertBack, остается рабочим индексом.
+  EXPECT_EQ(tree.countRange("key/2", "key/3"),
+            set.countRange("key/2", "key/3"));
+  EXPECT_EQ(tree.select(tree.rank("key/5")), set.getManySorted("key/5", 1)
+                                                 .front()
+                                                 .first);
+  tree.set("key/00", "new", 0);
+  EXPECT_TRUE(tree.remove(expected.back().first));
+  EXPECT_EQ(tree.getManySorted("key/00", 1).front().first, "key/00");
+  EXPECT_EQ(tree.countRange("", "~"), expected.size());
+
+  // Записи, загруженные до обрыва, остаются во всех индексах.
+  KVStorage<std::chrono::steady_clock,
+            Features<Sorted::BPlusTree, Ttl::Yes>>
+      partial(data);
+  StringStreamReader partial_reader(
+      std::string_view(stream).substr(0, stream.size() / 2));
+  EXPECT_THROW(partial.importStream(partial_reader), std::runtime_error);
+  auto loaded = partial.getManySorted("", 10'000);
+  EXPECT_FALSE(loaded.empty());
+  for (const auto& [key, value] : loaded) {
+    ASSERT_TRUE(partial.remove(key));
+  }
+  EXPECT_FALSE(partial.removeOneExpiredEntry().has_value());
+
+  // В непустое хранилище записи вливаются, как set.
+  KVStorage<std::chrono::steady_clock> merged(data);
+  merged.set("key/1", "kept", 0);
+  merged.set(expected.front().first, "overwritten", 0);
+  StringStreamReader merged_reader(stream);
+  EXPECT_EQ(merged.importStream(merged_reader), expected.size());
+  EXPECT_EQ(merged.get("key/1"), "kept");
+  EXPECT_EQ(merged.get(expected.front().first), expected.front().second);
+  EXPECT_EQ(merged.getManySorted("", 10'000).size(), expected.size() + 1);
+}
+
+TEST(StreamTest, DetectsCorruptionAndStopsAtEnd) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> source(data);
+  for (int i = 0; i < 5'000; ++i) {
+    source.set("key" + std::to_string(i), std::string(i % 13, 'v'), 0);
+  }
+  std::string stream = exportToString(source);
+
+  // Каждое место потока покрыто контрольной суммой, обрыв — числом записей.
+  for (std::size_t pos = 0; pos < stream.size(); pos += 613) {
+    std::string damaged = stream;
+    damaged[pos] ^= 0x10;
+    KVStorage<std::chrono::steady_clock> target(data);
+    StringStreamReader reader(damaged);
+    EXPECT_THROW(target.importStream(reader), std::runtime_error) << pos;
+  }
+  for (std::size_t size : {std::size_t{0}, std::size_t{10}, std::size_t{24},
+                           stream.size() / 2, stream.size() - 1}) {
+    KVStorage<std::chrono::steady_clock> target(data);
+    StringStreamReader reader(std::string_view(stream).substr(0, size));
+    EXPECT_THROW(target.importStream(reader), std::runtime_error) << size;
+  }
+
+  // Данные после потока (например, журнал изменений) не читаются.
+  std::string payload = stream + "log tail";
+  KVStorage<std::chrono::steady_clock> target(data);
+  ChunkedReader reader(payload);
+  EXPECT_EQ(target.importStream(reader), 5'000);
+  EXPECT_EQ(reader.consumed(), stream.size());
+  EXPECT_EQ(target.get("key4999"), std::string(4'999 % 13, 'v'));
+}
+
+TEST(StreamTest, ImportRespectsDefaultNamespaceQuota) {
+  using Storage =
+      KVStorage<std::chrono::steady_clock,
+                Features<Sorted::Yes, Ttl::Yes, Access::No, Namespaces::Yes>>;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  Storage source(data);
+  for (int i = 0; i < 100; ++i) {
+    source.set("key" + std::to_string(100 + i), "value", 1'000);
+  }
+  std::string stream = exportToString(source);
+
+  // Квота вытесняет записи прямо во время загрузки.
+  Storage target(data);
+  target.setNamespaceQuota(kDefaultNamespace, {.max_entries = 10});
+  StringStreamReader reader(stream);
+  EXPECT_EQ(target.importStream(reader), 100);
+  EXPECT_EQ(target.namespaceUsage(kDefaultNamespace).entries, 10);
+  EXPECT_EQ(target.getManySorted("", 100).front().first, "key190");
+  EXPECT_TRUE(target.remove("key199"));
+  EXPECT_FALSE(target.removeOneExpiredEntry().has_value());
+}
+
+namespace {
+
+// Записывает value в little-endian по offset и пересчитывает CRC32C
+// checksummed байт с checksummed_from, лежащую сразу за ними: так
+// поддельные размеры проходят проверку контрольной суммы.
+void forgeField(std::string& stream, std::size_t offset, uint64_t value,
+                int bytes, std::size_t checksummed_from,
+                std::size_t checksummed) {
+  for (int i = 0; i < bytes; ++i) {
+    stream[offset + i] = static_cast<char>(value >> (8 * i));
+  }
+  uint32_t crc = stream_detail::crc32c(
+      std::string_view(stream).substr(checksummed_from, checksummed));
+  for (int i = 0; i < 4; ++i) {
+    stream[checksummed_from + checksummed + i] =
+        static_cast<char>(crc >> (8 * i));
+  }
+}
+
+}  // namespace
+
+TEST(StreamTest, ForgedSizesDoNotAllocate) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"a", "1", 0}, {"b", "2", 0}, {"c", "3", 0}};
+  KVStorage<std::chrono::steady_clock> source(data);
+  std::string stream = exportToString(source);
+
+  // Заголовок обещает 2^40 записей: резерв KeyIndex остается маленьким.
+  std::string forged_hint = stream;
+  forgeField(forged_hint, 12, uint64_t{1} << 40, 8, 0, 20);
+  KVStorage<std::chrono::steady_clock> target({});
+  StringStreamReader reader(forged_hint);
+  EXPECT_EQ(target.importStream(reader), 3);
+  EXPECT_EQ(target.get("b"), "2");
+  EXPECT_LE(target.bucketCount(), 256 * 1'024);
+
+  // Кадр обещает 4 GiB данных, а поток на нем кончается: ошибка обрыва, а
+  // не попытка выделить 4 GiB.
+  std::string forged_frame = stream.substr(0, 24 + 16);
+  forgeField(forged_frame, 24, UINT32_MAX, 4, 24, 12);
+  KVStorage<std::chrono::steady_clock> truncated({});
+  StringStreamReader frame_reader(forged_frame);
+  EXPECT_THROW(truncated.importStream(frame_reader), std::runtime_error);
+}
+
+TEST(StreamTest, RejectsUnsortedKeys) {
+  std::string stream;
+  StringStreamWriter writer(stream);
+  RecordStreamWriter records(writer, 2);
+  records.add("b", "1", 0);
+  records.add("a", "2", 0);
+  records.finish();
+
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock> target(data);
+  StringStreamReader reader(stream);
+  EXPECT_THROW(target.importStream(reader), std::runtime_error);
+}
+
+TEST(BPlusTreeTest, SignedIntegerKeys) {
+  using Traits = KVTraits<int64_t, int64_t, MultiplyShiftHash,
+                          PlainKeys<int64_t>, Features<Sorted::BPlusTree>>;
+  std::vector<std::tuple<int64_t, int64_t, uint32_t>> data;
+  KVStorage<std::chrono::steady_clock, int64_t, int64_t, Traits> storage(data);
+
+  for (int64_t i = -500; i < 500; ++i) {
+    storage.set(i * 7, i, 0);
+  }
+  auto sorted = storage.getManySorted(-10, 3);
+  std::vector<std::pair<int64_t, int64_t>> expected = {
+      {-7, -1}, {0, 0}, {7, 1}};
+  EXPECT_EQ(sorted, expected);
+
+  // Целые ключи и значения переносятся потоком своими байтами.
+  std::string stream = exportToString(storage);
+  KVStorage<std::chrono::steady_clock, int64_t, int64_t, Traits> copy(data);
+  StringStreamReader reader(stream);
+  EXPECT_EQ(copy.importStream(reader), 1'000);
+  EXPECT_EQ(copy.getManySorted(-10, 3), expected);
+  EXPECT_EQ(copy.rank(0), 500);
+}
+
+TEST(ConcurrentSkipListTest, MatchesStdSet) {
+  ConcurrentSkipList<std::string> list;
+  std::set<std::string> expected;
+
+  std::mt19937 rng(5);
+  for (int i = 0; i < 20'000; ++i) {
+    std::string key = "k" + std::to_string(rng() % 2'000);
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(list.erase(key), expected.erase(key) == 1);
+    } else {
+      EXPECT_EQ(list.insert(key), expected.insert(key).second);
+    }
+  }
+  EXPECT_EQ(list.size(), expected.size());
+  EXPECT_TRUE(list.contains(*expected.begin()));
+  EXPECT_FALSE(list.contains("missing"));
+
+  std::vector<std::string> scanned;
+  list.scan("k5", 100, [&](const std::string& key) { scanned.push_back(key); });
+  std::vector<std::string> expected_scan(expected.lower_bound("k5"),
+                                         expected.end());
+  expected_scan.resize(std::min<std::size_t>(expected_scan.size(), 100));
+  EXPECT_EQ(scanned, expected_scan);
+}
+
+TEST(ConcurrentSkipListTest, ConcurrentInsertEraseScan) {
+  constexpr int kThreads = 4;
+  constexpr uint64_t kOwnKeys = 2'000;
+  ConcurrentSkipList<uint64_t> list;
+
+  // Каждый поток вставляет свои ключи, удаляет нечетные и одновременно
+  // борется с остальными за общие ключи и сканирует.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937_64 rng(t);
+      for (uint64_t i = 0; i < kOwnKeys; ++i) {
+        uint64_t own = 1'000'000 * (t + 1) + i;
+        EXPECT_TRUE(list.insert(own));
+        uint64_t shared = rng() % 64;
+        if (rng() % 2 == 0) {
+          list.insert(shared);
+        } else {
+          list.erase(shared);
+        }
+        if (i % 2 == 1) {
+          EXPECT_TRUE(list.erase(own));
+        }
+        if (i % 100 == 0) {
+          uint64_t previous = 0;
+          list.scan(rng() % 5'000'000, 50, [&](uint64_t key) {
+            EXPECT_GE(key, previous);
+            previous = key;
+          });
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 0; t < kThreads; ++t) {
+    for (uint64_t i = 0; i < kOwnKeys; ++i) {
+      EXPECT_EQ(list.contains(1'000'000 * (t + 1) + i), i % 2 == 0);
+    }
+  }
+  std::size_t count = 0;
+  list.scan(0, 1'000'000, [&](uint64_t) { ++count; });
+  EXPECT_EQ(count, list.size());
+}
+
+namespace {
+
+// Сравнивает ConcurrentKVStorage с KVStorage на случайных операциях.
+// Значения бывают от пустых до 100 байт.
+template <typename Storage>
+void expectMatchesKVStorage() {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"a", "1", 0}, {"b", "2", 1'000'000}, {"c", "3", 0}};
+  auto copy = data;
+  Storage storage(data);
+  KVStorage<std::chrono::steady_clock> expected(copy);
+
+  std::mt19937 rng(7);
+  for (int i = 0; i < 20'000; ++i) {
+    std::string key = "k" + std::to_string(rng() % 3'000);
+    switch (rng() % 4) {
+      case 0:
+        EXPECT_EQ(storage.remove(key), expected.remove(key));
+        break;
+      case 1:
+        EXPECT_EQ(storage.get(key), expected.get(key));
+        break;
+      default:
+        uint32_t ttl = rng() % 2 == 0 ? 0 : 1'000'000;
+        std::string value(rng() % 100, 'x');
+        value += std::to_string(i);
+        storage.set(key, value, ttl);
+        expected.set(key, value, ttl);
+    }
+  }
+
+  EXPECT_EQ(storage.getManySorted("", 10'000),
+            expected.getManySorted("", 10'000));
+  EXPECT_EQ(storage.getManySorted("k5", 7), expected.getManySorted("k5", 7));
+  EXPECT_EQ(storage.size(), storage.getManySorted("", 10'000).size());
+  EXPECT_FALSE(storage.removeOneExpiredEntry().has_value());
+}
+
+}  // namespace
+
+TEST(ConcurrentKVStorageTest, MatchesKVStorage) {
+  expectMatchesKVStorage<ConcurrentKVStorage<std::chrono::steady_clock>>();
+}
+
+TEST(ConcurrentKVStorageTest, InlineValuesMatchKVStorage) {
+  expectMatchesKVStorage<
+      ConcurrentKVStorage<std::chrono::steady_clock, SeededHash, 64>>();
+}
+
+TEST(ConcurrentKVStorageTest, ParallelWritersAndReaders) {
+  constexpr int kWriters = 4;
+  constexpr int kKeys = 2'000;
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  ConcurrentKVStorage<std::chrono::steady_clock> storage(data);
+
+  // Писатели меняют свои ключи и борются за общие, читатели проверяют, что
+  // значения и getManySorted согласованы.
+  std::atomic<bool> done{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kWriters; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      for (int i = 0; i < kKeys; ++i) {
+        std::string own = "w" + std::to_string(t) + "-" + std::to_string(i);
+        storage.set(own, own, 0);
+        storage.set("shared" + std::to_string(rng() % 32), own, 0);
+        if (i % 3 == 0) {
+          EXPECT_TRUE(storage.remove(own));
+        }
+        storage.remove("shared" + std::to_string(rng() % 32));
+      }
+    });
+  }
+  threads.emplace_back([&] {
+    std::mt19937 rng(42);
+    while (!done.load()) {
+      std::string key = "w" + std::to_string(rng() % kWriters) + "-" +
+                        std::to_string(rng() % kKeys);
+      if (auto value = storage.get(key)) {
+        EXPECT_EQ(*value, key);
+      }
+      auto sorted = storage.getManySorted(key, 20);
+      for (std::size_t i = 1; i < sorted.size(); ++i) {
+        EXPECT_LT(sorted[i - 1].first, sorted[i].first);
+      }
+    }
+  });
+  for (int t = 0; t < kWriters; ++t) {
+    threads[t].join();
+  }
+  done.store(true);
+  threads.back().join();
+
+  for (int t = 0; t < kWriters; ++t) {
+    for (int i = 0; i < kKeys; ++i) {
+      std::string own = "w" + std::to_string(t) + "-" + std::to_string(i);
+      EXPECT_EQ(storage.get(own).has_value(), i % 3 != 0);
+    }
+  }
+  EXPECT_EQ(storage.size(), storage.getManySorted("", 100'000).size());
+}
+
+TEST(ConcurrentKVStorageTest, InlineValuesAreNotTorn) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"key", "a", 0}};
+  ConcurrentKVStorage<std::chrono::steady_clock, SeededHash, 64> storage(
+      data);
+
+  // Писатель чередует значения разной длины, inline и в версии; читатели
+  // не должны увидеть смесь двух значений.
+  std::atomic<bool> done{false};
+  std::thread writer([&] {
+    for (int i = 0; i < 50'000; ++i) {
+      std::size_t size = 1 + i % 80;
+      storage.set("key", std::string(size, "abc"[i % 3]), 0);
+    }
+    done.store(true);
+  });
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 3; ++r) {
+    readers.emplace_back([&] {
+      while (!done.load()) {
+        auto value = storage.get("key");
+        ASSERT_TRUE(value.has_value());
+        ASSERT_FALSE(value->empty());
+        EXPECT_EQ(*value, std::string(value->size(), value->front()));
+      }
+    });
+  }
+  writer.join();
+  for (auto& reader : readers) {
+    reader.join();
+  }
+}
+
+TEST(HotKeyReplicasTest, PromoteUpdateRemove) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"hot", "value", 0}, {"cold", "value", 0}};
+  ConcurrentKVStorage<std::chrono::steady_clock> storage(data);
+  storage.setHotKeyReplication(
+      HotKeyOptions{.replicas = 4, .sample_rate = 1, .threshold = 4});
+
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(storage.get("hot"), "value");
+  }
+  EXPECT_EQ(storage.get("cold"), "value");
+  EXPECT_EQ(storage.hotKeyCount(), 1);
+
+  storage.set("hot", "new", 0);
+  EXPECT_EQ(storage.get("hot"), "new");
+
+  // Значение, не помещающееся в реплику, снимает с ключа статус горячего.
+  std::string large(100, 'x');
+  storage.set("hot", large, 0);
+  EXPECT_EQ(storage.hotKeyCount(), 0);
+  EXPECT_EQ(storage.get("hot"), large);
+
+  storage.set("hot", "small", 0);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(storage.get("hot"), "small");
+  }
+  EXPECT_EQ(storage.hotKeyCount(), 1);
+  EXPECT_TRUE(storage.remove("hot"));
+  EXPECT_EQ(storage.hotKeyCount(), 0);
+  EXPECT_FALSE(storage.get("hot").has_value());
+  storage.set("hot", "again", 0);
+  EXPECT_EQ(storage.get("hot"), "again");
+}
+
+TEST(HotKeyReplicasTest, MatchesKVStorageUnderChurn) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  auto copy = data;
+  ConcurrentKVStorage<std::chrono::steady_clock, SeededHash, 64> storage(data);
+  KVStorage<std::chrono::steady_clock> expected(copy);
+  // Низкий порог и небольшое число ключей: ключи постоянно становятся
+  // горячими и вытесняются.
+  storage.setHotKeyReplication(
+      HotKeyOptions{.replicas = 2, .sample_rate = 1, .threshold = 2});
+
+  std::mt19937 rng(11);
+  for (int i = 0; i < 50'000; ++i) {
+    std::string key = "k" + std::to_string(rng() % 40);
+    switch (rng() % 8) {
+      case 0:
+        EXPECT_EQ(storage.remove(key), expected.remove(key));
+        break;
+      case 1:
+      case 2: {
+        std::string value(rng() % 80, 'v');
+        value += std::to_string(i);
+        storage.set(key, value, 0);
+        expected.set(key, value, 0);
+        break;
+      }
+      default:
+        EXPECT_EQ(storage.get(key), expected.get(key));
+    }
+  }
+  EXPECT_GT(storage.hotKeyCount(), 0);
+}
+
+TEST(HotKeyReplicasTest, ConcurrentReadersSeeWholeValues) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data = {
+      {"hot", "a", 0}};
+  ConcurrentKVStorage<std::chrono::steady_clock> storage(data);
+  storage.setHotKeyReplication(
+      HotKeyOptions{.replicas = 2, .sample_rate = 4, .threshold = 2});
+  // Ключ становится горячим до начала записи: иначе быстрый писатель может
+  // закончить раньше, чем читатели наберут выборку, и реплики не проверятся.
+  while (storage.hotKeyCount() == 0) {
+    storage.get("hot");
+  }
+
+  std::atomic<bool> done{false};
+  std::thread writer([&] {
+    for (int i = 0; i < 20'000; ++i) {
+      storage.set("hot", std::string(1 + i % 60, "abc"[i % 3]), 0);
+    }
+    done.store(true);
+  });
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 3; ++r) {
+    readers.emplace_back([&] {
+      while (!done.load()) {
+        auto value = storage.get("hot");
+        ASSERT_TRUE(value.has_value());
+        EXPECT_EQ(*value, std::string(value->size(), value->front()));
+      }
+    });
+  }
+  writer.join();
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(storage.hotKeyCount(), 1);
+  EXPECT_EQ(storage.get("hot"),
+            std::string(1 + 19'999 % 60, "abc"[19'999 % 3]));
+}
+
+namespace {
+
+// Медленное хранилище в памяти: считает загрузки и запоминает пачки записей.
+class FakeBackend : public KVBackend {
+ public:
+  std::optional<std::string> load(std::string_view key) {
+    ++loads;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::lock_guard lock(mutex);
+    auto it = data.find(std::string(key));
+    return it != data.end() ? std::make_optional(it->second) : std::nullopt;
+  }
+
+  void write(std::span<const BackendWrite> batch) override {
+    std::lock_guard lock(mutex);
+    batches.push_back(batch.size());
+    for (const auto& [key, value] : batch) {
+      if (value.has_value()) {
+        data[key] = *value;
+      } else {
+        data.erase(key);
+      }
+    }
+  }
+
+  std::atomic<int> loads{0};
+  std::mutex mutex;
+  std::unordered_map<std::string, std::string> data;
+  std::vector<std::size_t> batches;
+};
+
+}  // namespace
+
+TEST(ReadThroughTest, ConcurrentMissesLoadOnce) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  ConcurrentKVStorage<std::chrono::steady_clock> storage(data);
+  FakeBackend backend;
+  backend.data["key"] = "value";
+  auto loader = [&](std::string_view key) { return backend.load(key); };
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&] {
+      EXPECT_EQ(storage.getOrLoad("key", loader, 0), "value");
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(backend.loads, 1);
+  EXPECT_EQ(storage.get("key"), "value");
+  EXPECT_EQ(storage.getOrLoad("key", loader, 0), "value");
+  EXPECT_EQ(backend.loads, 1);
+}
+
+TEST(ReadThroughTest, MissesAndErrorsAreNotCached) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  ConcurrentKVStorage<std::chrono::steady_clock> storage(data);
+  FakeBackend backend;
+  auto loader = [&](std::string_view key) { return backend.load(key); };
+
+  EXPECT_EQ(storage.getOrLoad("key", loader, 0), std::nullopt);
+  EXPECT_EQ(storage.size(), 0);
+
+  auto failing = [](std::string_view) -> std::optional<std::string> {
+    throw std::runtime_error("backend is down");
+  };
+  EXPECT_THROW(storage.getOrLoad("key", failing, 0), std::runtime_error);
+
+  backend.data["key"] = "value";
+  EXPECT_EQ(storage.getOrLoad("key", loader, 0), "value");
+  EXPECT_EQ(backend.loads, 2);
+}
+
+TEST(ReadThroughTest, LoadDoesNotOverwriteConcurrentSet) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  ConcurrentKVStorage<std::chrono::steady_clock> storage(data);
+  auto loader = [&](std::string_view key) -> std::optional<std::string> {
+    storage.set(std::string(key), "newer", 0);
+    return "stale";
+  };
+
+  EXPECT_EQ(storage.getOrLoad("key", loader, 0), "newer");
+  EXPECT_EQ(storage.get("key"), "newer");
+}
+
+TEST(ReadThroughTest, WriteBehindBatchesAndCoalesces) {
+  std::vector<std::tuple<std::string, std::string, uint32_t>> data;
+  ConcurrentKVStorage<std::chrono::steady_clock> storage(data);
+  auto backend = std::make_shared<FakeBackend>();
+  backend->data["stale"] = "value";
+  storage.setWriteBehind(
+      backend, WriteBehindOptions{.max_batch = 4,
+                                  .max_delay = std::chrono::hours(1)});
+
+  for (int i = 0; i < 3; ++i) {
+    storage.set("key1", "value" + std::to_string(i), 0);
+  }
+  storage.set("key2", "value", 0);
+  storage.remove("key2");
+  storage.remove("stale");
+  storage.flushWriteBehind();
+
+  {
+    std::lock_guard lock(backend->mutex);
+    EXPECT_EQ(backend->data,
+              (std::unordered_map<std::string, std::string>{
+                  {"key1", "value2"}}));
+    EXPECT_EQ(backend->batches, std::vector<std::size_t>{3});
+  }
+
+  // Полная пачка уходит, не дожидаясь max_delay.
+  for (int i = 0; i < 4; ++i) {
+    storage.set("full" + std::to_string(i), "value", 0);
+  }
+  while (true) {
+    std::lock_guard lock(backend->mutex);
+    if (backend->data.size() == 5) {
+      break;
+    }
+  }
+
+  // Выключение дописывает накопленное.
+  storage.set("last", "value", 0);
+  storage.setWriteBehind(nullptr);
+  std::lock_guard lock(backend->mutex);
+  EXPECT_EQ(backend->data.size(), 6);
+}